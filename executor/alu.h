@@ -0,0 +1,270 @@
+/** @file
+ * Portable ALU instructions for Halifax.
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+/**
+ * The ALU, shift and bit instructions in plain C++.  Every
+ * instruction is a class with two static templates, instantiated
+ * for unsigned char, unsigned short and unsigned operands:
+ *
+ *  - result(dst, src, efl) returns the new value of the destination,
+ *  - flags(dst, src, result, efl) returns the arithmetic flags
+ *    afterwards, taking the ones the instruction keeps from efl.
+ *
+ * Flags the architecture leaves undefined are either kept or cleared.
+ */
+struct Alu
+{
+  enum {
+    CF    = 1 <<  0,
+    PF    = 1 <<  2,
+    AF    = 1 <<  4,
+    ZF    = 1 <<  6,
+    SF    = 1 <<  7,
+    OF    = 1 << 11,
+    ARITH = CF | PF | AF | ZF | SF | OF,
+  };
+
+  /**
+   * Which flags an instruction writes.  Instructions that write all
+   * of them can be evaluated lazily.
+   */
+  enum Flags {
+    FLAGS_NONE,
+    FLAGS_SOME,
+    FLAGS_ALL,
+  };
+
+  template<typename T> static unsigned bits() { return 8 * sizeof(T); }
+  template<typename T> static unsigned msb(unsigned value) { return (value >> (bits<T>() - 1)) & 1; }
+
+  /**
+   * SF, ZF and PF of a result.
+   */
+  template<typename T>
+  static unsigned szp(T r)
+  {
+    return (msb<T>(r) ? SF : 0) | (r ? 0 : ZF) | (__builtin_parity(r & 0xff) ? 0 : PF);
+  }
+
+  template<typename T>
+  static unsigned add_flags(T d, T s, T r, bool cf)
+  {
+    return szp(r) | (cf ? CF : 0) | ((d ^ s ^ r) & AF) | (msb<T>((d ^ r) & (s ^ r)) ? OF : 0);
+  }
+
+  template<typename T>
+  static unsigned sub_flags(T d, T s, T r, bool cf)
+  {
+    return szp(r) | (cf ? CF : 0) | ((d ^ s ^ r) & AF) | (msb<T>((d ^ s) & (d ^ r)) ? OF : 0);
+  }
+
+  /**
+   * The shift count, masked like the hardware does.
+   */
+  static unsigned count(unsigned s) { return s & 0x1f; }
+
+  /**
+   * The bit a bit instruction works on.
+   */
+  template<typename T> static T bit(T s) { return T(1) << (s & (bits<T>() - 1)); }
+};
+
+
+#define ALU_OP(NAME, WRITES, STORES, EXCHANGES)				\
+  struct Alu##NAME {							\
+    static const Alu::Flags FLAGS = Alu::WRITES;			\
+    enum { STORE = STORES, EXCHANGE = EXCHANGES };			\
+    template<typename T> static T result(T d, T s, unsigned efl);	\
+    template<typename T> static unsigned flags(T d, T s, T r, unsigned efl); \
+  }
+
+ALU_OP(Add,  FLAGS_ALL,  1, 0);
+ALU_OP(Or,   FLAGS_ALL,  1, 0);
+ALU_OP(Adc,  FLAGS_SOME, 1, 0);
+ALU_OP(Sbb,  FLAGS_SOME, 1, 0);
+ALU_OP(And,  FLAGS_ALL,  1, 0);
+ALU_OP(Sub,  FLAGS_ALL,  1, 0);
+ALU_OP(Xor,  FLAGS_ALL,  1, 0);
+ALU_OP(Cmp,  FLAGS_ALL,  0, 0);
+ALU_OP(Test, FLAGS_ALL,  0, 0);
+ALU_OP(Xadd, FLAGS_ALL,  1, 1);
+ALU_OP(Inc,  FLAGS_SOME, 1, 0);
+ALU_OP(Dec,  FLAGS_SOME, 1, 0);
+ALU_OP(Neg,  FLAGS_ALL,  1, 0);
+ALU_OP(Not,  FLAGS_NONE, 1, 0);
+ALU_OP(Rol,  FLAGS_SOME, 1, 0);
+ALU_OP(Ror,  FLAGS_SOME, 1, 0);
+ALU_OP(Rcl,  FLAGS_SOME, 1, 0);
+ALU_OP(Rcr,  FLAGS_SOME, 1, 0);
+ALU_OP(Shl,  FLAGS_SOME, 1, 0);
+ALU_OP(Shr,  FLAGS_SOME, 1, 0);
+ALU_OP(Sar,  FLAGS_SOME, 1, 0);
+ALU_OP(Bt,   FLAGS_SOME, 0, 0);
+ALU_OP(Bts,  FLAGS_SOME, 1, 0);
+ALU_OP(Btr,  FLAGS_SOME, 1, 0);
+ALU_OP(Btc,  FLAGS_SOME, 1, 0);
+#undef ALU_OP
+
+#define ALU_RESULT(NAME) template<typename T> T Alu##NAME::result(T d, T s, unsigned efl)
+#define ALU_FLAGS(NAME)  template<typename T> unsigned Alu##NAME::flags(T d, T s, T r, unsigned efl)
+
+ALU_RESULT(Add)  { return d + s; }
+ALU_FLAGS(Add)   { return Alu::add_flags(d, s, r, r < d); }
+ALU_RESULT(Adc)  { return d + s + (efl & Alu::CF); }
+ALU_FLAGS(Adc)   { return Alu::add_flags(d, s, r, efl & Alu::CF ? r <= d : r < d); }
+ALU_RESULT(Sub)  { return d - s; }
+ALU_FLAGS(Sub)   { return Alu::sub_flags(d, s, r, d < s); }
+ALU_RESULT(Sbb)  { return d - s - (efl & Alu::CF); }
+ALU_FLAGS(Sbb)   { return Alu::sub_flags(d, s, r, efl & Alu::CF ? d <= s : d < s); }
+ALU_RESULT(Cmp)  { return d - s; }
+ALU_FLAGS(Cmp)   { return Alu::sub_flags(d, s, r, d < s); }
+ALU_RESULT(Xadd) { return d + s; }
+ALU_FLAGS(Xadd)  { return Alu::add_flags(d, s, r, r < d); }
+
+// AF is undefined for the logical operations.
+ALU_RESULT(And)  { return d & s; }
+ALU_FLAGS(And)   { return Alu::szp(r); }
+ALU_RESULT(Or)   { return d | s; }
+ALU_FLAGS(Or)    { return Alu::szp(r); }
+ALU_RESULT(Xor)  { return d ^ s; }
+ALU_FLAGS(Xor)   { return Alu::szp(r); }
+ALU_RESULT(Test) { return d & s; }
+ALU_FLAGS(Test)  { return Alu::szp(r); }
+
+// INC and DEC keep CF. NEG and NOT have no source.
+ALU_RESULT(Inc)  { return d + 1; }
+ALU_FLAGS(Inc)   { return Alu::add_flags(d, T(1), r, efl & Alu::CF); }
+ALU_RESULT(Dec)  { return d - 1; }
+ALU_FLAGS(Dec)   { return Alu::sub_flags(d, T(1), r, efl & Alu::CF); }
+ALU_RESULT(Neg)  { return -d; }
+ALU_FLAGS(Neg)   { return Alu::sub_flags(T(0), d, r, d != 0); }
+ALU_RESULT(Not)  { return ~d; }
+ALU_FLAGS(Not)   { return efl & Alu::ARITH; }
+
+/*
+ * A shift or rotate by zero changes nothing, not even the flags.  OF
+ * is only defined for a count of one and AF not at all, but we
+ * compute them for every count like newer CPUs do.
+ */
+ALU_RESULT(Shl)
+{
+  unsigned c = Alu::count(s);
+  return c < Alu::bits<T>() ? T(unsigned(d) << c) : 0;
+}
+ALU_FLAGS(Shl)
+{
+  unsigned c = Alu::count(s);
+  if (!c) return efl & Alu::ARITH;
+  bool cf = c <= Alu::bits<T>() && (unsigned(d) >> (Alu::bits<T>() - c)) & 1;
+  return Alu::szp(r) | (cf ? Alu::CF : 0) | (Alu::msb<T>(r) ^ cf ? Alu::OF : 0);
+}
+
+ALU_RESULT(Shr)  { return unsigned(d) >> Alu::count(s); }
+ALU_FLAGS(Shr)
+{
+  unsigned c = Alu::count(s);
+  if (!c) return efl & Alu::ARITH;
+  bool cf = (unsigned(d) >> (c - 1)) & 1;
+  return Alu::szp(r) | (cf ? Alu::CF : 0) | (Alu::msb<T>(d) ? Alu::OF : 0);
+}
+
+ALU_RESULT(Sar)
+{
+  unsigned shift = 32 - Alu::bits<T>();
+  return (int(unsigned(d) << shift) >> shift) >> Alu::count(s);
+}
+ALU_FLAGS(Sar)
+{
+  unsigned c = Alu::count(s);
+  if (!c) return efl & Alu::ARITH;
+  unsigned shift = 32 - Alu::bits<T>();
+  bool cf = ((int(unsigned(d) << shift) >> shift) >> (c - 1)) & 1;
+  return Alu::szp(r) | (cf ? Alu::CF : 0);
+}
+
+// Rotates only write CF and OF.
+ALU_RESULT(Rol)
+{
+  unsigned c = Alu::count(s) % Alu::bits<T>();
+  return c ? T(d << c | d >> (Alu::bits<T>() - c)) : d;
+}
+ALU_FLAGS(Rol)
+{
+  if (!Alu::count(s)) return efl & Alu::ARITH;
+  unsigned cf = r & 1;
+  return (efl & (Alu::ARITH & ~(Alu::CF | Alu::OF))) | (cf ? Alu::CF : 0) | (Alu::msb<T>(r) ^ cf ? Alu::OF : 0);
+}
+
+ALU_RESULT(Ror)
+{
+  unsigned c = Alu::count(s) % Alu::bits<T>();
+  return c ? T(d >> c | d << (Alu::bits<T>() - c)) : d;
+}
+ALU_FLAGS(Ror)
+{
+  if (!Alu::count(s)) return efl & Alu::ARITH;
+  unsigned cf = Alu::msb<T>(r);
+  return (efl & (Alu::ARITH & ~(Alu::CF | Alu::OF))) | (cf ? Alu::CF : 0) | (cf ^ Alu::msb<T>(r << 1) ? Alu::OF : 0);
+}
+
+/*
+ * RCL and RCR rotate through CF, so they work on bits+1 bits.
+ */
+template<typename T>
+static unsigned long long alu_rotate_carry(T d, unsigned c, unsigned efl, bool left)
+{
+  unsigned width = Alu::bits<T>() + 1;
+  unsigned long long value = (efl & Alu::CF ? 1ULL << Alu::bits<T>() : 0) | d;
+  c = Alu::count(c) % width;
+  if (!c) return value;
+  if (!left) c = width - c;
+  return (value << c | value >> (width - c)) & ((1ULL << width) - 1);
+}
+
+ALU_RESULT(Rcl) { return alu_rotate_carry(d, s, efl, true); }
+ALU_FLAGS(Rcl)
+{
+  if (!Alu::count(s)) return efl & Alu::ARITH;
+  unsigned cf = alu_rotate_carry(d, s, efl, true) >> Alu::bits<T>();
+  return (efl & (Alu::ARITH & ~(Alu::CF | Alu::OF))) | (cf ? Alu::CF : 0) | (Alu::msb<T>(r) ^ cf ? Alu::OF : 0);
+}
+
+ALU_RESULT(Rcr) { return alu_rotate_carry(d, s, efl, false); }
+ALU_FLAGS(Rcr)
+{
+  if (!Alu::count(s)) return efl & Alu::ARITH;
+  unsigned cf = alu_rotate_carry(d, s, efl, false) >> Alu::bits<T>();
+  return (efl & (Alu::ARITH & ~(Alu::CF | Alu::OF))) | (cf ? Alu::CF : 0) | (Alu::msb<T>(r) ^ Alu::msb<T>(r << 1) ? Alu::OF : 0);
+}
+
+/*
+ * The bit instructions only define CF.  The bit offset was already
+ * added to the address of a memory operand.
+ */
+#define ALU_BIT(NAME, EXPR)						\
+  ALU_RESULT(NAME) { return EXPR; }					\
+  ALU_FLAGS(NAME)  { return (efl & Alu::ARITH & ~Alu::CF) | (d & Alu::bit(s) ? Alu::CF : 0); }
+ALU_BIT(Bt,  d)
+ALU_BIT(Bts, d | Alu::bit(s))
+ALU_BIT(Btr, d & ~Alu::bit(s))
+ALU_BIT(Btc, d ^ Alu::bit(s))
+#undef ALU_BIT
+
+#undef ALU_RESULT
+#undef ALU_FLAGS
@@ -126,7 +126,8 @@ def filter_chars(snippet, op_size, flags):
 		("[EDX]", ("%%dl","%%dx", "%%edx")[op_size]),
 		("[IMM]", filter(lambda x: x in ["IMM1", "IMM2", "IMMO", "CONST1"], flags) and "1" or "0"),
 		("[OP1]", "OP1" in flags and "1" or "0"),
-		("[IMMU]", "IMM1" in flags and "unsigned char" or "unsigned")]:
+		("[IMMU]", "IMM1" in flags and "unsigned char" or "unsigned"),
+		("[T]", ("unsigned char", "unsigned short", "unsigned")[op_size])]:
 	snippet = map(lambda x: x.replace(m, n), snippet)
     return snippet
 
@@ -165,7 +166,7 @@ def generate_functions(name, flags, snippet, enc, functions, l2):
     l2.extend(filter(lambda x: x, map(lambda x: x[0] in flags and x[1] or "", additions)))
 
     # flag handling
-    f2 = ["LOADFLAGS", "SAVEFLAGS", "MODRM", "BYTE", "DIRECTION", "READONLY", "ASM", "RMW", "LOCK", "MOFS", "BITS", "QWORD"]
+    f2 = ["LOADFLAGS", "SAVEFLAGS", "MODRM", "BYTE", "DIRECTION", "READONLY", "ASM", "RMW", "LOCK", "MOFS", "BITS", "QWORD", "LAZYFLAGS"]
     if "SKIPMODRM" in flags:                    f2.remove("MODRM")
     if "IMM1" in flags and "BITS" in flags:     f2.remove("BITS")
     if name in ["cltd"]:                        f2.remove("DIRECTION")
@@ -315,18 +316,18 @@ opcodes += [
 opcodes += [(x, ["ASM", "EAX", "NO_OS", x in ["aaa", "aas"] and "LOADFLAGS", "SAVEFLAGS"],
 	     ["#ifdef __x86_64__\n\tLogging::panic(\"Unable to execute '" + x + "'\\n\");\n#else\n\tasm volatile(\"mov (%%\" VMM_EXPAND(VMM_REG(cx)) \"), %%eax;" + x + ";mov %%eax, (%%\" VMM_EXPAND(VMM_REG(cx)) \")\" : \"+d\"(tmp_src), \"+c\"(tmp_dst) : : \"eax\");\n#endif\n"])
 	    for x in ["aaa", "aas", "daa", "das"]]
-opcodes += [(x, ["ASM", x in ["cmp", "test"] and "READONLY",
-	   		x in ["adc", "sbb"] and "LOADFLAGS",
-			x not in ["mov"] and "SAVEFLAGS",
-			x not in ["mov", "cmp",  "test"] and "RMW",
-			],
-	     ["mov[bwl] (%\" VMM_EXPAND(VMM_REG(dx)) \"), [EAX]", "[lock] %s[bwl] [EAX],(%%\" VMM_EXPAND(VMM_REG(cx)) \")"%x])
-	    for x in ["mov", "add", "adc", "sub", "sbb", "and", "or", "xor", "cmp", "test"]]
-opcodes += [(x, ["ASM", x not in ["not"] and "SAVEFLAGS", x in ["dec", "inc"] and "LOADFLAGS", "RMW"],
-	     ["[lock] " + x + "[bwl] (%\" VMM_EXPAND(VMM_REG(cx)) \")"])
+# The ALU, shift and bit instructions are templates from alu.h.
+def alu(x, src = "tmp_src"):
+    return ["InstructionCache::alu<Alu%s, [T]>(cache, %s, tmp_dst)"%(x.capitalize(), src)]
+opcodes += [("mov", ["ASM"], ["mov[bwl] (%\" VMM_EXPAND(VMM_REG(dx)) \"), [EAX]", "mov[bwl] [EAX],(%\" VMM_EXPAND(VMM_REG(cx)) \")"])]
+opcodes += [(x, [x in ["cmp", "test"] and "READONLY",
+			x not in ["cmp",  "test"] and "RMW",
+			x not in ["adc", "sbb"] and "LAZYFLAGS",
+			], alu(x))
+	    for x in ["add", "adc", "sub", "sbb", "and", "or", "xor", "cmp", "test"]]
+opcodes += [(x, [x in ["neg", "not"] and "LAZYFLAGS", "RMW"], alu(x, "tmp_dst"))
 	    for x in ["inc", "dec", "neg", "not"]]
-opcodes += [(x, ["ASM", "CONST1", x in ["rcr", "rcl"] and "LOADFLAGS", "SAVEFLAGS", "RMW"],
-	     ["xchg %\" VMM_EXPAND(VMM_REG(dx)) \", %\" VMM_EXPAND(VMM_REG(cx)) \"","movb (%\" VMM_EXPAND(VMM_REG(cx)) \"),%cl", "%s[bwl] %%cl, (%%\" VMM_EXPAND(VMM_REG(dx)) \")"%x]) for x in ["rol", "ror", "rcl", "rcr", "shl", "shr", "sar"]]
+opcodes += [(x, ["CONST1", "RMW"], alu(x)) for x in ["rol", "ror", "rcl", "rcr", "shl", "shr", "sar"]]
 opcodes += [(x, ["ASM", "SAVEFLAGS", "DIRECTION"], ["%s[bwl] (%%\" VMM_EXPAND(VMM_REG(dx)) \"), [EAX]"%x, "mov [EAX], (%\" VMM_EXPAND(VMM_REG(cx)) \")"]) for x in ["bsf", "bsr"]]
 ccflags = map(lambda x: compile_and_disassemble(".byte %#x, 0x00"%x, file, fdict)[2].split()[0][1:], range(0x70, 0x80))
 for i in range(len(ccflags)):
@@ -338,7 +339,7 @@ for i in range(len(ccflags)):
     opcodes += [("j"+ccflag,    ["JMP",   "ASM", "LOADFLAGS", "DIRECTION"],
 		 ['__attribute__((regparm(3))) int (*foo)(InstructionCache *, void *) = helper_JMP_static<[os]>',
 		  'asm volatile ("j%s 1f;call %%P0; 1:" : : "i"(foo))'%(ccflags[i ^ 1])])]
-opcodes += [(x, [x[-1] == "b" and "BYTE", "HAS_OS"], [
+opcodes += [(x, [x[-1] == "b" and "BYTE", "HAS_OS", "LAZYFLAGS"], [
             "unsigned dummy",
 	    "tmp_dst = cache->get_reg32((cache->_entry->data[cache->_entry->offset_opcode] >> 3) & 0x7)",
 	    """asm volatile("movl (%%2), %%0; [data16] %s (%%1), %%0; mov %%0, (%%2)" : "=a"(dummy), "+d"(tmp_src), "+c"(tmp_dst))"""%x])
@@ -349,14 +350,16 @@ def add_helper(l, flags, params):
 	name = reduce(lambda x,y: x.replace(y, "_"), "% ,", x.upper())
 	if "NO_OS" not in flags: name += "<[os]>"
 	opcodes.append((x, flags, ["cache->helper_%s(%s)"%(name, params or "")]))
-add_helper(["push", "lret", "ret"],                              ["DIRECTION"], "tmp_src")
+add_helper(["push", "ret"],                                      ["DIRECTION", "LAZYFLAGS"], "tmp_src")
+add_helper(["lret"],                                             ["DIRECTION"], "tmp_src")
 add_helper(["int", "aad", "aam"],                                ["NO_OS"], "*reinterpret_cast<unsigned char *>(tmp_src)")
 add_helper(["ljmp", "lcall", "call", "jmp",  "jecxz", "loop", "loope", "loopne"],
 	   ["JMP", "DIRECTION"], "tmp_src")
 add_helper(["in", "out"],                                        [],       "*reinterpret_cast<[IMMU] *>(tmp_src), &cache->_cpu->eax")
 add_helper(["popf", "pushf", "leave", "iret"],                   [], "")
-add_helper(["pop"],                                              [], "tmp_dst")
-add_helper(["lea", "lgdt", "lidt"],                              ["MEMONLY", "DIRECTION", "SKIPMODRM"], "")
+add_helper(["pop"],                                              ["LAZYFLAGS"], "tmp_dst")
+add_helper(["lea"],                                              ["MEMONLY", "DIRECTION", "SKIPMODRM", "LAZYFLAGS"], "")
+add_helper(["lgdt", "lidt"],                                     ["MEMONLY", "DIRECTION", "SKIPMODRM"], "")
 add_helper(["sgdt", "sidt"],                                     ["MEMONLY", "SKIPMODRM"], "")
 
 add_helper(["mov %cr0,%edx", "mov %edx,%cr0"],                   ["MODRM", "DROP1", "REGONLY", "NO_OS", "CPL0"], "")
@@ -431,14 +434,12 @@ opcodes += [(x, ["FPU", "FPUNORESTORE", "NO_OS"], [x]) for x in ["fninit"]]
 opcodes += [(x, ["FPU", "NO_OS"], [x+" (%%\" VMM_EXPAND(VMM_REG(cx)) \")"]) for x in ["fnstsw", "fnstcw", "ficom", "ficomp"]]
 opcodes += [(x, ["FPU", "NO_OS", "EAX"], ["fnstsw (%%\" VMM_EXPAND(VMM_REG(cx)) \")"]) for x in ["fnstsw %ax"]]
 opcodes += [(".byte 0xdb, 0xe4 ", ["NO_OS", "COMPLETE"], ["/* fnsetpm, on 287 only, noop afterwards */"])]
-opcodes += [(x, [x not in ["bt"] and "RMW" or "READONLY", "SAVEFLAGS", "BITS", "ASM"], ["mov (%\" VMM_EXPAND(VMM_REG(dx)) \"), %eax",
-										       "and  $(8<<[os])-1, %eax",
-											"[lock] "+x+" [EAX],(%\" VMM_EXPAND(VMM_REG(cx)) \")"]) for x in ["bt", "btc", "bts", "btr"]]
+opcodes += [(x, [x not in ["bt"] and "RMW" or "READONLY", "BITS"], alu(x)) for x in ["bt", "btc", "bts", "btr"]]
 opcodes += [("cmpxchg", ["RMW"], ['char res; asm volatile("mov (%2), %2; [lock] cmpxchg [EDX], (%3); setz %1" : "+a"(cache->_cpu->eax), "=d"(res) : "d"(tmp_src), "c"(tmp_dst))',
 				  "if (res) cache->_cpu->efl |= EFL_ZF; else cache->_cpu->efl &= EFL_ZF"])]
 opcodes += [("cmpxchg8b", ["RMW", "NO_OS", "QWORD"], ['char res; asm volatile("[lock] cmpxchg8b (%3); setz %2" : "+a"(cache->_cpu->eax), "+d"(cache->_cpu->edx), "=c"(res) : "D"(tmp_dst), "b"(cache->_cpu->ebx), "c"(cache->_cpu->ecx))',
 				  "if (res) cache->_cpu->efl |= EFL_ZF; else cache->_cpu->efl &= EFL_ZF"])]
-opcodes += [("xadd", ["RMW", "ASM", "SAVEFLAGS"], ['mov (%\" VMM_EXPAND(VMM_REG(dx)) \"), [EAX]', '[lock] xadd [EAX], (%\" VMM_EXPAND(VMM_REG(cx)) \")', 'mov [EAX], (%\" VMM_EXPAND(VMM_REG(dx)) \")'])]
+opcodes += [("xadd", ["RMW", "LAZYFLAGS"], alu("xadd"))]
 
 # unimplemented instructions
 opcodes += [(x, [], []) for x in ["vmcall", "vmlaunch", "vmresume", "vmxoff", "vmptrld", "vmptrst", "vmread", "vmwrite"]] # , "vmxon", "vmclear"
@@ -0,0 +1,264 @@
+/** @file
+ * Executable memory for translated guest code.
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+class InstructionCache;
+
+/**
+ * A buffer of x86-64 code that is filled from the bottom.  It knows
+ * just enough of the instruction encoding to re-encode guest
+ * instructions and glue them together.  Writing past the end only
+ * marks the buffer as overflowed, the caller has to check that.
+ */
+class CodeBuffer
+{
+  unsigned char *_start;
+  unsigned char *_pos;
+  unsigned char *_end;
+  bool _overflow;
+
+public:
+  enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8,  R9,  R10, R11, R12, R13, R14, R15,
+    NOREG = ~0u
+  };
+
+  enum Cond {
+    CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+    CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
+  };
+
+  unsigned char *start() { return _start; }
+  unsigned char *pos()   { return _pos; }
+  size_t room()          { return _pos < _end ? _end - _pos : 0; }
+  bool overflow()        { return _overflow; }
+
+  void reset(unsigned char *pos) { _pos = pos; _overflow = false; }
+
+  void byte(unsigned value)
+  {
+    if (_pos < _end) *_pos++ = value; else _overflow = true;
+  }
+
+  void bytes(const unsigned char *data, unsigned len) { for (unsigned i = 0; i < len; i++) byte(data[i]); }
+  void dword(unsigned value) { for (unsigned i = 0; i < 4; i++) byte(value >> (8 * i)); }
+  void qword(unsigned long long value) { dword(value); dword(value >> 32); }
+
+  /**
+   * Align the next instruction with int3 padding.
+   */
+  void align(unsigned n) { while (uintptr_t(_pos) & (n - 1) && !_overflow) byte(0xcc); }
+
+  /**
+   * Reserve memory for other things than code.
+   */
+  void *alloc(size_t size)
+  {
+    align(16);
+    if (room() < size) { _overflow = true; return 0; }
+    void *res = _pos;
+    _pos += size;
+    return res;
+  }
+
+  /**
+   * A REX prefix, if one is needed.  Registers that are NOREG do not
+   * contribute.
+   */
+  void rex(bool w, unsigned reg, unsigned index, unsigned base, bool force = false)
+  {
+    unsigned value = 0x40 | (w ? 8 : 0);
+    if (reg   != NOREG && reg   & 8) value |= 4;
+    if (index != NOREG && index & 8) value |= 2;
+    if (base  != NOREG && base  & 8) value |= 1;
+    if (value != 0x40 || force) byte(value);
+  }
+
+  /**
+   * One- and two-byte opcodes, 0x0fxx is the second kind.
+   */
+  void opcode(unsigned op)
+  {
+    if (op > 0xff) byte(op >> 8);
+    byte(op);
+  }
+
+  /**
+   * op reg, rm with two registers.
+   */
+  void reg(unsigned op, unsigned reg, unsigned rm, bool w = false)
+  {
+    rex(w, reg, NOREG, rm);
+    opcode(op);
+    byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+  }
+
+  /**
+   * The modrm and SIB bytes for [base + index * (1 << scale) + disp].
+   * Base or index can be NOREG, but not RSP as index.
+   */
+  void modrm_mem(unsigned reg, unsigned base, unsigned index, unsigned scale, int disp)
+  {
+    bool disp8 = disp == static_cast<signed char>(disp);
+    unsigned mod = base == NOREG ? 0 : (disp8 ? 0x40 : 0x80);
+    // RBP and R13 have no form without displacement
+    if (!disp && base != NOREG && (base & 7) != 5) mod = 0;
+    if (index == NOREG && base != NOREG && (base & 7) != 4) {
+      byte(mod | (reg & 7) << 3 | (base & 7));
+    } else {
+      byte(mod | (reg & 7) << 3 | 4);
+      byte(scale << 6 | (index == NOREG ? 4 : index & 7) << 3 | (base == NOREG ? 5 : base & 7));
+    }
+    if (mod == 0x40) byte(disp); else if (mod == 0x80 || base == NOREG) dword(disp);
+  }
+
+  /**
+   * op reg, [base + index * (1 << scale) + disp].
+   */
+  void mem(unsigned op, unsigned reg, unsigned base, int disp, bool w = false, unsigned index = NOREG, unsigned scale = 0)
+  {
+    rex(w, reg, index, base);
+    opcode(op);
+    modrm_mem(reg, base, index, scale, disp);
+  }
+
+  void mov_imm(unsigned reg, unsigned value)
+  {
+    rex(false, NOREG, NOREG, reg);
+    byte(0xb8 | (reg & 7));
+    dword(value);
+  }
+
+  void mov_imm64(unsigned reg, unsigned long long value)
+  {
+    rex(true, NOREG, NOREG, reg);
+    byte(0xb8 | (reg & 7));
+    qword(value);
+  }
+
+  /**
+   * Emit a jump with a 32-bit displacement.  The returned position
+   * is patched with patch() once the target is known.
+   */
+  unsigned char *jmp()
+  {
+    byte(0xe9);
+    dword(0);
+    return _pos;
+  }
+
+  unsigned char *jcc(unsigned cond)
+  {
+    byte(0x0f);
+    byte(0x80 | cond);
+    dword(0);
+    return _pos;
+  }
+
+  void jmp(unsigned char *target)  { patch(jmp(), target); }
+  void jcc(unsigned cond, unsigned char *target)  { patch(jcc(cond), target); }
+
+  /**
+   * Let the jump that ends at pos go to target.
+   */
+  void patch(unsigned char *pos, unsigned char *target)
+  {
+    if (_overflow || pos > _end) return;
+    int rel = target - pos;
+    for (unsigned i = 0; i < 4; i++) pos[int(i) - 4] = rel >> (8 * i);
+  }
+
+  void call(const void *func)
+  {
+    mov_imm64(RAX, reinterpret_cast<uintptr_t>(func));
+    byte(0xff);
+    byte(0xd0);
+  }
+
+  CodeBuffer() : _start(), _pos(), _end(), _overflow() {}
+  CodeBuffer(void *start, size_t size) : _start(reinterpret_cast<unsigned char *>(start)), _pos(_start), _end(_start + size), _overflow() {}
+};
+
+
+/**
+ * A guest block translated to host code.  The header is followed by
+ * a copy of the guest code, the host code comes afterwards.
+ */
+struct Translation
+{
+  enum {
+    PAGES = 2
+  };
+  unsigned linear;
+  unsigned length;
+  // the data segments that have to be flat
+  unsigned segments;
+  // the write generations of the code pages, like an InstructionCacheEntry
+  unsigned *gen_ptr[PAGES];
+  unsigned gen[PAGES];
+  unsigned tlb_gen;
+  // the entry point of the host code
+  unsigned char *code;
+  unsigned char guest[];
+};
+
+
+/**
+ * What the interpreter and translated code share.  Translated code
+ * finds it in RBX.
+ */
+struct TranslationState
+{
+  enum {
+    TLB_SIZE = 256,
+  };
+
+  enum Exit {
+    // continue with the next block
+    EXIT_CHAIN,
+    // the interpreter has to run the next instruction
+    EXIT_INTERPRET,
+  };
+
+  // written by translated code when it returns
+  unsigned eip;
+  unsigned exit;
+  // instructions done in loops and before the exit
+  unsigned loops;
+  unsigned tail;
+  // instructions translated code may still run in loops
+  int budget;
+  // the target of indirect branches and the address of a TLB miss
+  unsigned target;
+  unsigned virt;
+  InstructionCache *cache;
+
+  /**
+   * Translations of guest pages to host RAM for inline accesses.
+   * The tags are the guest page of an access or 1 if invalid, host
+   * is the host address of the page minus the guest one.
+   */
+  struct TlbEntry {
+    unsigned read;
+    unsigned write;
+    uintptr_t host;
+    unsigned *gen;
+    uintptr_t unused;
+  } tlb[TLB_SIZE];
+};
@@ -22,6 +22,11 @@
 #include "instcache.h"
 
 
+enum {
+  // executable memory for translated guest code
+  CODE_CACHE_SIZE = 2 << 20,
+};
+
 /**
  * Halifax: an instruction emulator.
  */
@@ -36,14 +41,24 @@ public:
   }
 
   Halifax(VCpu *vcpu) : InstructionCache(vcpu) {
-    vcpu->executor.add(this,  receive_static);
+    vcpu->executor.add(this,  receive_static, CpuMessage::TYPE_SINGLE_STEP, 1);
   }
   void *operator new(size_t size)  { return new /*(__alignof__(Halifax))*/ char[size]; }
 };
 
 PARAM_HANDLER(halifax,
-	      "halifax - create a halifax that emulatates instructions.")
+	      "halifax:threshold - create a halifax that emulatates instructions.",
+	      "Example: 'halifax:32'.",
+	      "Blocks that ran threshold times are translated to host code, if the host gives us executable memory. Default is 32, 0 disables translation.")
 {
   if (!mb.last_vcpu) Logging::panic("no VCPU for this Halifax");
-  new Halifax(mb.last_vcpu);
+  Halifax *halifax = new Halifax(mb.last_vcpu);
+
+  MessageHostOp msg0(MessageHostOp::OP_VCPU_EMULATED, 0UL);
+  if (mb.bus_hostop.send(msg0)) halifax->enable_persistent_tlb();
+
+  unsigned threshold = ~argv[0] ? argv[0] : 32;
+  MessageHostOp msg(MessageHostOp::OP_ALLOC_CODE, 0UL, CODE_CACHE_SIZE);
+  if (threshold && mb.bus_hostop.send(msg) && msg.ptr)
+    halifax->enable_translation(msg.ptr, msg.len, threshold);
 }
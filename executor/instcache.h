@@ -54,6 +54,8 @@ enum {
 };
 
 #include "memtlb.h"
+#include "alu.h"
+#include "codecache.h"
 
 
 enum {
@@ -109,6 +111,16 @@ struct InstructionCacheEntry
   void     *src;
   void     *dst;
   unsigned immediate;
+  // the fall-through successor, chaining straight-line code into blocks
+  InstructionCacheEntry *next;
+  // the write generations of the code pages, valid as long as the TLB is
+  unsigned *gen_ptr[2];
+  unsigned gen[2];
+  unsigned tlb_gen;
+  bool untracked;
+  // the translation of the block starting here and how often the interpreter ran it
+  Translation *translation;
+  unsigned hits;
 };
 
 
@@ -145,12 +157,16 @@ class InstructionCache : public MemTlb
     IC_RMW       = 1 <<  9,
     IC_MOFS      = 1 << 10,
     IC_QWORD     = 1 << 11,
+    // runs while the arithmetic flags are pending, see flags_materialize()
+    IC_LAZYFLAGS = 1 << 12,
   };
 
 
   enum {
     SIZE = 64,
-    ASSOZ = 4
+    ASSOZ = 4,
+    // the maximum number of instructions executed in one step
+    BLOCK_SIZE = 64
   };
 
   unsigned _pos;
@@ -165,14 +181,25 @@ class InstructionCache : public MemTlb
   unsigned _oeip;
   unsigned _oesp;
   unsigned _ointr_state;
+  bool  _block_exit;
+  // The last instruction that wrote all arithmetic flags, with its
+  // operands and result.  Until flags_materialize() computes them,
+  // the arithmetic flags in _cpu->efl are stale.
+  unsigned (*_lazy_flags)(unsigned dst, unsigned src, unsigned res);
+  unsigned _lazy_dst;
+  unsigned _lazy_src;
+  unsigned _lazy_res;
   mword _dr6;
   mword _dr[4];
   unsigned _fpustate [512/sizeof(unsigned)] __attribute__((aligned(16)));
 
   int send_message(CpuMessage::Type type)
   {
+    _block_exit = true;
     CpuMessage msg(type, _cpu, _mtr_in);
+    _vcpu->lock(true);
     _vcpu->executor.send(msg, true);
+    _vcpu->lock(false);
     return _fault;
   }
 
@@ -196,34 +223,80 @@ class InstructionCache : public MemTlb
     if ((~limit && limit < (virt + len - 1)) || ((entry->inst_len + len) > InstructionCacheEntry::MAX_INSTLEN)) GP0;
     virt += READ(cs).base;
 
-    read_code(virt, len, entry->data + entry->inst_len);
+    CacheEntry *mem;
+    if (read_code(virt, len, entry->data + entry->inst_len, mem)) return _fault;
     entry->inst_len += len;
+
+    // remember the generation of the pages we fetched from
+    if (!mem->_gen) entry->untracked = true;
+    else
+      for (unsigned i=0; i < 1 + (mem->_phys2 != ~0xffful); i++)
+	for (unsigned j=0; j < 2; j++)
+	  {
+	    if (entry->gen_ptr[j] == mem->_gen + i) break;
+	    if (entry->gen_ptr[j]) continue;
+	    entry->gen_ptr[j] = mem->_gen + i;
+	    entry->gen[j] = mem->_gen[i];
+	    break;
+	  }
+    entry->tlb_gen = _tlb_gen;
     return _fault;
   }
 
 
+  /**
+   * Is the code of an entry unmodified since it was fetched?  This
+   * holds if the translation and the pages are unchanged.
+   */
+  bool unmodified(InstructionCacheEntry *entry)
+  {
+    return !entry->untracked && entry->tlb_gen == _tlb_gen
+      && *entry->gen_ptr[0] == entry->gen[0]
+      && (!entry->gen_ptr[1] || *entry->gen_ptr[1] == entry->gen[1]);
+  }
+
+
   /**
    * Find a cache entry for the given state and checks whether it is
-   * still valid.
+   * still valid.  The fall-through successor of the previous
+   * instruction is tried first.  Entries are only refetched if their
+   * pages were written or the TLB was flushed.  Entries on pages
+   * without a write generation are compared every time.
    */
-  bool find_entry(unsigned &index)
+  bool find_entry(unsigned &index, InstructionCacheEntry *prev)
   {
     unsigned cs_ar = READ(cs).ar;
     unsigned linear = _cpu->eip + READ(cs).base;
-    for (unsigned i = slot(linear); i < slot(linear) + ASSOZ; i++)
-      if (linear == _tags[i] &&  _values[i].inst_len)
-	{
-	  InstructionCacheEntry tmp;
-	  tmp.inst_len = 0;
-	  // revalidate entries
-	  if (fetch_code(&tmp, _values[i].inst_len)) return false;
-
-	  // either code modified or two entries with different bases?
-	  if (memcmp(tmp.data, _values[i].data, _values[i].inst_len) || cs_ar != _values[i].cs_ar)  continue;
-	  index = i;
-	  //COUNTER_INC("I$ ok");
-	  return true;
-	}
+    unsigned limit = READ(cs).limit;
+    unsigned chained = (prev && prev->next) ? prev->next - _values : ~0u;
+    for (unsigned n = 0; n <= ASSOZ; n++)
+      {
+	unsigned i = n ? slot(linear) + n - 1 : chained;
+	if (!~i || (n && i == chained) || linear != _tags[i] || !_values[i].inst_len) continue;
+
+	// two entries with different bases?
+	if (cs_ar != _values[i].cs_ar) continue;
+	if (~limit && limit < (_cpu->eip + _values[i].inst_len - 1)) { EXCEPTION(this, 0xd, 0); return false; }
+
+	if (!unmodified(_values + i))
+	  {
+	    InstructionCacheEntry tmp;
+	    memset(&tmp, 0, sizeof(tmp));
+	    // revalidate entries
+	    if (fetch_code(&tmp, _values[i].inst_len)) return false;
+
+	    // code modified?
+	    if (memcmp(tmp.data, _values[i].data, _values[i].inst_len))  continue;
+	    memcpy(_values[i].gen_ptr, tmp.gen_ptr, sizeof(tmp.gen_ptr));
+	    memcpy(_values[i].gen, tmp.gen, sizeof(tmp.gen));
+	    _values[i].tlb_gen = tmp.tlb_gen;
+	    _values[i].untracked = tmp.untracked;
+	  }
+	index = i;
+	if (prev) prev->next = _values + i;
+	//COUNTER_INC("I$ ok");
+	return true;
+      }
     // allocate new invalid entry
     index = slot(linear) + (_pos++ % ASSOZ);
     memset(_values + index, 0, sizeof(*_values));
@@ -267,16 +340,18 @@ class InstructionCache : public MemTlb
 #include "insthelper.h"
 #include "instructions.h"
 #include "instructions.inc"
+#include "translator.h"
 
 public:
   /**
-   * Decode the instruction.
+   * Decode the instruction.  A previous instruction that falls
+   * through to this one gets chained to it.
    */
-  int get_instruction()
+  int get_instruction(InstructionCacheEntry *prev = 0)
   {
     //COUNTER_INC("INSTR");
     unsigned index = 0;
-    if (!find_entry(index) && !_fault)
+    if (!find_entry(index, prev) && !_fault)
       {
 	_entry = _values + index;
 	_entry->address_size = _entry->operand_size = ((_entry->cs_ar >> 10) & 1) + 1;
@@ -299,6 +374,7 @@ public:
 	  }
 
 	assert(_values[index].execute);
+	if (prev) prev->next = _values + index;
 	//COUNTER_INC("decoded");
       }
     _entry = _values + index;
@@ -436,6 +512,54 @@ public:
   }
 
 
+  template<class OP, typename T>
+  static unsigned lazy_flags(unsigned dst, unsigned src, unsigned res) { return OP::flags(T(dst), T(src), T(res), 0); }
+
+  /**
+   * Execute one of the ALU instructions from alu.h.  Flags that are
+   * completely overwritten are only computed when needed.
+   */
+  template<class OP, typename T>
+  static void alu(InstructionCache *cache, void *tmp_src, void *tmp_dst)
+  {
+    T *dst = reinterpret_cast<T *>(tmp_dst);
+    T *src = reinterpret_cast<T *>(tmp_src);
+    unsigned efl = cache->_cpu->efl;
+    T d = *dst, s = *src;
+    T r = OP::result(d, s, efl);
+    if (OP::STORE) {
+      if ((cache->_entry->prefixes & 0xff) != 0xf0)
+	*dst = r;
+      else
+	while (!__atomic_compare_exchange_n(dst, &d, r, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	  r = OP::result(d, s, efl);
+    }
+    if (OP::EXCHANGE) *src = d;
+
+    if (OP::FLAGS == Alu::FLAGS_NONE) return;
+    if (OP::FLAGS == Alu::FLAGS_ALL) {
+      cache->_lazy_flags = lazy_flags<OP, T>;
+      cache->_lazy_dst = d;
+      cache->_lazy_src = s;
+      cache->_lazy_res = r;
+    }
+    else
+      cache->_cpu->efl = (efl & ~Alu::ARITH) | OP::flags(d, s, r, efl);
+    cache->_mtr_out |= MTD_RFLAGS;
+  }
+
+
+  /**
+   * Compute the pending arithmetic flags.
+   */
+  void flags_materialize()
+  {
+    if (!_lazy_flags) return;
+    _cpu->efl = (_cpu->efl & ~Alu::ARITH) | _lazy_flags(_lazy_dst, _lazy_src, _lazy_res);
+    _lazy_flags = 0;
+  }
+
+
   /**
    * Execute the instruction.
    */
@@ -448,6 +572,12 @@ public:
     void *tmp_src   = _entry->src;
     void *tmp_dst   = _entry->dst;
 
+    // Only instructions that ignore the arithmetic flags or overwrite
+    // all of them run before the pending flags are computed.
+    unsigned flags = _entry->flags & (IC_ASM | IC_LOADFLAGS | IC_SAVEFLAGS | IC_LAZYFLAGS);
+    if (flags != IC_ASM && (~flags & IC_LAZYFLAGS))
+      flags_materialize();
+
     if (((_entry->prefixes & 0xff) == 0xf0) && ((~_entry->flags & IC_LOCK) || (_entry->modrminfo & MRM_REG))) {
       Logging::panic("LOCK prefix %02x%02x%02x%02x at eip %x:%x\n", _entry->data[0], _entry->data[1], _entry->data[2], _entry->data[3], _cpu->cs.sel, _cpu->eip);
       UD0;
@@ -540,8 +670,11 @@ public:
 	      {
 		_cpu->inj_info = 0;
 		// triple fault
+		flags_materialize();
 		CpuMessage msg(CpuMessage::TYPE_TRIPLE, _cpu, _mtr_in);
+		_vcpu->lock(true);
 		_vcpu->executor.send(msg, true);
+		_vcpu->lock(false);
 	      }
 	    else
 	      {
@@ -560,25 +693,73 @@ public:
     return true;
   }
 
+
+  /**
+   * Can the block be continued with the next instruction?  We stop at
+   * faults, taken branches, I/O and other state changes that have to
+   * be visible outside, and whenever an event is pending.
+   */
+  bool block_continues(unsigned count, unsigned mtr)
+  {
+    return count < BLOCK_SIZE
+      && !_fault && !_block_exit
+      && _cpu->eip == _oeip + _entry->inst_len
+      && !(mtr & ~(MTD_GPR_ACDB | MTD_GPR_BSD | MTD_RSP | MTD_RIP_LEN | MTD_RFLAGS))
+      && !(_cpu->intr_state & 3)
+      && !(_cpu->inj_info & 0x80000000)
+      && !(_cpu->efl & EFL_TF)
+      && !_vcpu->event_pending(_cpu->efl & EFL_IF);
+  }
+
 public:
 
+  /**
+   * Execute a block of straight-line instructions.  Every instruction
+   * is committed on its own, so a fault only rolls back the
+   * instruction that caused it.  Translated blocks run before.
+   */
   void step(CpuMessage &msg) {
     _cpu = msg.cpu;
     _mtr_in = msg.mtr_in;
     _mtr_out =  msg.mtr_out;
     _fault = 0;
     if (!init()) {
+      unsigned mtr_out = _mtr_out;
+      run_translations(mtr_out);
       _entry = 0;
-      _oeip = _cpu->eip;
-      _oesp = _cpu->esp;
-      _ointr_state = _cpu->intr_state;
-      // remove sti+movss blocking
-      _cpu->intr_state &= ~3;
-      event_injection() || get_instruction() || execute();
-      if (commit()) invalidate(true);
+      for (unsigned count = 1; ; count++) {
+	InstructionCacheEntry *prev = _entry;
+	_entry = 0;
+	_mtr_out = 0;
+	_block_exit = false;
+	_oeip = _cpu->eip;
+	_oesp = _cpu->esp;
+	_ointr_state = _cpu->intr_state;
+	// remove sti+movss blocking
+	_cpu->intr_state &= ~3;
+	if (!(count == 1 && event_injection()) && !get_instruction(prev)) {
+	  if (count == 1) count_block(_entry);
+	  execute();
+	}
+	writes_done();
+
+	unsigned mtr = _mtr_out;
+	bool committed = commit();
+	mtr_out |= _mtr_out;
+	if (!committed) break;
+	_vcpu->stats.instructions++;
+	invalidate(true);
+	if (!block_continues(count, mtr)) break;
+      }
+      flags_materialize();
+      _mtr_out = mtr_out;
     }
     msg.mtr_out = _mtr_out;
   }
 
- InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate() { }
+ InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _block_exit(), _lazy_flags(), _lazy_dst(), _lazy_src(), _lazy_res(), _dr6(), _dr(), _fpustate()
+#ifdef __x86_64__
+  , _translator(), _code(), _code_start(), _threshold(), _translation_tlb_gen(), _translation_cpl(), _translation(), _enter(), _exit(), _exit_flags()
+#endif
+  { }
 };
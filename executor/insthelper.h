@@ -307,8 +307,11 @@ helper_SDT(SGDT,gd, MTD_GDTR)
   void __attribute__((regparm(3)))  helper_IN(unsigned port, void *dst)
   {
     // XXX check IOPBM
+    _block_exit = true;
     CpuMessage msg(true, _cpu, operand_size, port, dst, _mtr_in);
+    _vcpu->lock(true);
     _vcpu->executor.send(msg, true);
+    _vcpu->lock(false);
   }
 
   template<unsigned operand_size>
@@ -316,21 +319,21 @@ helper_SDT(SGDT,gd, MTD_GDTR)
   {
 
     // XXX check IOPBM
+    _block_exit = true;
     CpuMessage msg(false, _cpu, operand_size, port, dst, _mtr_in);
+    _vcpu->lock(true);
     _vcpu->executor.send(msg, true);
+    _vcpu->lock(false);
   }
 
 /**
  * Calc the flags for an operation.
  */
-int calc_flags(unsigned operand_size, void *src, void *dst) {
-  InstructionCacheEntry entry2;
-  entry2.execute = operand_size == 0 ? exec_38_cmp_0 : (operand_size == 1 ? exec_39_cmp_1 : exec_39_cmp_2);
-  entry2.flags = IC_SAVEFLAGS;
-  InstructionCacheEntry *old = _entry;
-  _entry = &entry2;
-  call_asm(src, dst);
-  _entry = old;
+template<typename T>
+int calc_flags(void *src, void *dst) {
+  T d = *reinterpret_cast<T *>(dst), s = *reinterpret_cast<T *>(src);
+  _cpu->efl = (_cpu->efl & ~Alu::ARITH) | AluCmp::flags(d, s, T(d - s), _cpu->efl);
+  _mtr_out |= MTD_RFLAGS;
   return _fault;
 }
 
@@ -346,13 +349,94 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
     SH_DOOP_OUT = 1 << 6
   };
 
+  /**
+   * Can [virt, virt+length) be accessed through the segment without a
+   * fault? Expand-down segments are left to handle_segment().
+   */
+  static bool segment_covers(CpuState::Descriptor *desc, unsigned virt, unsigned length, bool write)
+  {
+    if ((desc->ar & 0xc) == 4 || ~desc->ar & 0x80) return false;
+    if (!write && (desc->ar & 0xa) == 0x8 || write && (desc->ar & 0xa) != 0x2) return false;
+    return virt + length - 1 >= virt && virt + length - 1 <= desc->limit;
+  }
+
+  /**
+   * The number of elements from a linear address to the end of its
+   * page in the direction of the string operation.
+   */
+  template<unsigned operand_size>
+  static unsigned page_elements(unsigned linear, bool down)
+  {
+    unsigned offset = linear & 0xfff;
+    if (offset + (1 << operand_size) > 0x1000) return 0;
+    return (down ? offset + (1 << operand_size) : 0x1000 - offset) >> operand_size;
+  }
+
+  /**
+   * Do the elements of a rep movs or rep stos that fit into the
+   * current source and destination pages at once, if both pages are
+   * RAM and do not overlap. Returns the number of elements done. On 0
+   * the next element takes the slow path, which also reports faults
+   * exactly like before.
+   */
+  template<unsigned feature, unsigned operand_size>
+  unsigned string_bulk()
+  {
+    bool down = _cpu->efl & 0x400;
+    CpuState::Descriptor *src_seg = (&_cpu->es) + ((_entry->prefixes >> 8) & 0xf);
+    unsigned dst_linear = _cpu->es.base + _cpu->edi;
+    unsigned src_linear = src_seg->base + _cpu->esi;
+
+    unsigned n = VMM_MIN(_cpu->ecx, page_elements<operand_size>(dst_linear, down));
+    if (feature & SH_LOAD_ESI) n = VMM_MIN(n, page_elements<operand_size>(src_linear, down));
+    if (n < 2) return 0;
+
+    // The lowest address is back bytes below the first element.
+    unsigned len  = n << operand_size;
+    unsigned back = down ? len - (1 << operand_size) : 0;
+    if (!segment_covers(&_cpu->es, _cpu->edi - back, len, true)) return 0;
+    if (feature & SH_LOAD_ESI && !segment_covers(src_seg, _cpu->esi - back, len, false)) return 0;
+
+    char *src = 0;
+    if (feature & SH_LOAD_ESI && !(src = ram_page(src_linear & ~3u, user_access(TYPE_R)))) return 0;
+    char *dst = ram_page(dst_linear & ~3u, user_access(TYPE_W));
+    if (!dst) return 0;
+    dst += (dst_linear & 0xfff) - back;
+
+    if (feature & SH_LOAD_ESI) {
+      src += (src_linear & 0xfff) - back;
+      if (uintptr_t(src) < uintptr_t(dst) + len && uintptr_t(dst) < uintptr_t(src) + len) return 0;
+      memcpy(dst, src, len);
+    }
+    else if (operand_size == 0)
+      memset(dst, _cpu->al, len);
+    else
+      for (unsigned i = 0; i < len; i += 1 << operand_size)
+	move<operand_size>(dst + i, &_cpu->eax);
+
+    _cpu->ecx -= n;
+    if (feature & SH_LOAD_ESI) _cpu->esi += down ? -len : len;
+    _cpu->edi += down ? -len : len;
+    return n;
+  }
+
 #define NCHECK(X)  { if (X) break; }
 #define FEATURE(X,Y) { if (feature & (X)) Y; }
   template<unsigned feature, unsigned operand_size>
   int __attribute__((regparm(3)))  string_helper()
   {
+    const bool bulk = feature == (SH_LOAD_ESI | SH_SAVE_EDI) || feature == SH_SAVE_EDI;
     while (_entry->address_size == 1 && _cpu->cx || _entry->address_size == 2 && _cpu->ecx || !(_entry->prefixes & 0xff))
       {
+	if (bulk && _entry->address_size == 2 && _entry->prefixes & 0xff) {
+	  unsigned done = string_bulk<feature, operand_size>();
+	  if (_fault) break;
+	  if (done) {
+	    if (string_interrupted()) break;
+	    continue;
+	  }
+	}
+
 	void *src = &_cpu->eax;
 	void *dst = &_cpu->eax;
 
@@ -360,7 +444,11 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
 	FEATURE(SH_LOAD_EDI, NCHECK(logical_mem<operand_size>(&_cpu->es, _cpu->edi, false, dst)));
 	FEATURE(SH_DOOP_IN,  helper_IN<operand_size>(_cpu->dx, dst));
 	FEATURE(SH_DOOP_OUT, helper_OUT<operand_size>(_cpu->dx, src));
-	FEATURE(SH_DOOP_CMP, calc_flags(operand_size, src, dst); );
+	FEATURE(SH_DOOP_CMP, {
+	    if (operand_size == 0)      calc_flags<unsigned char>(src, dst);
+	    else if (operand_size == 1) calc_flags<unsigned short>(src, dst);
+	    else                        calc_flags<unsigned>(src, dst);
+	  });
 	FEATURE(SH_SAVE_EDI, NCHECK(logical_mem<operand_size>(&_cpu->es, _cpu->edi, true, dst)));
 	FEATURE(SH_SAVE_EDI | SH_SAVE_EAX, move<operand_size>(dst, src));
 
@@ -372,12 +460,23 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
 	if (_entry->address_size == 1)  _cpu->cx--; else _cpu->ecx--;
 	FEATURE(SH_DOOP_CMP,  if (((_entry->prefixes & 0xff) == 0xf3)  && (~_cpu->efl & 0x40))  break);
 	FEATURE(SH_DOOP_CMP,  if (((_entry->prefixes & 0xff) == 0xf2)  && ( _cpu->efl & 0x40))  break);
-
-	// XXX check for interrupts
+	if (string_interrupted()) break;
       }
     return _fault;
   }
 
+  /**
+   * Stop a rep instruction with elements left for a pending event.
+   * The instruction is restarted after the event was handled.
+   */
+  bool string_interrupted()
+  {
+    if (!(_entry->address_size == 1 ? _cpu->cx : _cpu->ecx)) return false;
+    if (!_vcpu->event_pending(_cpu->efl & EFL_IF)) return false;
+    _cpu->eip = _oeip;
+    return true;
+  }
+
 
 /**
  * Move from control register.
@@ -420,8 +519,8 @@ int helper_MOV__EDX__CR0()
   *tmp_dst = tmp;
   _mtr_out |= MTD_CR;
 
-  // XXX flush only if paging-bits change
-  // update TLB
+  // a CR3 reload flushes the TLB even if the value is unchanged
+  flush_tlb();
   return init();
 }
 
@@ -884,7 +983,7 @@ int idt_traversal(unsigned event, unsigned error_code)
 
 
 int helper_INT(unsigned char vector) { return idt_traversal(0x80000600 | vector, 0); }
-int helper_INVLPG() { return _fault; }
+int helper_INVLPG() { flush_tlb(); return _fault; }
 int helper_FWAIT()                              { return _fault; }
 int helper_MOV__DB0__EDX()
 {
@@ -951,14 +1050,14 @@ void helper_AAM(unsigned char imm) {
   _cpu->ax = ((_cpu->al / imm) << 8) | (_cpu->al % imm);
   _mtr_out |= MTD_GPR_ACDB | MTD_RFLAGS;
   unsigned zero = 0;
-  calc_flags(0, &_cpu->eax, &zero);
+  calc_flags<unsigned char>(&_cpu->eax, &zero);
 }
 
 void helper_AAD(unsigned char imm) {
   _cpu->ax = (_cpu->al + (_cpu->ah * imm)) & 0xff;
   _mtr_out |= MTD_GPR_ACDB | MTD_RFLAGS;
   unsigned zero = 0;
-  calc_flags(0, &_cpu->eax, &zero);
+  calc_flags<unsigned char>(&_cpu->eax, &zero);
 }
 
 
@@ -59,7 +59,15 @@ private:
     // Number of buffers, we need two for movs, push and similar instructions...
     BUFFERS = 6,
     // The maximum size of a buffer, the minmum is 16+dword (cmpxchg16b+instruction-reread).
-    BUFFER_SIZE = 16 + 4
+    BUFFER_SIZE = 16 + 4,
+    // Number of RAM regions we map directly.
+    REGIONS = 4,
+    // Regions of at least this many pages are mapped directly.
+    REGION_MIN_PAGES = 256,
+    // Number of entries handed out for direct accesses, we need one per page walk level plus movs.
+    DIRECT = 8,
+    // Number of pages one instruction writes before writes_done(), a movs writes two.
+    WRITTEN = 8
   };
 
   // the hash function for the cache
@@ -87,6 +95,8 @@ public:
     char *_ptr;
     // length of cache entry, this can be up to 8k long
     size_t _len;
+    // the write generation of the first page or 0 if not tracked
+    unsigned *_gen;
     // a pointer in a single linked list to an older entry in the set or ~0u at the end
     unsigned _older;
     bool is_valid(uintptr_t phys1, uintptr_t phys2, size_t len)
@@ -104,6 +114,58 @@ private:
   } _sets[SIZE];
 
 
+  /**
+   * Large RAM regions learned from the memregion bus.  Accesses to
+   * them bypass the cache.
+   */
+  struct Region
+  {
+    uintptr_t _start;
+    uintptr_t _end;
+    char     *_ptr;
+    unsigned *_gen;
+  } _regions[REGIONS];
+  unsigned _region_count;
+  CacheEntry _direct[DIRECT];
+  unsigned _direct_pos;
+  // the write generations of the pages written since writes_done()
+  unsigned *_written[WRITTEN];
+  unsigned _written_count;
+
+
+  /**
+   * Note a write to a page.  Its generation is bumped now and again
+   * in writes_done(), so that another CPU that reads the generation
+   * in between refetches the code later.
+   */
+  void note_write(unsigned *gen)
+  {
+    Cpu::atomic_xadd(gen, 1);
+    // Only bulk accesses, which are done page by page, run out of slots.
+    if (_written_count == WRITTEN) writes_done();
+    _written[_written_count++] = gen;
+  }
+
+
+  /**
+   * Remember a region.  Accesses that do not fit into a region we
+   * already know end up here again, thus we keep a region only once.
+   */
+  void learn_region(MessageMemRegion &msg)
+  {
+    if (_region_count >= REGIONS || msg.count < REGION_MIN_PAGES) return;
+    uintptr_t start = msg.start_page << 12;
+    uintptr_t end   = (msg.start_page + msg.count) << 12;
+    for (unsigned i=0; i < _region_count; i++)
+      if (start < _regions[i]._end && _regions[i]._start < end) return;
+    Region &r = _regions[_region_count++];
+    r._start = start;
+    r._end   = end;
+    r._ptr   = msg.ptr;
+    r._gen   = msg.gen;
+  }
+
+
   /**
    * Cache MMIO registers and pending writes to them.  The data is
    * sorted in two single linked lists. The usage list via
@@ -119,18 +181,20 @@ private:
   unsigned _newest_write;
 
 
+  /**
+   * Read or write a buffer with one burst per page.
+   */
   void buffer_io(bool read, unsigned index) {
-    assert(!(_buffers[index]._len & 3));
-    assert(!(_buffers[index]._phys1 & 3));
-
-    uintptr_t address = _buffers[index]._phys1;
-    for (size_t i=0; i < _buffers[index]._len; i += 4) {
-      MessageMem msg2(read, address, reinterpret_cast<unsigned *>(_buffers[index].data + i));
+    Buffers &b = _buffers[index];
+    assert(!(b._len & 3));
+    assert(!(b._phys1 & 3));
+
+    size_t first = VMM_MIN(b._len, 0x1000 - (b._phys1 & 0xfff));
+    MessageMem msg1(read, b._phys1, reinterpret_cast<unsigned *>(b.data), first / 4);
+    _mem.send(msg1, true);
+    if (first < b._len) {
+      MessageMem msg2(read, b._phys2, reinterpret_cast<unsigned *>(b.data + first), (b._len - first) / 4);
       _mem.send(msg2, true);
-      if ((address & 0xfff) != 0xffc)
-	address += 4;
-      else
-	address = _buffers[index]._phys2;
     }
   }
 
@@ -172,31 +236,47 @@ private:
 /*
  * Search for an entry starting from the newest one.
  */
-#define search_entry(set, newest)					\
+#define search_entry(set, newest, counter)				\
   unsigned old = ~0;							\
   unsigned entry = newest;						\
   for (; ~set[entry]._older; old = entry, entry = set[entry]._older)	\
     if (set[entry].is_valid(phys1, phys2, len))				\
-      return_move_to_front(set, newest);				\
+      {									\
+	COUNTER_INC(counter);						\
+	return_move_to_front(set, newest);				\
+      }									\
   /* we have at least an assoziativity of two! */			\
   assert(~old);								\
   assert(~entry);							\
 
 
-public:
-
   /**
    * Get an entry from the cache or fetch one from memory.
    */
-  CacheEntry *get(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
+  CacheEntry *get_entry(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
   {
     assert(!(phys1 & 3));
     assert(!(len & 3));
 
-    // XXX simplify it by relying on memory ranges
+    // directly mapped RAM?
+    if (phys2 == ~0xffful || phys2 == (phys1 & ~0xffful) + 0x1000)
+      for (unsigned i=0; i < _region_count; i++)
+	{
+	  Region &r = _regions[i];
+	  if (phys1 < r._start || phys1 + len > r._end) continue;
+	  COUNTER_INC("MC direct");
+	  CacheEntry *res = _direct + (_direct_pos++ % DIRECT);
+	  res->_ptr   = r._ptr + (phys1 - r._start);
+	  res->_gen   = r._gen ? r._gen + ((phys1 - r._start) >> 12) : 0;
+	  res->_len   = len;
+	  res->_phys1 = phys1;
+	  res->_phys2 = phys2;
+	  return res;
+	}
+
     {
       unsigned s = slot(phys1);
-      search_entry(_sets[s]._values, _sets[s]._newest);
+      search_entry(_sets[s]._values, _sets[s]._newest, "MC hit");
 
       /**
        * What should we do if two different pages are referenced?
@@ -215,8 +295,11 @@ public:
       // try to get a direct memory reference
       MessageMemRegion msg1(phys1 >> 12);
       if (supported && _memregion.send(msg1, true) && msg1.ptr && ((phys1 + len) <= ((msg1.start_page + msg1.count) << 12))) {
+	COUNTER_INC("MC region");
+	learn_region(msg1);
 	CacheEntry *res = _sets[s]._values + entry;
 	res->_ptr = msg1.ptr + (phys1 - (msg1.start_page << 12));
+	res->_gen = msg1.gen ? msg1.gen + ((phys1 >> 12) - msg1.start_page) : 0;
 	res->_len = len;
 	res->_phys1 = phys1;
 	res->_phys2 = phys2;
@@ -227,7 +310,8 @@ public:
     // we could not alloc the memory region directly from RAM, thus we use our own buffer instead.
     {
       assert(len <= BUFFER_SIZE);
-      search_entry(_buffers, _newest_buffer);
+      search_entry(_buffers, _newest_buffer, "MC buffer hit");
+      COUNTER_INC("MC buffer");
 
       /**
        * Invalidate a dirty entry, as we entry points to the last used
@@ -251,6 +335,7 @@ public:
 	}
 
       // init entry
+      _buffers[entry]._gen   = 0;
       _buffers[entry]._len   = len;
       _buffers[entry]._phys1 = phys1;
       _buffers[entry]._phys2 = phys2;
@@ -262,6 +347,56 @@ public:
     }
   }
 
+public:
+
+  /**
+   * Get an entry and note writes to RAM, so that code on these pages
+   * gets revalidated.
+   */
+  CacheEntry *get(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
+  {
+    CacheEntry *res = get_entry(phys1, phys2, len, type);
+    if (type & TYPE_W && res->_gen)
+      {
+	note_write(res->_gen);
+	if (res->_phys2 != ~0xffful) note_write(res->_gen + 1);
+      }
+    return res;
+  }
+
+
+  /**
+   * Bump the generations of the pages written since the last call
+   * again, after the stores were done.
+   */
+  void writes_done()
+  {
+    for (unsigned i=0; i < _written_count; i++) Cpu::atomic_xadd(_written[i], 1);
+    _written_count = 0;
+  }
+
+
+  /**
+   * Return the page at phys if it is in a RAM region we already know,
+   * or 0 otherwise. Writes are noted like in get().  The write
+   * generation of the page is returned in gen, if asked for.  It is 0
+   * if the page is not tracked.
+   */
+  char *get_ram_page(uintptr_t phys, Type type, unsigned **gen = 0)
+  {
+    phys &= ~0xffful;
+    for (unsigned i=0; i < _region_count; i++)
+      {
+	Region &r = _regions[i];
+	if (phys < r._start || phys >= r._end) continue;
+	unsigned *g = r._gen ? r._gen + ((phys - r._start) >> 12) : 0;
+	if (type & TYPE_W && g) note_write(g);
+	if (gen) *gen = g;
+	return r._ptr + (phys - r._start);
+      }
+    return 0;
+  }
+
 
   /**
    * Invalidate the cache, thus writeback the buffers.
@@ -276,7 +411,7 @@ public:
     }
 
 
-  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), debug(false), _sets()
+  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), debug(false), _sets(), _regions(), _region_count(), _direct(), _direct_pos(), _written(), _written_count()
   {
     assert(ASSOZ   >= 2);
     assert(BUFFERS >= 2);
@@ -27,12 +27,35 @@ class MemTlb : public MemCache
 {
 protected:
   CpuState *_cpu;
+  // incremented whenever cached translations become invalid
+  unsigned _tlb_gen;
 
 private:
   // pdpt cache for 32-bit PAE
   unsigned long long _pdpt[4];
   unsigned long _msr_efer;
   unsigned _paging_mode;
+  mword _paging_cr3;
+  // the TLB generation the paging state was computed for
+  unsigned _paging_gen;
+  // do translations survive between steps?
+  bool _tlb_persistent;
+
+  enum {
+    TLB_SIZE = 256
+  };
+
+  /**
+   * A translation of a 4k page.  Entries from older TLB generations
+   * are invalid.
+   */
+  struct TlbEntry
+  {
+    uintptr_t _virt;
+    uintptr_t _phys;
+    unsigned  _rights;
+    unsigned  _gen;
+  } _tlb[TLB_SIZE];
 
   enum Features {
     FEATURE_PSE        = 1 << 0,
@@ -41,7 +64,7 @@ private:
     FEATURE_SMALL_PDPT = 1 << 3,
     FEATURE_LONG       = 1 << 4,
   };
-  unsigned (*tlb_fill_func)(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys);
+  unsigned (*tlb_fill_func)(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys, unsigned &rights);
 
 #define AD_ASSIST(bits)							\
   if ((pte & (bits)) != (bits))						\
@@ -54,18 +77,18 @@ private:
     }
 
   template <unsigned features, typename PTE_TYPE>
-    static unsigned tlb_fill(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys)
-  {  return tlb->tlb_fill2<features, PTE_TYPE>(virt, type, phys); }
+    static unsigned tlb_fill(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys, unsigned &rights)
+  {  return tlb->tlb_fill2<features, PTE_TYPE>(virt, type, phys, rights); }
 
 
   template <unsigned features, typename PTE_TYPE>
-    unsigned tlb_fill2(uintptr_t virt, unsigned type, uintptr_t &phys)
+    unsigned tlb_fill2(uintptr_t virt, unsigned type, uintptr_t &phys, unsigned &rights)
   {
     PTE_TYPE pte;
     if (features & FEATURE_SMALL_PDPT) pte = _pdpt[(virt >> 30) & 3]; else pte = READ(cr3);
     if (features & FEATURE_SMALL_PDPT && ~pte & 1) PF(virt, type & ~1);
     if (~features & FEATURE_PAE || ~_paging_mode & (1<<11)) type &= ~TYPE_X;
-    unsigned rights = TYPE_R | TYPE_W | TYPE_U | TYPE_X;
+    rights = TYPE_R | TYPE_W | TYPE_U | TYPE_X;
     unsigned l = features & FEATURE_LONG ? 4 : 2;
     bool is_sp;
     CacheEntry *entry = 0;
@@ -115,10 +138,31 @@ private:
     return _fault;
   }
 
+  /**
+   * Translate a virtual address.  The page tables are only walked if
+   * the TLB misses or has not enough rights for this access.
+   */
   int virt_to_phys(uintptr_t virt, Type type, uintptr_t &phys) {
 
-    if (tlb_fill_func) return tlb_fill_func(this, virt, type, phys);
-    phys = virt;
+    if (!tlb_fill_func) {
+      phys = virt;
+      return _fault;
+    }
+
+    TlbEntry *tlb = _tlb + ((virt >> 12) % TLB_SIZE);
+    if (tlb->_gen == _tlb_gen && tlb->_virt == (virt & ~0xffful) && (tlb->_rights & type) == type) {
+      //COUNTER_INC("TLB hit");
+      phys = tlb->_phys | (virt & 0xfff);
+      return _fault;
+    }
+
+    unsigned rights;
+    if (!tlb_fill_func(this, virt, type, phys, rights)) {
+      tlb->_virt   = virt & ~0xffful;
+      tlb->_phys   = phys & ~0xffful;
+      tlb->_rights = rights;
+      tlb->_gen    = _tlb_gen;
+    }
     return _fault;
   }
 
@@ -144,9 +188,24 @@ protected:
   }
 
 
+  /**
+   * Forget all translations.
+   */
+  void flush_tlb() { _tlb_gen++; }
+
+
+  /**
+   * Recompute the paging state if it was changed since the last
+   * flush.  Without a persistent TLB, the guest may have changed its
+   * page tables natively since the last step, so we start over.
+   */
   int init() {
 
-    _paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0x30 | _msr_efer & 0xc00;
+    unsigned paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0x30 | _msr_efer & 0xc00;
+    if (!_tlb_persistent || paging_mode != _paging_mode || READ(cr3) != _paging_cr3) flush_tlb();
+    if (_paging_gen == _tlb_gen) return _fault;
+    _paging_mode = paging_mode;
+    _paging_cr3  = READ(cr3);
 
     // fetch pdpts in leagacy PAE mode
     if ((_paging_mode & 0x80000420) == 0x80000020)
@@ -173,6 +232,7 @@ protected:
 	      tlb_fill_func = &tlb_fill<FEATURE_PSE | FEATURE_PAE | FEATURE_LONG, unsigned long long>;
 	  }
       }
+    _paging_gen = _tlb_gen;
     return _fault;
   }
 
@@ -180,10 +240,10 @@ protected:
   /**
    * Read the len instruction-bytes at the given address into a buffer.
    */
-  int read_code(uintptr_t virt, size_t len, void *buffer)
+  int read_code(uintptr_t virt, size_t len, void *buffer, CacheEntry *&entry)
   {
     assert(len < 16);
-    CacheEntry *entry = find_virtual(virt & ~3, (len + (virt & 3) + 3) & ~3ul, user_access(Type(TYPE_X | TYPE_R)));
+    entry = find_virtual(virt & ~3, (len + (virt & 3) + 3) & ~3ul, user_access(Type(TYPE_X | TYPE_R)));
     if (entry) {
       assert(len <= entry->_len);
       memcpy(buffer, entry->_ptr + (virt & 3), len);
@@ -195,6 +255,18 @@ protected:
   }
 
 
+  /**
+   * Return the RAM page behind virt for bulk accesses, or 0 if it is
+   * not RAM or the translation faults.
+   */
+  char *ram_page(uintptr_t virt, Type type, unsigned **gen = 0)
+  {
+    uintptr_t phys;
+    if (virt_to_phys(virt, type, phys)) return 0;
+    return get_ram_page(phys, type, gen);
+  }
+
+
   int prepare_virtual(uintptr_t virt, size_t len, Type type, void *&ptr)
   {
     bool round = (virt | len) & 3;
@@ -207,5 +279,13 @@ protected:
   }
 
 
-  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion), _cpu(), _pdpt(), _msr_efer(), _paging_mode(), tlb_fill_func() {}
+public:
+  /**
+   * Keep the TLB between steps.  This is only correct if the guest
+   * never runs natively, as it could change page tables or do an
+   * INVLPG behind our back otherwise.
+   */
+  void enable_persistent_tlb() { _tlb_persistent = true; }
+
+  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion), _cpu(), _tlb_gen(1), _pdpt(), _msr_efer(), _paging_mode(), _paging_cr3(), _paging_gen(), _tlb_persistent(), _tlb(), tlb_fill_func() {}
 };
@@ -0,0 +1,997 @@
+/** @file
+ * Translation of hot guest blocks to host code.
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Blocks whose first instruction the interpreter ran _threshold
+ * times are translated to x86-64 code.  Guest and host share the
+ * instruction set, so most instructions are just re-encoded: guest
+ * registers live in R8-R15, the CpuState in RBP and the
+ * TranslationState in RBX.  Memory operands go through a small TLB of
+ * RAM pages that is checked inline.
+ *
+ * Anything else leaves translated code at an instruction boundary and
+ * the interpreter continues with the exact state: TLB misses that are
+ * not RAM or fault, writes to the code of the block and instructions
+ * that are not translated.
+ *
+ * Only flat 32-bit protected mode code is translated.  A translation
+ * hangs off the InstructionCacheEntry of its first instruction and is
+ * invalidated like it, by the write generations of the code pages.
+ */
+#ifdef __x86_64__
+
+  typedef CodeBuffer CB;
+
+  enum {
+    // instructions translated code runs per step
+    TRANSLATION_BUDGET = 4096,
+    // side exits of a translation
+    TRANSLATION_STUBS = 4 * BLOCK_SIZE,
+    // the MTDs translated code reads and writes
+    TRANSLATION_MTD = MTD_GPR_ACDB | MTD_GPR_BSD | MTD_RSP | MTD_RIP_LEN | MTD_RFLAGS
+                    | MTD_DS_ES | MTD_FS_GS | MTD_CS_SS | MTD_CR | MTD_STATE | MTD_INJ,
+  };
+
+  enum {
+    TR_FAIL,
+    TR_NEXT,
+    TR_END,
+  };
+
+  /**
+   * The code after the block that leaves it or fills the TLB.
+   */
+  struct Stub {
+    enum Kind {
+      EXIT,
+      LOOP,
+      SLOW,
+    } kind;
+    unsigned exit;
+    // the jump to the stub
+    unsigned char *jump;
+    // are the arithmetic flags in the host EFLAGS?
+    bool flags;
+    unsigned eip;
+    unsigned done;
+    // SLOW: length and direction of the access and where to retry it
+    unsigned access;
+    unsigned char *retry;
+  };
+
+  struct Translator {
+    Translation *t;
+    unsigned char *body;
+    // are the arithmetic flags in the host EFLAGS?
+    bool flags;
+    unsigned stubs;
+    Stub stub[TRANSLATION_STUBS];
+  };
+
+  /**
+   * A guest instruction of a block, with the prefixes parsed.
+   */
+  struct GuestInsn {
+    InstructionCacheEntry *entry;
+    unsigned eip;
+    unsigned next;
+    // 0x0fxx for two-byte opcodes
+    unsigned op;
+    unsigned modrm;
+    bool o16;
+    bool lock;
+    bool rep;
+  };
+
+  /**
+   * What a modrm instruction does with its operands.
+   */
+  struct Form {
+    enum {
+      RM_READ  = 1 << 0,
+      RM_WRITE = 1 << 1,
+      FL_READ  = 1 << 2,
+      FL_WRITE = 1 << 3,
+      // the reg field is a register and not an opcode extension
+      REG      = 1 << 4,
+      BYTE_REG = 1 << 5,
+      BYTE_RM  = 1 << 6,
+      CL       = 1 << 7,
+      LOCKABLE = 1 << 8,
+      REG_ONLY = 1 << 9,
+    };
+    unsigned flags;
+    // the size of a memory operand
+    unsigned len;
+  };
+
+  Translator _translator;
+  CodeBuffer _code;
+  unsigned char *_code_start;
+  unsigned _threshold;
+  unsigned _translation_tlb_gen;
+  unsigned _translation_cpl;
+  TranslationState _translation;
+  void (*_enter)(TranslationState *state, CpuState *cpu, unsigned char *code);
+  unsigned char *_exit;
+  unsigned char *_exit_flags;
+
+  static unsigned host_reg(unsigned reg) { return CB::R8 + reg; }
+  static unsigned gpr_offset(unsigned reg) { return offsetof(CpuState, eax) + reg * sizeof(mword); }
+
+  enum {
+    EFL_OFFSET    = offsetof(CpuState, efl),
+    EIP_OFFSET    = offsetof(TranslationState, eip),
+    EXIT_OFFSET   = offsetof(TranslationState, exit),
+    LOOPS_OFFSET  = offsetof(TranslationState, loops),
+    TAIL_OFFSET   = offsetof(TranslationState, tail),
+    BUDGET_OFFSET = offsetof(TranslationState, budget),
+    TARGET_OFFSET = offsetof(TranslationState, target),
+    VIRT_OFFSET   = offsetof(TranslationState, virt),
+    TLB_READ      = offsetof(TranslationState, tlb) + offsetof(TranslationState::TlbEntry, read),
+    TLB_WRITE     = offsetof(TranslationState, tlb) + offsetof(TranslationState::TlbEntry, write),
+    TLB_HOST      = offsetof(TranslationState, tlb) + offsetof(TranslationState::TlbEntry, host),
+    TLB_GEN       = offsetof(TranslationState, tlb) + offsetof(TranslationState::TlbEntry, gen),
+  };
+
+
+  /**
+   * Is the guest in a mode we translate code for?
+   */
+  bool translation_mode()
+  {
+    CpuState::Descriptor &cs = _cpu->cs;
+    return _cpu->pm() && !_cpu->v86() && !cs.base && !~cs.limit && (cs.ar & 0x498) == 0x498;
+  }
+
+
+  /**
+   * A present, writable, expand-up 32-bit data segment over the whole
+   * address space.
+   */
+  static bool flat_segment(CpuState::Descriptor &d) { return !d.base && !~d.limit && (d.ar & 0x49e) == 0x492; }
+
+
+  void emit_flags_save()
+  {
+    _code.byte(0x9c);                                 // pushf
+    _code.byte(0x58);                                 // pop rax
+    _code.reg(0x81, 4, CB::RAX); _code.dword(Alu::ARITH);
+    _code.mem(0x8b, CB::RCX, CB::RBP, EFL_OFFSET);
+    _code.reg(0x81, 4, CB::RCX); _code.dword(~unsigned(Alu::ARITH));
+    _code.reg(0x09, CB::RAX, CB::RCX);
+    _code.mem(0x89, CB::RCX, CB::RBP, EFL_OFFSET);
+  }
+
+
+  void emit_flags_load()
+  {
+    _code.mem(0x8b, CB::RCX, CB::RBP, EFL_OFFSET);
+    _code.reg(0x81, 4, CB::RCX); _code.dword(Alu::ARITH);
+    _code.byte(0x51);                                 // push rcx
+    _code.byte(0x9d);                                 // popf
+  }
+
+
+  void flags_to_memory(Translator &tr) { if (tr.flags)  emit_flags_save(); tr.flags = false; }
+  void flags_to_host(Translator &tr)   { if (!tr.flags) emit_flags_load(); tr.flags = true; }
+
+
+  void add_stub(Translator &tr, Stub::Kind kind, unsigned char *jump, unsigned eip, unsigned done,
+		unsigned exit = TranslationState::EXIT_CHAIN, unsigned access = 0, unsigned char *retry = 0)
+  {
+    Stub &s = tr.stub[tr.stubs++];
+    s.kind   = kind;
+    s.exit   = exit;
+    s.jump   = jump;
+    s.flags  = tr.flags;
+    s.eip    = eip;
+    s.done   = done;
+    s.access = access;
+    s.retry  = retry;
+  }
+
+
+  /**
+   * Leave translated code after done instructions of the block.  The
+   * eip was already stored for dynamic exits.
+   */
+  void emit_exit(Translator &tr, unsigned eip, unsigned done, unsigned exit, bool dynamic = false)
+  {
+    if (!dynamic) { _code.mem(0xc7, 0, CB::RBX, EIP_OFFSET); _code.dword(eip); }
+    _code.mem(0xc7, 0, CB::RBX, TAIL_OFFSET); _code.dword(done);
+    _code.mem(0xc7, 0, CB::RBX, EXIT_OFFSET); _code.dword(exit);
+    _code.jmp(tr.flags ? _exit_flags : _exit);
+  }
+
+
+  /**
+   * Emit the guest address of a modrm memory operand into dst.  The
+   * segment base is zero in flat mode.
+   */
+  void emit_address(GuestInsn &g, unsigned dst)
+  {
+    unsigned info = g.entry->modrminfo;
+    unsigned base = CB::NOREG, index = CB::NOREG, scale = 0;
+    unsigned char *disp = g.entry->data + g.entry->offset_opcode + 1;
+    if (info & MRM_SIB) {
+      if (~info & MRM_NOBASE) base = host_reg(info & 7);
+      if (((info >> 3) & 7) != 4) { index = host_reg((info >> 3) & 7); scale = (info >> 6) & 3; }
+      disp++;
+    }
+    else if (info & 0xf || info & MRM_EAX) base = host_reg(info & 7);
+
+    int value = 0;
+    switch ((info >> MRM_DISSHIFT) & 3) {
+    case 1: value = *reinterpret_cast<signed char *>(disp); break;
+    case 3: value = *reinterpret_cast<int *>(disp); break;
+    default: break;
+    }
+    _code.mem(0x8d, dst, base, value, false, index, scale);
+  }
+
+
+  /**
+   * Look up the guest address in EAX in the TLB of translated code and
+   * leave the host address in RDX + RAX.  Misses go to a SLOW stub.
+   * Writes bump the write generation of the page, whose pointer stays
+   * in RSI for emit_written(), and leave the block before they hit its
+   * own code.  The arithmetic flags have to be in memory.
+   */
+  void emit_access(Translator &tr, GuestInsn &g, unsigned done, unsigned len, bool write)
+  {
+    unsigned char *retry = _code.pos();
+    _code.reg(0x89, CB::RAX, CB::RCX);
+    _code.reg(0xc1, 5, CB::RCX); _code.byte(12);
+    _code.reg(0x81, 4, CB::RCX); _code.dword(TranslationState::TLB_SIZE - 1);
+    _code.reg(0xc1, 4, CB::RCX); _code.byte(5);
+    _code.mem(0x8d, CB::RDX, CB::RAX, len - 1);
+    _code.reg(0x81, 4, CB::RDX); _code.dword(~0xfffu);
+    _code.mem(0x3b, CB::RDX, CB::RBX, write ? TLB_WRITE : TLB_READ, false, CB::RCX);
+    add_stub(tr, Stub::SLOW, _code.jcc(CB::CC_NE), g.eip, done, TranslationState::EXIT_INTERPRET, len | (write ? 0x100 : 0), retry);
+    if (write) {
+      _code.mem(0x8b, CB::RSI, CB::RBX, TLB_GEN, true, CB::RCX);
+      for (unsigned i = 0; i < Translation::PAGES; i++) {
+	if (!tr.t->gen_ptr[i]) continue;
+	_code.mov_imm64(CB::RDI, reinterpret_cast<uintptr_t>(tr.t->gen_ptr[i]));
+	_code.reg(0x39, CB::RDI, CB::RSI, true);
+	add_stub(tr, Stub::EXIT, _code.jcc(CB::CC_E), g.eip, done, TranslationState::EXIT_INTERPRET);
+      }
+      _code.byte(0xf0);                             // lock
+      _code.mem(0x83, 0, CB::RSI, 0); _code.byte(1);
+    }
+    _code.mem(0x8b, CB::RDX, CB::RBX, TLB_HOST, true, CB::RCX);
+  }
+
+
+  /**
+   * Bump the write generation in RSI again after the store, like
+   * MemTlb::writes_done(), so that another CPU that read the old
+   * generation before the store cannot miss it.  The host flags are
+   * preserved if they are live.
+   */
+  void emit_written(bool flags)
+  {
+    if (flags) _code.byte(0x9c);                      // pushf
+    _code.byte(0xf0);                                 // lock
+    _code.mem(0x83, 0, CB::RSI, 0); _code.byte(1);
+    if (flags) _code.byte(0x9d);                      // popf
+  }
+
+
+  /**
+   * The segment of a memory operand, if we can translate it.  It has
+   * to be flat now, otherwise every lookup would reject the block.
+   */
+  bool data_segment(GuestInsn &g, unsigned &seg)
+  {
+    seg = (g.entry->prefixes >> 8) & 0xf;
+    return seg < 6 && seg != 1 && flat_segment((&_cpu->es)[seg]);
+  }
+
+
+  unsigned imm_offset(GuestInsn &g)
+  {
+    static const unsigned char disp[] = { 0, 1, 2, 4 };
+    unsigned info = g.entry->modrminfo;
+    return g.entry->offset_opcode + 1 + !!(info & MRM_SIB) + disp[(info >> MRM_DISSHIFT) & 3];
+  }
+
+
+  /**
+   * Classify the modrm instructions that are translated by
+   * re-encoding them.
+   */
+  bool classify(GuestInsn &g, Form &f)
+  {
+    unsigned ext = (g.modrm >> 3) & 7;
+    unsigned size = g.o16 ? 2 : 4;
+    f.flags = 0;
+    f.len = size;
+    if (g.op < 0x40 && (g.op & 7) < 4) {
+      unsigned alu = g.op >> 3;
+      f.flags = Form::REG | (g.op & 2 || alu == 7 ? Form::RM_READ : Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE);
+      f.flags |= (alu == 2 || alu == 3) ? Form::FL_READ | Form::FL_WRITE : Form::FL_WRITE;
+      if (~g.op & 1) f.flags |= Form::BYTE_REG | Form::BYTE_RM;
+    }
+    else switch (g.op) {
+      case 0x69: case 0x6b: case 0x0faf:
+	f.flags = Form::REG | Form::RM_READ | Form::FL_WRITE;
+	break;
+      case 0x80: case 0x81: case 0x83:
+	f.flags = ext == 7 ? Form::RM_READ : Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE;
+	f.flags |= (ext == 2 || ext == 3) ? Form::FL_READ | Form::FL_WRITE : Form::FL_WRITE;
+	if (g.op == 0x80) f.flags |= Form::BYTE_RM;
+	break;
+      case 0x84: case 0x85:
+	f.flags = Form::REG | Form::RM_READ | Form::FL_WRITE | (g.op & 1 ? 0 : Form::BYTE_REG | Form::BYTE_RM);
+	break;
+      case 0x86: case 0x87:
+	f.flags = Form::REG | Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE | (g.op & 1 ? 0 : Form::BYTE_REG | Form::BYTE_RM);
+	break;
+      case 0x88: case 0x89:
+	f.flags = Form::REG | Form::RM_WRITE | (g.op & 1 ? 0 : Form::BYTE_REG | Form::BYTE_RM);
+	break;
+      case 0x8a: case 0x8b:
+	f.flags = Form::REG | Form::RM_READ | (g.op & 1 ? 0 : Form::BYTE_REG | Form::BYTE_RM);
+	break;
+      case 0xc0: case 0xc1: case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+	if (ext == 6) return false;
+	f.flags = Form::RM_READ | Form::RM_WRITE | Form::FL_READ | Form::FL_WRITE;
+	if (~g.op & 1) f.flags |= Form::BYTE_RM;
+	if (g.op >= 0xd2) f.flags |= Form::CL;
+	break;
+      case 0xc6: case 0xc7:
+	if (ext) return false;
+	f.flags = Form::RM_WRITE | (g.op & 1 ? 0 : Form::BYTE_RM);
+	break;
+      case 0xf6: case 0xf7:
+	if (ext == 0)      f.flags = Form::RM_READ | Form::FL_WRITE;
+	else if (ext == 2) f.flags = Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE;
+	else if (ext == 3) f.flags = Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE | Form::FL_WRITE;
+	else return false;
+	if (~g.op & 1) f.flags |= Form::BYTE_RM;
+	break;
+      case 0xfe: case 0xff:
+	if (ext > 1) return false;
+	f.flags = Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE | Form::FL_READ | Form::FL_WRITE;
+	if (~g.op & 1) f.flags |= Form::BYTE_RM;
+	break;
+      case 0x0f40 ... 0x0f4f:
+	f.flags = Form::REG | Form::RM_READ | Form::FL_READ;
+	break;
+      case 0x0f90 ... 0x0f9f:
+	f.flags = Form::RM_WRITE | Form::FL_READ | Form::BYTE_RM;
+	break;
+      case 0x0fa3: case 0x0fab: case 0x0fb3: case 0x0fbb:
+	// the bit offset would address memory outside the operand
+	f.flags = Form::REG | Form::REG_ONLY | Form::RM_READ | Form::FL_READ | Form::FL_WRITE;
+	if (g.op != 0x0fa3) f.flags |= Form::RM_WRITE;
+	break;
+      case 0x0fba:
+	if (ext < 4) return false;
+	f.flags = Form::RM_READ | Form::FL_READ | Form::FL_WRITE | (ext == 4 ? 0 : Form::RM_WRITE | Form::LOCKABLE);
+	break;
+      case 0x0fb6: case 0x0fbe:
+	f.flags = Form::REG | Form::RM_READ | Form::BYTE_RM;
+	break;
+      case 0x0fb7: case 0x0fbf:
+	f.flags = Form::REG | Form::RM_READ;
+	f.len = 2;
+	break;
+      case 0x0fbc: case 0x0fbd:
+	f.flags = Form::REG | Form::RM_READ | Form::FL_WRITE;
+	break;
+      case 0x0fa4: case 0x0fac:
+	f.flags = Form::REG | Form::RM_READ | Form::RM_WRITE | Form::FL_READ | Form::FL_WRITE;
+	break;
+      case 0x0fa5: case 0x0fad:
+	f.flags = Form::REG | Form::RM_READ | Form::RM_WRITE | Form::FL_READ | Form::FL_WRITE | Form::CL;
+	break;
+      case 0x0fc0: case 0x0fc1:
+	f.flags = Form::REG | Form::RM_READ | Form::RM_WRITE | Form::LOCKABLE | Form::FL_WRITE;
+	if (~g.op & 1) f.flags |= Form::BYTE_REG | Form::BYTE_RM;
+	break;
+      default:
+	return false;
+      }
+    if (f.flags & Form::BYTE_RM) f.len = 1;
+
+    // AH-BH have no encoding next to R8-R15
+    bool mod3 = (g.modrm & 0xc0) == 0xc0;
+    if (f.flags & Form::BYTE_REG && ext >= 4) return false;
+    if (f.flags & Form::BYTE_RM && mod3 && (g.modrm & 7) >= 4) return false;
+    if (f.flags & Form::REG_ONLY && !mod3) return false;
+    if (g.lock && (mod3 || ~f.flags & Form::LOCKABLE)) return false;
+    unsigned seg;
+    return mod3 || data_segment(g, seg);
+  }
+
+
+  /**
+   * A modrm instruction, re-encoded for the host.
+   */
+  void emit_modrm(Translator &tr, GuestInsn &g, unsigned done, Form &f)
+  {
+    unsigned reg = (g.modrm >> 3) & 7;
+    if (f.flags & Form::REG) reg = host_reg(reg);
+    unsigned imm = imm_offset(g);
+    if ((g.modrm & 0xc0) == 0xc0) {
+      if (f.flags & Form::FL_READ) flags_to_host(tr);
+      if (f.flags & Form::CL) _code.reg(0x89, host_reg(1), CB::RCX);
+      if (g.o16) _code.byte(0x66);
+      _code.reg(g.op, reg, host_reg(g.modrm & 7));
+    }
+    else {
+      unsigned seg;
+      data_segment(g, seg);
+      tr.t->segments |= 1 << seg;
+      flags_to_memory(tr);
+      emit_address(g, CB::RAX);
+      emit_access(tr, g, done, f.len, f.flags & Form::RM_WRITE);
+      if (f.flags & Form::FL_READ) flags_to_host(tr);
+      if (f.flags & Form::CL) _code.reg(0x89, host_reg(1), CB::RCX);
+      if (g.o16)  _code.byte(0x66);
+      if (g.lock) _code.byte(0xf0);
+      _code.mem(g.op, reg, CB::RDX, 0, false, CB::RAX);
+    }
+    _code.bytes(g.entry->data + imm, g.entry->inst_len - imm);
+    if (f.flags & Form::FL_WRITE) tr.flags = true;
+    if ((g.modrm & 0xc0) != 0xc0 && f.flags & Form::RM_WRITE) emit_written(tr.flags);
+  }
+
+
+  /**
+   * Push value, a register or an immediate, to the guest stack.
+   */
+  void emit_push(Translator &tr, GuestInsn &g, unsigned done, unsigned size, unsigned reg, unsigned value = 0)
+  {
+    tr.t->segments |= 1 << 2;
+    flags_to_memory(tr);
+    _code.mem(0x8d, CB::RAX, host_reg(4), -size);
+    emit_access(tr, g, done, size, true);
+    if (size == 2) _code.byte(0x66);
+    if (reg != CB::NOREG) _code.mem(0x89, reg, CB::RDX, 0, false, CB::RAX);
+    else {
+      _code.mem(0xc7, 0, CB::RDX, 0, false, CB::RAX);
+      if (size == 2) { _code.byte(value); _code.byte(value >> 8); } else _code.dword(value);
+    }
+    emit_written(tr.flags);
+    _code.reg(0x89, CB::RAX, host_reg(4));
+  }
+
+
+  /**
+   * Pop size bytes from the guest stack at base into ECX.
+   */
+  void emit_pop(Translator &tr, GuestInsn &g, unsigned done, unsigned size, unsigned base, unsigned extra = 0)
+  {
+    tr.t->segments |= 1 << 2;
+    flags_to_memory(tr);
+    _code.reg(0x89, base, CB::RAX);
+    emit_access(tr, g, done, size, false);
+    if (size == 2) _code.byte(0x66);
+    _code.mem(0x8b, CB::RCX, CB::RDX, 0, false, CB::RAX);
+    _code.mem(0x8d, host_reg(4), base, size + extra);
+  }
+
+
+  /**
+   * Translate a guest instruction.  Nothing is emitted if it fails.
+   */
+  unsigned translate_insn(Translator &tr, GuestInsn &g, unsigned done)
+  {
+    Form f;
+    if (classify(g, f)) {
+      emit_modrm(tr, g, done, f);
+      return TR_NEXT;
+    }
+    if (g.lock || (g.rep && g.op != 0xc3)) return TR_FAIL;
+
+    unsigned size = g.o16 ? 2 : 4;
+    unsigned ext = (g.modrm >> 3) & 7;
+    bool mod3 = (g.modrm & 0xc0) == 0xc0;
+    bool stack = flat_segment(_cpu->ss);
+    const unsigned char *imm = g.entry->data + g.entry->offset_opcode;
+    unsigned imm_len = g.entry->inst_len - g.entry->offset_opcode;
+    unsigned seg = 3;
+
+    // ALU instructions with AL or EAX and an immediate
+    if (g.op < 0x40 && ((g.op & 7) == 4 || (g.op & 7) == 5)) {
+      unsigned alu = g.op >> 3;
+      if (alu == 2 || alu == 3) flags_to_host(tr);
+      if (g.o16) _code.byte(0x66);
+      _code.reg(g.op & 1 ? 0x81 : 0x80, alu, host_reg(0));
+      _code.bytes(imm, imm_len);
+      tr.flags = true;
+      return TR_NEXT;
+    }
+
+    switch (g.op) {
+    case 0x40 ... 0x4f:
+      flags_to_host(tr);
+      if (g.o16) _code.byte(0x66);
+      _code.reg(0xff, (g.op >> 3) & 1, host_reg(g.op & 7));
+      return TR_NEXT;
+    case 0x50 ... 0x57:
+      if (!stack) return TR_FAIL;
+      emit_push(tr, g, done, size, host_reg(g.op & 7));
+      return TR_NEXT;
+    case 0x58 ... 0x5f:
+      if (!stack) return TR_FAIL;
+      emit_pop(tr, g, done, size, host_reg(4));
+      if (g.o16) _code.byte(0x66);
+      _code.reg(0x89, CB::RCX, host_reg(g.op & 7));
+      return TR_NEXT;
+    case 0x68:
+      if (!stack) return TR_FAIL;
+      emit_push(tr, g, done, size, CB::NOREG, g.o16 ? *reinterpret_cast<const unsigned short *>(imm) : *reinterpret_cast<const unsigned *>(imm));
+      return TR_NEXT;
+    case 0x6a:
+      if (!stack) return TR_FAIL;
+      emit_push(tr, g, done, size, CB::NOREG, static_cast<signed char>(imm[0]));
+      return TR_NEXT;
+    case 0x8d:
+      if (mod3 || g.o16) return TR_FAIL;
+      emit_address(g, host_reg(ext));
+      return TR_NEXT;
+    case 0x90:
+      return TR_NEXT;
+    case 0x91 ... 0x97:
+      if (g.o16) _code.byte(0x66);
+      _code.reg(0x87, host_reg(0), host_reg(g.op & 7));
+      return TR_NEXT;
+    case 0x98:
+      if (g.o16) _code.byte(0x66);
+      _code.reg(g.o16 ? 0x0fbe : 0x0fbf, host_reg(0), host_reg(0));
+      return TR_NEXT;
+    case 0x99:
+      if (g.o16) _code.byte(0x66);
+      _code.reg(0x89, host_reg(0), CB::RAX);
+      if (g.o16) _code.byte(0x66);
+      _code.byte(0x99);
+      if (g.o16) _code.byte(0x66);
+      _code.reg(0x89, CB::RDX, host_reg(2));
+      return TR_NEXT;
+    case 0xa0 ... 0xa3:
+      if (!data_segment(g, seg)) return TR_FAIL;
+      tr.t->segments |= 1 << seg;
+      flags_to_memory(tr);
+      _code.mov_imm(CB::RAX, *reinterpret_cast<const unsigned *>(imm));
+      emit_access(tr, g, done, g.op & 1 ? size : 1, g.op >= 0xa2);
+      if (g.o16 && g.op & 1) _code.byte(0x66);
+      _code.mem(g.op >= 0xa2 ? 0x88 | (g.op & 1) : 0x8a | (g.op & 1), host_reg(0), CB::RDX, 0, false, CB::RAX);
+      if (g.op >= 0xa2) emit_written(tr.flags);
+      return TR_NEXT;
+    case 0xa8: case 0xa9:
+      if (g.o16) _code.byte(0x66);
+      _code.reg(g.op == 0xa8 ? 0xf6 : 0xf7, 0, host_reg(0));
+      _code.bytes(imm, imm_len);
+      tr.flags = true;
+      return TR_NEXT;
+    case 0xb0 ... 0xb3:
+      _code.rex(false, CB::NOREG, CB::NOREG, host_reg(g.op & 7));
+      _code.byte(0xb0 | (g.op & 7));
+      _code.byte(imm[0]);
+      return TR_NEXT;
+    case 0xb8 ... 0xbf:
+      if (g.o16) _code.byte(0x66);
+      _code.rex(false, CB::NOREG, CB::NOREG, host_reg(g.op & 7));
+      _code.byte(0xb8 | (g.op & 7));
+      _code.bytes(imm, size);
+      return TR_NEXT;
+    case 0xc9:
+      if (g.o16 || !stack) return TR_FAIL;
+      emit_pop(tr, g, done, 4, host_reg(5));
+      _code.reg(0x89, CB::RCX, host_reg(5));
+      return TR_NEXT;
+    case 0xc2: case 0xc3:
+      if (g.o16 || !stack) return TR_FAIL;
+      emit_pop(tr, g, done, 4, host_reg(4), g.op == 0xc2 ? *reinterpret_cast<const unsigned short *>(imm) : 0);
+      _code.mem(0x89, CB::RCX, CB::RBX, EIP_OFFSET);
+      emit_exit(tr, 0, done + 1, TranslationState::EXIT_CHAIN, true);
+      return TR_END;
+    case 0xe8:
+      if (g.o16 || !stack) return TR_FAIL;
+      emit_push(tr, g, done, 4, CB::NOREG, g.next);
+      emit_exit(tr, g.next + *reinterpret_cast<const int *>(imm), done + 1, TranslationState::EXIT_CHAIN);
+      return TR_END;
+    case 0xe9: case 0xeb: {
+      if (g.o16) return TR_FAIL;
+      unsigned target = g.next + (g.op == 0xeb ? static_cast<signed char>(imm[0]) : *reinterpret_cast<const int *>(imm));
+      if (target == tr.t->linear)
+	add_stub(tr, Stub::LOOP, _code.jmp(), target, done + 1);
+      else
+	emit_exit(tr, target, done + 1, TranslationState::EXIT_CHAIN);
+      return TR_END;
+    }
+    case 0x70 ... 0x7f: case 0x0f80 ... 0x0f8f: {
+      if (g.o16) return TR_FAIL;
+      unsigned target = g.next + (g.op < 0x80 ? static_cast<signed char>(imm[0]) : *reinterpret_cast<const int *>(imm));
+      flags_to_host(tr);
+      add_stub(tr, target == tr.t->linear ? Stub::LOOP : Stub::EXIT, _code.jcc(g.op & 0xf), target, done + 1);
+      return TR_NEXT;
+    }
+    case 0xff:
+      if (ext == 6 && mod3) {
+	if (!stack) return TR_FAIL;
+	emit_push(tr, g, done, size, host_reg(g.modrm & 7));
+	return TR_NEXT;
+      }
+      if ((ext != 2 && ext != 4) || g.o16 || (ext == 2 && !stack) || (!mod3 && !data_segment(g, seg))) return TR_FAIL;
+      if (mod3)
+	_code.mem(0x89, host_reg(g.modrm & 7), CB::RBX, TARGET_OFFSET);
+      else {
+	tr.t->segments |= 1 << seg;
+	flags_to_memory(tr);
+	emit_address(g, CB::RAX);
+	emit_access(tr, g, done, 4, false);
+	_code.mem(0x8b, CB::RCX, CB::RDX, 0, false, CB::RAX);
+	_code.mem(0x89, CB::RCX, CB::RBX, TARGET_OFFSET);
+      }
+      if (ext == 2) emit_push(tr, g, done, 4, CB::NOREG, g.next);
+      _code.mem(0x8b, CB::RCX, CB::RBX, TARGET_OFFSET);
+      _code.mem(0x89, CB::RCX, CB::RBX, EIP_OFFSET);
+      emit_exit(tr, 0, done + 1, TranslationState::EXIT_CHAIN, true);
+      return TR_END;
+    case 0x0fc8 ... 0x0fcf:
+      if (g.o16) return TR_FAIL;
+      _code.rex(false, CB::NOREG, CB::NOREG, host_reg(g.op & 7));
+      _code.byte(0x0f);
+      _code.byte(0xc8 | (g.op & 7));
+      return TR_NEXT;
+    default:
+      return TR_FAIL;
+    }
+  }
+
+
+  void emit_stub(Translator &tr, Stub &s)
+  {
+    _code.patch(s.jump, _code.pos());
+    tr.flags = s.flags;
+    switch (s.kind) {
+    case Stub::EXIT:
+      emit_exit(tr, s.eip, s.done, s.exit);
+      break;
+    case Stub::LOOP: {
+      // count the iteration and go around again, as long as the budget lasts
+      flags_to_memory(tr);
+      _code.mem(0x81, 0, CB::RBX, LOOPS_OFFSET);  _code.dword(s.done);
+      _code.mem(0x81, 5, CB::RBX, BUDGET_OFFSET); _code.dword(s.done);
+      unsigned char *out = _code.jcc(CB::CC_LE);
+      _code.jmp(tr.body);
+      _code.patch(out, _code.pos());
+      emit_exit(tr, s.eip, 0, TranslationState::EXIT_CHAIN);
+      break;
+    }
+    case Stub::SLOW: {
+      // the fill helper may clobber R8-R11
+      for (unsigned i = 0; i < 4; i++) _code.mem(0x89, host_reg(i), CB::RBP, gpr_offset(i));
+      _code.mem(0x89, CB::RAX, CB::RBX, VIRT_OFFSET);
+      _code.reg(0x89, CB::RBX, CB::RDI, true);
+      _code.reg(0x89, CB::RAX, CB::RSI);
+      _code.mov_imm(CB::RDX, s.access);
+      _code.call(reinterpret_cast<const void *>(&translation_fill));
+      for (unsigned i = 0; i < 4; i++) _code.mem(0x8b, host_reg(i), CB::RBP, gpr_offset(i));
+      _code.reg(0x85, CB::RAX, CB::RAX);
+      unsigned char *fail = _code.jcc(CB::CC_E);
+      _code.mem(0x8b, CB::RAX, CB::RBX, VIRT_OFFSET);
+      _code.jmp(s.retry);
+      _code.patch(fail, _code.pos());
+      emit_exit(tr, s.eip, s.done, s.exit);
+      break;
+    }
+    }
+  }
+
+
+  /**
+   * Parse the prefixes and the opcode of a cached instruction.
+   */
+  bool decode(InstructionCacheEntry *entry, unsigned eip, GuestInsn &g)
+  {
+    g.entry = entry;
+    g.eip = eip;
+    g.next = eip + entry->inst_len;
+    g.o16 = g.lock = g.rep = false;
+    unsigned i = 0;
+    for (;; i++) {
+      unsigned char b = entry->data[i];
+      if (b == 0x66)      g.o16 = true;
+      else if (b == 0xf0) g.lock = true;
+      else if (b == 0xf3) g.rep = true;
+      else if (b != 0x26 && b != 0x2e && b != 0x36 && b != 0x3e && b != 0x64 && b != 0x65) break;
+    }
+    g.op = entry->data[i++];
+    if (g.op == 0x0f) g.op = 0x0f00 | entry->data[i++];
+    g.modrm = i < entry->inst_len ? entry->data[i] : 0;
+    return i == entry->offset_opcode && entry->address_size == 2 && g.o16 == (entry->operand_size == 1);
+  }
+
+
+  /**
+   * Add the code pages of an entry to those of a block.
+   */
+  static bool add_pages(InstructionCacheEntry *entry, unsigned **gen_ptr, unsigned *gen)
+  {
+    if (entry->untracked || !entry->gen_ptr[0]) return false;
+    for (unsigned i = 0; i < 2 && entry->gen_ptr[i]; i++) {
+      unsigned j = 0;
+      while (j < Translation::PAGES && gen_ptr[j] && gen_ptr[j] != entry->gen_ptr[i]) j++;
+      if (j == Translation::PAGES) return false;
+      gen_ptr[j] = entry->gen_ptr[i];
+      gen[j] = entry->gen[i];
+    }
+    return true;
+  }
+
+
+  void flush_translations()
+  {
+    for (unsigned i = 0; i < SIZE*ASSOZ; i++) {
+      _values[i].translation = 0;
+      _values[i].hits = 0;
+    }
+    _code.reset(_code_start);
+  }
+
+
+  /**
+   * Translate the straight-line code the interpreter chained to head.
+   */
+  void translate(InstructionCacheEntry *head)
+  {
+    InstructionCacheEntry *entries[BLOCK_SIZE];
+    unsigned *gen_ptr[Translation::PAGES] = {};
+    unsigned gen[Translation::PAGES] = {};
+    unsigned linear = _tags[head - _values];
+    unsigned length = 0, n = 0;
+    for (InstructionCacheEntry *e = head; e && n < BLOCK_SIZE; e = e->next) {
+      if (_tags[e - _values] != linear + length || e->cs_ar != head->cs_ar || !e->inst_len
+	  || !unmodified(e) || !add_pages(e, gen_ptr, gen)) break;
+      entries[n++] = e;
+      length += e->inst_len;
+    }
+    if (!n) return;
+
+    unsigned char *start = _code.pos();
+    Translation *t = reinterpret_cast<Translation *>(_code.alloc(sizeof(Translation) + length));
+    if (!t) { flush_translations(); return; }
+    t->linear = linear;
+    t->length = length;
+    t->segments = 0;
+    memcpy(t->gen_ptr, gen_ptr, sizeof(gen_ptr));
+    memcpy(t->gen, gen, sizeof(gen));
+    t->tlb_gen = _tlb_gen;
+    for (unsigned i = 0, pos = 0; i < n; pos += entries[i++]->inst_len)
+      memcpy(t->guest + pos, entries[i]->data, entries[i]->inst_len);
+
+    Translator &tr = _translator;
+    _code.align(16);
+    t->code = tr.body = _code.pos();
+    tr.t = t;
+    tr.flags = false;
+    tr.stubs = 0;
+
+    unsigned done = 0, eip = linear, res = TR_NEXT;
+    while (done < n && res == TR_NEXT) {
+      GuestInsn g;
+      if (tr.stubs + 8 > TRANSLATION_STUBS) break;
+      if (!decode(entries[done], eip, g)) { res = TR_FAIL; break; }
+      res = translate_insn(tr, g, done);
+      if (res == TR_FAIL) break;
+      eip = g.next;
+      done++;
+    }
+    if (!done) { _code.reset(start); return; }
+    if (res != TR_END)
+      emit_exit(tr, eip, done, res == TR_FAIL ? TranslationState::EXIT_INTERPRET : TranslationState::EXIT_CHAIN);
+    for (unsigned i = 0; i < tr.stubs; i++) emit_stub(tr, tr.stub[i]);
+    if (_code.overflow()) { flush_translations(); return; }
+
+    head->translation = t;
+  }
+
+
+  /**
+   * Count the runs of the block starting with entry and translate it
+   * once it is hot.
+   */
+  void count_block(InstructionCacheEntry *entry)
+  {
+    if (!_threshold || entry->translation || entry->hits >= _threshold || !translation_mode()) return;
+    if (++entry->hits == _threshold) translate(entry);
+  }
+
+
+  /**
+   * Are the segments the translation uses still flat?
+   */
+  bool segments_flat(Translation *t)
+  {
+    for (unsigned i = 0; i < 6; i++)
+      if (t->segments & (1 << i) && !flat_segment((&_cpu->es)[i])) return false;
+    return true;
+  }
+
+
+  /**
+   * Is the translation still valid?  The code is compared again if its
+   * pages were written or the TLB was flushed.
+   */
+  bool translation_valid(Translation *t)
+  {
+    if (t->tlb_gen == _tlb_gen && *t->gen_ptr[0] == t->gen[0] && (!t->gen_ptr[1] || *t->gen_ptr[1] == t->gen[1]))
+      return true;
+
+    // The code pages have to be the same, their generations are part of the code.
+    mword cr2 = _cpu->cr2;
+    unsigned page = t->linear & ~0xfffu, pages = ((t->linear + t->length - 1) >> 12) - (t->linear >> 12) + 1;
+    bool res = true;
+    for (unsigned i = 0; i < pages && res; i++, page += 0x1000) {
+      unsigned *gen = 0;
+      char *ptr = ram_page(page, user_access(Type(TYPE_X | TYPE_R)), &gen);
+      if (!ptr || gen != t->gen_ptr[i]) { res = false; break; }
+      unsigned start = i ? page : t->linear;
+      unsigned end = i + 1 < pages ? page + 0x1000 : t->linear + t->length;
+      res = !memcmp(ptr + (start & 0xfff), t->guest + (start - t->linear), end - start);
+      t->gen[i] = *gen;
+    }
+    _fault = 0;
+    _cpu->cr2 = cr2;
+    if (res) t->tlb_gen = _tlb_gen;
+    return res;
+  }
+
+
+  Translation *find_translation(unsigned linear)
+  {
+    unsigned s = slot(linear);
+    for (unsigned i = s; i < s + ASSOZ; i++) {
+      Translation *t = _values[i].translation;
+      if (!t || _tags[i] != linear || _values[i].cs_ar != _cpu->cs.ar) continue;
+      if (!segments_flat(t)) {
+	// The guest changed a segment under the block.  The hits stay at
+	// the threshold, so it is not translated again before a flush.
+	_values[i].translation = 0;
+	continue;
+      }
+      if (translation_valid(t)) return t;
+      _values[i].translation = 0;
+      _values[i].hits = 0;
+    }
+    return 0;
+  }
+
+
+  /**
+   * Put the RAM page of an access into the TLB of translated code.
+   */
+  bool fill_translation_tlb(unsigned virt, unsigned len, bool write)
+  {
+    if ((virt ^ (virt + len - 1)) & ~0xfffu) return false;
+    mword cr2 = _cpu->cr2;
+    unsigned *gen = 0;
+    char *ptr = ram_page(virt, user_access(write ? TYPE_W : TYPE_R), &gen);
+    _fault = 0;
+    _cpu->cr2 = cr2;
+    if (!ptr || !gen) return false;
+
+    unsigned page = virt & ~0xfffu;
+    TranslationState::TlbEntry &e = _translation.tlb[(virt >> 12) % TranslationState::TLB_SIZE];
+    if (e.read != page) e.write = 1;
+    e.read = page;
+    if (write) e.write = page;
+    e.host = reinterpret_cast<uintptr_t>(ptr) - page;
+    e.gen  = gen;
+    return true;
+  }
+
+
+  static unsigned translation_fill(TranslationState *state, unsigned virt, unsigned access)
+  {
+    return state->cache->fill_translation_tlb(virt, access & 0xff, access & 0x100);
+  }
+
+
+  /**
+   * Run translated blocks as long as they chain into each other.
+   */
+  void run_translations(unsigned &mtr_out)
+  {
+    if (!_threshold || debug || (_mtr_in & TRANSLATION_MTD) != TRANSLATION_MTD || !translation_mode()
+	|| _cpu->intr_state & 3 || _cpu->inj_info & 0x80000000 || _cpu->efl & EFL_TF) return;
+
+    if (_translation_tlb_gen != _tlb_gen || _translation_cpl != _cpu->cpl()) {
+      for (unsigned i = 0; i < TranslationState::TLB_SIZE; i++)
+	_translation.tlb[i].read = _translation.tlb[i].write = 1;
+      _translation_tlb_gen = _tlb_gen;
+      _translation_cpl = _cpu->cpl();
+    }
+
+    unsigned long long done = 0;
+    _translation.budget = TRANSLATION_BUDGET;
+    while (_translation.budget > 0 && !_vcpu->event_pending(_cpu->efl & EFL_IF)) {
+      Translation *t = find_translation(_cpu->eip);
+      if (!t) break;
+      flags_materialize();
+      _translation.loops = 0;
+      _enter(&_translation, _cpu, t->code);
+      _cpu->eip = _translation.eip;
+      _translation.budget -= _translation.tail;
+      done += _translation.loops + _translation.tail;
+      if (_translation.exit != TranslationState::EXIT_CHAIN) break;
+    }
+    if (!done) return;
+    _vcpu->stats.instructions += done;
+    mtr_out |= MTD_RIP_LEN | MTD_GPR_ACDB | MTD_GPR_BSD | MTD_RSP | MTD_RFLAGS;
+  }
+
+
+  /**
+   * The entry and exit code that all translations share.
+   */
+  void emit_trampolines()
+  {
+    static const unsigned char save[]    = { 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 };
+    static const unsigned char restore[] = { 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3 };
+
+    // enter(state, cpu, code)
+    _enter = reinterpret_cast<void (*)(TranslationState *, CpuState *, unsigned char *)>(_code.pos());
+    _code.bytes(save, sizeof(save));
+    _code.reg(0x83, 5, CB::RSP, true); _code.byte(8);
+    _code.reg(0x89, CB::RDI, CB::RBX, true);
+    _code.reg(0x89, CB::RSI, CB::RBP, true);
+    for (unsigned i = 0; i < 8; i++) _code.mem(0x8b, host_reg(i), CB::RBP, gpr_offset(i));
+    _code.reg(0xff, 4, CB::RDX);
+
+    _exit_flags = _code.pos();
+    emit_flags_save();
+    _exit = _code.pos();
+    for (unsigned i = 0; i < 8; i++) _code.mem(0x89, host_reg(i), CB::RBP, gpr_offset(i));
+    _code.reg(0x83, 0, CB::RSP, true); _code.byte(8);
+    _code.bytes(restore, sizeof(restore));
+  }
+
+public:
+  /**
+   * Translate blocks that ran threshold times into the given
+   * executable memory.
+   */
+  void enable_translation(void *code, size_t size, unsigned threshold)
+  {
+    _code = CodeBuffer(code, size);
+    _translation.cache = this;
+    emit_trampolines();
+    _code.align(16);
+    _code_start = _code.pos();
+    _threshold = _code.overflow() ? 0 : threshold;
+  }
+private:
+
+#else
+
+  void count_block(InstructionCacheEntry *entry) {}
+  void run_translations(unsigned &mtr_out) {}
+
+public:
+  void enable_translation(void *code, size_t size, unsigned threshold) {}
+private:
+
+#endif
@@ -86,6 +86,21 @@ private:
   uintptr_t _modaddr;
   unsigned _lowmem;
 
+  struct MapArg {
+    DBus<MessageHostOp> *bus;
+    unsigned module;
+  };
+
+  /**
+   * Let the host map ELF segments directly from the module file.
+   */
+  static bool map_segment(void *arg, char *dst, size_t offset, size_t len)
+  {
+    MapArg *a = reinterpret_cast<MapArg *>(arg);
+    MessageHostOp msg(MessageHostOp::map_module(a->module, dst, offset, len));
+    return len && a->bus->send(msg);
+  }
+
   /**
    * Initialize an MBI from the hip.
    */
@@ -109,7 +124,10 @@ private:
 	switch(modcount)
 	  {
 	  case 0:
-	    if (Elf::decode_elf(msg2.start, msg2.size, physmem, rip, offset, memsize, 0, 0)) return 0;
+	    {
+	      MapArg arg = { &_mb.bus_hostop, modcount + 1 };
+	      if (Elf::decode_elf(msg2.start, msg2.size, physmem, rip, offset, memsize, 0, 0, map_segment, &arg)) return 0;
+	    }
 	    offset = (offset + 0xfff) & ~0xffful;
 	    mbi = offset;
 	    offset += 0x1000;
@@ -191,7 +191,7 @@ public:
 
         // XXX Lock?
         unsigned tail = _hwreg[TDT0];
-        memcpy(_tx_buf[tail], nmsg.buffer, nmsg.len);
+        nmsg.copy(_tx_buf[tail], sizeof(_tx_buf[tail]));
 
         // If the dma descriptor is not zero, it is still in use.
         if ((_tx_ring[tail].lo | _tx_ring[tail].hi) != 0) return false;
@@ -137,6 +137,11 @@ public:
     switch (msg.type) {
     case MessageNetwork::PACKET:
       if (msg.buffer >= _receive_buffer && msg.buffer < _receive_buffer + BUFFER_SIZE) return false;
+      if (msg.fragcount) {
+        unsigned char packet[(PG_START - PG_TX) * PAGE_SIZE];
+        if (msg.len > sizeof(packet)) return false;
+        return send_packet(packet, msg.copy(packet, sizeof(packet)));
+      }
       return send_packet(msg.buffer, msg.len);
     case MessageNetwork::QUERY_MAC:
       msg.mac = Endian::hton64(_mac.raw) >> 16;
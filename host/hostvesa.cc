@@ -166,6 +166,10 @@ public:
       case MessageHostOp::OP_ATTACH_MSI:
 	// forward to the host
 	return _hostmb.bus_hostop.send(msg);
+      case MessageHostOp::OP_GUEST_MEM_TRACKED:
+      case MessageHostOp::OP_VCPU_EMULATED:
+	// the VESA BIOS runs only in the instruction emulator
+	return true;
       case MessageHostOp::OP_VCPU_BLOCK:
 	// invalid value, to abort the loop
 	_cpu.actv_state = 0x80000000;
@@ -174,6 +178,7 @@ public:
       case MessageHostOp::OP_VCPU_RELEASE:
       case MessageHostOp::OP_NOTIFY_IRQ:
       case MessageHostOp::OP_GET_MODULE:
+      case MessageHostOp::OP_MAP_MODULE:
       case MessageHostOp::OP_GET_MAC:
       case MessageHostOp::OP_VIRT_TO_PHYS:
       case MessageHostOp::OP_ALLOC_FROM_GUEST:
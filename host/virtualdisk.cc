@@ -31,6 +31,7 @@ class VirtualDisk : public StaticReceiver<VirtualDisk>
 {
 
   DBus<MessageDiskCommit> &_bus_commit;
+  DBus<MessageMemRegion>  &_bus_memregion;
   unsigned      _disknr;
   char *        _data;
   unsigned long _length;
@@ -54,8 +55,14 @@ public:
 	      status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE | (i << MessageDisk::DISK_STATUS_SHIFT));
 	      break;
 	    }
-	  if (msg.type == MessageDisk::DISK_READ)
+	  if (msg.type == MessageDisk::DISK_READ) {
 	    memcpy(reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset), start, end - start);
+
+	    // Let the instruction emulator know about modified code.
+	    MessageMemRegion mmsg(msg.dma[i].byteoffset >> 12);
+	    if (_bus_memregion.send(mmsg, true))
+	      mmsg.written(msg.dma[i].byteoffset, msg.dma[i].bytecount);
+	  }
 	  else
 	    memcpy(start, reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset), end - start);
 	  offset += end - start;
@@ -83,8 +90,8 @@ public:
   }
 
 
-  VirtualDisk(DBus<MessageDiskCommit> &bus_commit, unsigned disknr, char *data, unsigned long length, const char *cmdline) :
-    _bus_commit(bus_commit), _disknr(disknr), _data(data), _length(length), _cmdline(cmdline) {}
+  VirtualDisk(DBus<MessageDiskCommit> &bus_commit, DBus<MessageMemRegion> &bus_memregion, unsigned disknr, char *data, unsigned long length, const char *cmdline) :
+    _bus_commit(bus_commit), _bus_memregion(bus_memregion), _disknr(disknr), _data(data), _length(length), _cmdline(cmdline) {}
 };
 
 PARAM_HANDLER(vdisk,
@@ -126,7 +133,7 @@ PARAM_HANDLER(vdisk,
 		  fileinfo.name, fileinfo.size, mb.bus_disk.count());
           
 
-  VirtualDisk * dev = new VirtualDisk(mb.bus_diskcommit,
+  VirtualDisk * dev = new VirtualDisk(mb.bus_diskcommit, mb.bus_memregion,
 				      mb.bus_disk.count(),
 				      module,
 				      fileinfo.size,
@@ -144,7 +151,7 @@ PARAM_HANDLER(vdisk_empty,
 
   Logging::printf("vdisk_empty: Attached as vdisk %u.\n", mb.bus_disk.count());
 
-  VirtualDisk * dev = new VirtualDisk(mb.bus_diskcommit,
+  VirtualDisk * dev = new VirtualDisk(mb.bus_diskcommit, mb.bus_memregion,
 				      mb.bus_disk.count(),
 				      buffer,
 				      size,
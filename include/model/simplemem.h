@@ -29,8 +29,10 @@ bool copy_inout(uintptr_t address, void *ptr, size_t count, bool read)
   if (!_bus_memregion->send(msg) || !msg.ptr || ((address + count) > ((msg.start_page + msg.count) << 12))) return false;
   if (read)
     memcpy(ptr, msg.ptr + (address - (msg.start_page << 12)), count);
-  else
+  else {
     memcpy(msg.ptr + (address - (msg.start_page << 12)), ptr, count);
+    msg.written(address, count);
+  }
   return true;
 }
 
@@ -56,11 +58,12 @@ bool copy_out(uintptr_t address, void *ptr, size_t count)
   }
   assert(!(address & 3));
   while (count >= 4) {
-    MessageMem msg(false, address, reinterpret_cast<unsigned *>(p));
+    size_t l = VMM_MIN(count, 0x1000 - (address & 0xfff)) & ~3;
+    MessageMem msg(false, address, reinterpret_cast<unsigned *>(p), l / 4);
     if (!_bus_mem->send(msg, true)) return false;
-    address += 4;
-    p       += 4;
-    count   -= 4;
+    address += l;
+    p       += l;
+    count   -= l;
   }
   if (count) {
     unsigned value;
@@ -95,11 +98,12 @@ bool copy_in(uintptr_t address, void *ptr, size_t count)
   }
   assert(!(address & 3));
   while (count >= 4) {
-    MessageMem msg(true, address, reinterpret_cast<unsigned *>(p));
+    size_t l = VMM_MIN(count, 0x1000 - (address & 0xfff)) & ~3;
+    MessageMem msg(true, address, reinterpret_cast<unsigned *>(p), l / 4);
     if (!_bus_mem->send(msg, true)) return false;
-    address += 4;
-    p       += 4;
-    count   -= 4;
+    address += l;
+    p       += l;
+    count   -= l;
   }
   if (count) {
     unsigned value;
@@ -19,6 +19,7 @@
 
 #include "service/logging.h"
 #include "service/string.h"
+#include "service/cpu.h"
 
 /**
  * The generic Device used in generic bus transactions.
@@ -30,10 +31,45 @@ public:
   void debug_dump() {
     Logging::printf("\t%s\n", _debug_name);
   }
+  const char *debug_name() const { return _debug_name; }
   Device(const char *debug_name) :_debug_name(debug_name) {}
 };
 
 
+/**
+ * A lock for busses that are used from different threads.  It is
+ * taken around every send, thus it has to be recursive.
+ */
+typedef void (*BusLockFunction)(void *lock, bool acquire);
+
+
+/**
+ * Where profiling output goes. It takes printf-style arguments.
+ */
+typedef void (*ProfileFunction)(void *data, const char *format, ...);
+
+
+/**
+ * The address of a message used to dispatch it to the devices owning
+ * it.  Messages without an address are sent to everybody.  Message
+ * types overload this function.
+ */
+template <class M>
+bool bus_address(M &msg, unsigned long &address) { return false; }
+
+
+/**
+ * Messages that carry a burst of data overload these functions to
+ * tell the bus in how many pieces it can be split and what they look
+ * like.  Receivers that do not handle bursts get the pieces one by
+ * one.
+ */
+template <class M>
+unsigned bus_pieces(M &msg) { return 1; }
+template <class M>
+M bus_piece(M &msg, unsigned i) { return msg; }
+
+
 /**
  * A bus is a way to connect devices.
  */
@@ -41,17 +77,61 @@ template <class M>
 class DBus
 {
   typedef bool (*ReceiveFunction)(Device *, M&);
+
+  // Reading the TSC twice costs more than most receivers, so only
+  // every n-th call of an entry is timed.
+  enum { PROFILE_SAMPLE = 16 };
+
   struct Entry
   {
     Device *_dev;
     ReceiveFunction _func;
+    bool _ranged;
+    bool _burst;
+
+    // Profiling: messages accepted and TSC cycles spent in the
+    // receiver, including the messages it sends itself. The cycles
+    // are measured for every PROFILE_SAMPLE-th call and scaled. The
+    // dumped_ values are from the last profile_dump().
+    unsigned long _calls;
+    unsigned long _hits;
+    unsigned long long _cycles;
+    unsigned long _dumped_hits;
+    unsigned long long _dumped_cycles;
+  };
+
+  /**
+   * An address range claimed by an entry.
+   */
+  struct Range
+  {
+    unsigned long _start;
+    unsigned long _count;
+    unsigned _entry;
   };
 
   unsigned long _debug_counter;
+  unsigned long _debug_probed;
+  unsigned long _dumped_counter;
+  void *_lock;
+  BusLockFunction _lock_func;
   unsigned _list_count;
   unsigned _list_size;
+  unsigned _burst_count;
   struct Entry *_list;
 
+  /**
+   * The range index.  It splits the address space into segments and
+   * keeps the entries that could receive a message to a segment in
+   * LIFO order.  Entries without a range are part of every segment.
+   */
+  unsigned _range_count;
+  struct Range *_ranges;
+  unsigned _seg_count;
+  unsigned long *_seg_start;
+  unsigned *_seg_first;
+  unsigned *_seg_entries;
+
   /**
    * To avoid bugs we disallow the copy constuctor.
    */
@@ -65,15 +145,180 @@ class DBus
     _list = n;
     _list_size = new_size;
   };
+
+  bool covers(unsigned entry, unsigned long address)
+  {
+    if (!_list[entry]._ranged) return true;
+    for (unsigned i = 0; i < _range_count; i++)
+      if (_ranges[i]._entry == entry && address - _ranges[i]._start < _ranges[i]._count)
+	return true;
+    return false;
+  }
+
+  /**
+   * Rebuild the range index.  This is only done while devices are
+   * added, thus we do not care about the quadratic runtime.
+   */
+  void build_index()
+  {
+    delete [] _seg_start;
+    delete [] _seg_first;
+    delete [] _seg_entries;
+
+    // collect the segment boundaries
+    unsigned long *starts = new unsigned long[2 * _range_count + 1];
+    unsigned n = 0;
+    starts[n++] = 0;
+    for (unsigned i = 0; i < _range_count; i++) {
+      starts[n++] = _ranges[i]._start;
+      if (_ranges[i]._start + _ranges[i]._count > _ranges[i]._start)
+	starts[n++] = _ranges[i]._start + _ranges[i]._count;
+    }
+    for (unsigned i = 1; i < n; i++)
+      for (unsigned j = i; j > 0 && starts[j - 1] > starts[j]; j--) {
+	unsigned long t = starts[j];
+	starts[j] = starts[j - 1];
+	starts[j - 1] = t;
+      }
+    _seg_count = 0;
+    for (unsigned i = 0; i < n; i++)
+      if (!_seg_count || starts[_seg_count - 1] != starts[i])
+	starts[_seg_count++] = starts[i];
+    _seg_start = starts;
+
+    // the entries per segment
+    _seg_first   = new unsigned[_seg_count + 1];
+    _seg_entries = new unsigned[_seg_count * _list_count];
+    unsigned pos = 0;
+    for (unsigned k = 0; k < _seg_count; k++) {
+      _seg_first[k] = pos;
+      for (unsigned i = _list_count; i--;)
+	if (covers(i, _seg_start[k])) _seg_entries[pos++] = i;
+    }
+    _seg_first[_seg_count] = pos;
+  }
+
 public:
 
-  void add(Device *dev, ReceiveFunction func)
+  /**
+   * Add a device.  Devices that handle bursts natively set burst,
+   * all others only get the pieces of a burst.
+   */
+  void add(Device *dev, ReceiveFunction func, bool burst = false)
   {
     if (_list_count >= _list_size)
       set_size(_list_size > 0 ? _list_size * 2 : 1);
+    memset(_list + _list_count, 0, sizeof(*_list));
     _list[_list_count]._dev    = dev;
     _list[_list_count]._func = func;
+    _list[_list_count]._ranged = false;
+    _list[_list_count]._burst  = burst;
+    _burst_count += burst;
     _list_count++;
+    if (_range_count) build_index();
+  }
+
+  /**
+   * Add a device that only receives messages to the given address
+   * range.  Devices can claim multiple ranges by calling this again.
+   */
+  void add(Device *dev, ReceiveFunction func, unsigned long start, unsigned long count, bool burst = false)
+  {
+    unsigned entry = _list_count;
+    while (entry-- && (_list[entry]._dev != dev || _list[entry]._func != func || !_list[entry]._ranged))
+      ;
+    if (!~entry) {
+      add(dev, func, burst);
+      entry = _list_count - 1;
+      _list[entry]._ranged = true;
+    }
+
+    Range *n = new Range[_range_count + 1];
+    memcpy(n, _ranges, _range_count * sizeof(*_ranges));
+    delete [] _ranges;
+    _ranges = n;
+    _ranges[_range_count]._start = start;
+    _ranges[_range_count]._count = count;
+    _ranges[_range_count]._entry = entry;
+    _range_count++;
+    build_index();
+  }
+
+private:
+
+  void lock()   { if (_lock_func) _lock_func(_lock, true); }
+  void unlock() { if (_lock_func) _lock_func(_lock, false); }
+
+  bool call(Entry &e, M &msg)
+  {
+    _debug_probed++;
+    bool res;
+    if (e._calls++ % PROFILE_SAMPLE)
+      res = e._func(e._dev, msg);
+    else {
+      unsigned long long start = Cpu::rdtsc();
+      res = e._func(e._dev, msg);
+      e._cycles += (Cpu::rdtsc() - start) * PROFILE_SAMPLE;
+    }
+    e._hits += res;
+    return res;
+  }
+
+  /**
+   * Send to the entries that own the address.  With burst set, only
+   * the entries that handle bursts are asked.
+   */
+  bool  send_lifo(M &msg, bool earlyout, bool burst = false)
+  {
+    bool res = false;
+    unsigned long address;
+    if (_seg_count && bus_address(msg, address)) {
+      unsigned lo = 0, hi = _seg_count;
+      while (hi - lo > 1) {
+	unsigned mid = (lo + hi) / 2;
+	if (_seg_start[mid] <= address) lo = mid; else hi = mid;
+      }
+      for (unsigned j = _seg_first[lo]; j < _seg_first[lo + 1] && !(earlyout && res); j++)
+	if (!burst || _list[_seg_entries[j]]._burst)
+	  res |= call(_list[_seg_entries[j]], msg);
+      return res;
+    }
+    for (unsigned i = _list_count; i-- && !(earlyout && res);)
+      if (!burst || _list[i]._burst)
+	res |= call(_list[i], msg);
+    return res;
+  }
+
+  /**
+   * A burst goes first to the entries that handle bursts.  If none
+   * of them takes it, the pieces are sent one by one to everybody,
+   * including the entries that refused the whole burst.  This
+   * succeeds only if every piece was received.
+   *
+   * Note that the entries that handle bursts get precedence, thus
+   * they should not overlap with others.
+   */
+  bool  send_burst(M &msg, bool earlyout)
+  {
+    if (_burst_count && send_lifo(msg, earlyout, true)) return true;
+
+    bool res = true;
+    for (unsigned i = 0, n = bus_pieces(msg); i < n; i++) {
+      M piece = bus_piece(msg, i);
+      res &= send_lifo(piece, earlyout);
+    }
+    return res;
+  }
+
+public:
+
+  /**
+   * Protect the receivers with a lock.
+   */
+  void set_lock(void *lock, BusLockFunction func)
+  {
+    _lock = lock;
+    _lock_func = func;
   }
 
   /**
@@ -81,10 +326,25 @@ public:
    */
   bool  send(M &msg, bool earlyout = false)
   {
+    lock();
     _debug_counter++;
-    bool res = false;
-    for (unsigned i = _list_count; i-- && !(earlyout && res);)
-      res |= _list[i]._func(_list[i]._dev, msg);
+    bool res = bus_pieces(msg) > 1 ? send_burst(msg, earlyout) : send_lifo(msg, earlyout);
+    unlock();
+    return res;
+  }
+
+  /**
+   * Send message LIFO, but never split a burst.  A burst only goes to
+   * the entries that handle bursts.  This is for forwarders that are
+   * burst receivers on another bus: if nobody here takes the whole
+   * burst, that bus splits it, so no piece is delivered twice.
+   */
+  bool  send_unsplit(M &msg, bool earlyout = false)
+  {
+    lock();
+    _debug_counter++;
+    bool res = bus_pieces(msg) > 1 ? _burst_count && send_lifo(msg, earlyout, true) : send_lifo(msg, earlyout);
+    unlock();
     return res;
   }
 
@@ -93,10 +353,12 @@ public:
    */
   bool  send_fifo(M &msg)
   {
+    lock();
     _debug_counter++;
     bool res = false;
     for (unsigned i = 0; i < _list_count; i++)
-      res |= _list[i]._func(_list[i]._dev, msg);
+      res |= call(_list[i], msg);
+    unlock();
     return 0;
   }
 
@@ -107,13 +369,16 @@ public:
    */
   bool  send_rr(M &msg, unsigned &start)
   {
+    lock();
     _debug_counter++;
-    for (unsigned i = 0; i < _list_count; i++)
-      if (_list[i]._func(_list[(i + start) % _list_count]._dev, msg)) {
+    bool res = false;
+    for (unsigned i = 0; i < _list_count && !res; i++)
+      if (call(_list[(i + start) % _list_count], msg)) {
 	start = (i + start + 1) % _list_count;
-	return true;
+	res = true;
       }
-    return false;
+    unlock();
+    return res;
   }
 
 
@@ -128,7 +393,8 @@ public:
    */
   void debug_dump()
   {
-    Logging::printf("%s: Bus used %ld times.", __PRETTY_FUNCTION__, _debug_counter);
+    Logging::printf("%s: Bus used %ld times, %ld receivers probed (%ld per message).", __PRETTY_FUNCTION__,
+		    _debug_counter, _debug_probed, _debug_counter ? _debug_probed / _debug_counter : 0);
     for (unsigned i = 0; i < _list_count; i++)
       {
 	Logging::printf("\n%2d:\t", i);
@@ -137,6 +403,34 @@ public:
     Logging::printf("\n");
   }
 
+  /**
+   * Profiling output: the messages sent on the bus and the hits and
+   * cycles of every receiver. The diff columns show the change since
+   * the last call. Unless full is set, idle receivers are skipped.
+   */
+  void profile_dump(const char *name, bool full, ProfileFunction out, void *data)
+  {
+    if (!full && _debug_counter == _dumped_counter) return;
+    out(data, "%-12s %12lu msgs  diff %10lu\n", name, _debug_counter, _debug_counter - _dumped_counter);
+    _dumped_counter = _debug_counter;
+
+    for (unsigned i = 0; i < _list_count; i++) {
+      Entry &e = _list[i];
+      if (full || e._hits != e._dumped_hits || e._cycles != e._dumped_cycles) {
+	// Strip the "... [with Y = " of the StaticReceiver name.
+	const char *dev = e._dev ? e._dev->debug_name() : "host";
+	const char *with = strstr(dev, "Y = ");
+	size_t len = with ? strcspn(with += 4, ";]") : strlen(dev);
+	out(data, "  %-32.*s %10lu hits %14llu cycles  diff %10lu %14llu\n",
+	    int(VMM_MIN(len, size_t(32))), with ? with : dev, e._hits, e._cycles,
+	    e._hits - e._dumped_hits, e._cycles - e._dumped_cycles);
+      }
+      e._dumped_hits   = e._hits;
+      e._dumped_cycles = e._cycles;
+    }
+  }
+
   /** Default constructor. */
-  DBus() : _debug_counter(0), _list_count(0), _list_size(0), _list(nullptr) {}
+  DBus() : _debug_counter(0), _debug_probed(0), _dumped_counter(0), _lock(nullptr), _lock_func(nullptr), _list_count(0), _list_size(0), _burst_count(0), _list(nullptr),
+	   _range_count(0), _ranges(nullptr), _seg_count(0), _seg_start(nullptr), _seg_first(nullptr), _seg_entries(nullptr) {}
 };
@@ -22,6 +22,7 @@
 
 #include <nul/types.h>
 #include <nul/compiler.h>
+#include <service/cpu.h>
 
 /****************************************************/
 /* IOIO messages                                    */
@@ -46,6 +47,8 @@ struct MessageIOIn
   MessageIOIn(Type _type, unsigned short _port, unsigned _count, void *_ptr) : type(_type), port(_port), count(_count), ptr(_ptr) {}
 };
 
+static inline bool bus_address(MessageIOIn &msg, unsigned long &address) { address = msg.port; return true; }
+
 struct MessageHwIOIn : public MessageIOIn {
   MessageHwIOIn(Type _type, unsigned short _port) : MessageIOIn(_type, _port) {}
   MessageHwIOIn(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOIn(_type, _port, _count, _ptr) {}
@@ -71,6 +74,8 @@ struct MessageIOOut {
   MessageIOOut(Type _type, unsigned short _port, unsigned _count, void *_ptr) : type(_type), port(_port), count(_count), ptr(_ptr) {}
 };
 
+static inline bool bus_address(MessageIOOut &msg, unsigned long &address) { address = msg.port; return true; }
+
 struct MessageHwIOOut : public MessageIOOut {
   MessageHwIOOut(Type _type, unsigned short _port, unsigned _value) : MessageIOOut(_type, _port, _value) {}
   MessageHwIOOut(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOOut(_type, _port, _count, _ptr) {}
@@ -83,6 +88,11 @@ struct MessageHwIOOut : public MessageIOOut {
 
 /**
  * A dword aligned memory access.
+ *
+ * A burst accesses count dwords at once, but never crosses a page.
+ * Only devices that were added to the bus as burst receivers see
+ * bursts.  They take one only if they cover it completely.  All
+ * others get single dwords.
  */
 struct MessageMem
 {
@@ -94,15 +104,32 @@ struct MessageMem
   bool read;
   uintptr_t phys;
   unsigned *ptr;
-  MessageMem(bool _read, uintptr_t _phys, unsigned *_ptr) : read(_read), phys(_phys), ptr(_ptr) {}
+  unsigned count;
+
+  /**
+   * Is the whole access within the given range?
+   */
+  bool covered(uintptr_t base, size_t size) { return phys - base < size && size - (phys - base) >= 4 * count; }
+
+  MessageMem(bool _read, uintptr_t _phys, unsigned *_ptr, unsigned _count = 1) : read(_read), phys(_phys), ptr(_ptr), count(_count) {}
 };
 
+static inline bool bus_address(MessageMem &msg, unsigned long &address) { address = msg.phys; return true; }
+static inline unsigned bus_pieces(MessageMem &msg) { return msg.count; }
+static inline MessageMem bus_piece(MessageMem &msg, unsigned i) { return MessageMem(msg.read, msg.phys + 4 * i, msg.ptr + i); }
+
 /**
  * Request a region that is directly mapped into our memory.  Used for
  * mapping it to the user and optimizing internal access.
  *
  * Note, that clients can also return an empty region by not setting
  * the ptr.
+ *
+ * Regions holding RAM can additionally provide a write generation per
+ * page.  Everybody writing through the ptr has to bump it, so that
+ * decoded instructions can be invalidated.  This is only done if the
+ * host confirms with OP_GUEST_MEM_TRACKED that the guest never writes
+ * its memory natively.
  */
 struct MessageMemRegion
 {
@@ -110,7 +137,18 @@ struct MessageMemRegion
   uintptr_t start_page;
   unsigned      count;
   char *        ptr;
-  MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0) {}
+  unsigned *    gen;
+
+  /**
+   * Note a write to the given physical range.
+   */
+  void written(uintptr_t phys, size_t len)
+  {
+    if (!gen || !len) return;
+    for (uintptr_t p = phys >> 12; p <= (phys + len - 1) >> 12 && p < start_page + count; p++)
+      Cpu::atomic_xadd(gen + p - start_page, 1);
+  }
+  MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0), gen(0) {}
 };
 
 
@@ -442,6 +480,7 @@ struct MessageHostOp
       OP_ASSIGN_PCI,
       OP_VIRT_TO_PHYS,
       OP_GET_MODULE,
+      OP_MAP_MODULE,
       OP_GET_MAC,
       OP_GUEST_MEM,
       OP_ALLOC_FROM_GUEST,
@@ -449,6 +488,9 @@ struct MessageHostOp
       OP_VCPU_BLOCK,
       OP_VCPU_RELEASE,
       OP_WAIT_CHILD,
+      OP_ALLOC_CODE,
+      OP_GUEST_MEM_TRACKED,
+      OP_VCPU_EMULATED,
     } type;
   union {
     unsigned long value;
@@ -471,6 +513,7 @@ struct MessageHostOp
       size_t size;
       char * cmdline;
       size_t cmdlen;
+      size_t offset;
     };
     struct {
       unsigned msi_gsi;
@@ -528,8 +571,20 @@ struct MessageHostOp
     return n;
   }
 
+  /**
+   * Map size bytes of a module starting at offset copy-on-write to
+   * the page-aligned start. Hosts that cannot do this return false.
+   */
+  static MessageHostOp map_module(unsigned module, char *start, size_t offset, size_t size)
+  {
+    MessageHostOp n(module, start, size);
+    n.type   = OP_MAP_MODULE;
+    n.offset = offset;
+    return n;
+  }
+
   explicit MessageHostOp(VCpu *_vcpu) : type(OP_VCPU_CREATE_BACKEND), value(0), vcpu(_vcpu) {}
-  explicit MessageHostOp(unsigned _module, char * _start, size_t _size=0) : type(OP_GET_MODULE), module(_module), start(_start), size(_size), cmdlen(0)  {}
+  explicit MessageHostOp(unsigned _module, char * _start, size_t _size=0) : type(OP_GET_MODULE), module(_module), start(_start), size(_size), cmdlen(0), offset(0)  {}
   explicit MessageHostOp(Type _type, unsigned long _value, size_t _len=0, unsigned _cpu=~0U) : type(_type), value(_value),
                                                                                                       ptr(0), len(_len), cpu(_cpu) {}
   explicit MessageHostOp(Type _type, void * _value, size_t _len=0) : type(_type), obj(_value), ptr(0), len(_len) {}
@@ -725,11 +780,15 @@ struct MessageTime
 /* Network messages                                 */
 /****************************************************/
 
+class PacketRing;
+
 struct MessageNetwork
 {
   enum ops {
     PACKET,
-    QUERY_MAC
+    QUERY_MAC,
+    RING_ATTACH,                // a NIC model wants its packets in ring
+    RING_NOTIFY,                // ring has packets for an idle consumer
   };
 
   unsigned type;
@@ -740,12 +799,55 @@ struct MessageNetwork
       size_t len;
     };
     unsigned long long mac;
+    PacketRing *ring;
   };
 
   unsigned client;
 
-  MessageNetwork(const unsigned char *buffer, size_t len, unsigned client) : type(PACKET), buffer(buffer), len(len), client(client) {}
-  MessageNetwork(unsigned type, unsigned client) : type(type), mac(0), client(client) { }
+  /**
+   * A packet can be scattered over several fragments, e.g. TX
+   * buffers in guest memory. In this case buffer and len describe
+   * the first fragment and the total packet length.
+   */
+  struct Fragment {
+    const unsigned char *buffer;
+    size_t len;
+  };
+  enum { MAX_FRAGMENTS = 64 };
+
+  const Fragment *fragments;
+  unsigned fragcount;
+
+  /**
+   * More packets of a burst follow. Receivers can defer work, like
+   * raising an interrupt, until the last packet of the burst.
+   */
+  bool more;
+
+  /**
+   * Copy the packet into a linear buffer. Returns the number of bytes
+   * copied, which is less than len if the buffer is too small.
+   */
+  size_t copy(unsigned char *dst, size_t size) const
+  {
+    if (!fragcount) {
+      size_t n = len < size ? len : size;
+      memcpy(dst, buffer, n);
+      return n;
+    }
+    size_t n = 0;
+    for (unsigned i = 0; i < fragcount && n < size; i++) {
+      size_t chunk = fragments[i].len < size - n ? fragments[i].len : size - n;
+      memcpy(dst + n, fragments[i].buffer, chunk);
+      n += chunk;
+    }
+    return n;
+  }
+
+  MessageNetwork(const unsigned char *buffer, size_t len, unsigned client) : type(PACKET), buffer(buffer), len(len), client(client), fragments(0), fragcount(0), more(false) {}
+  MessageNetwork(const Fragment *fragments, unsigned fragcount, size_t len, unsigned client)
+    : type(PACKET), buffer(fragments[0].buffer), len(len), client(client), fragments(fragments), fragcount(fragcount), more(false) {}
+  MessageNetwork(unsigned type, unsigned client) : type(type), mac(0), client(client), fragments(0), fragcount(0), more(false) { }
 };
 
 /* EOF */
@@ -81,6 +81,81 @@ class Motherboard
 
   VCpu *last_vcpu;
   Clock *clock() { return _clock; }
+
+  /**
+   * Call v(bus, name) for every bus.
+   */
+  template <class V>
+  void for_each_bus(V &v)
+  {
+    v(bus_acpi, "acpi");
+    v(bus_ahcicontroller, "ahcicontroller");
+    v(bus_apic, "apic");
+    v(bus_bios, "bios");
+    v(bus_console, "console");
+    v(bus_discovery, "discovery");
+    v(bus_disk, "disk");
+    v(bus_diskcommit, "diskcommit");
+    v(bus_hostop, "hostop");
+    v(bus_hwioin, "hwioin");
+    v(bus_ioin, "ioin");
+    v(bus_hwioout, "hwioout");
+    v(bus_ioout, "ioout");
+    v(bus_input, "input");
+    v(bus_hostirq, "hostirq");
+    v(bus_irqlines, "irqlines");
+    v(bus_irqnotify, "irqnotify");
+    v(bus_legacy, "legacy");
+    v(bus_mem, "mem");
+    v(bus_memregion, "memregion");
+    v(bus_network, "network");
+    v(bus_ps2, "ps2");
+    v(bus_hwpcicfg, "hwpcicfg");
+    v(bus_pcicfg, "pcicfg");
+    v(bus_pic, "pic");
+    v(bus_pit, "pit");
+    v(bus_serial, "serial");
+    v(bus_time, "time");
+    v(bus_timeout, "timeout");
+    v(bus_timer, "timer");
+    v(bus_vesa, "vesa");
+  }
+
+  struct BusLocker
+  {
+    void *lock;
+    BusLockFunction func;
+    template <class M> void operator()(DBus<M> &bus, const char *) { bus.set_lock(lock, func); }
+  };
+
+  struct BusProfiler
+  {
+    bool full;
+    ProfileFunction out;
+    void *data;
+    template <class M> void operator()(DBus<M> &bus, const char *name) { bus.profile_dump(name, full, out, data); }
+  };
+
+  /**
+   * Serialize all busses with the given lock, as the devices behind
+   * them are shared between threads.
+   */
+  void set_lock(void *lock, BusLockFunction func)
+  {
+    BusLocker locker = { lock, func };
+    for_each_bus(locker);
+  }
+
+  /**
+   * Dump the profiling counters of all busses. The diff columns show
+   * the change since the last dump, like in dump_counters().
+   */
+  void dump_profile(bool full, ProfileFunction out, void *data)
+  {
+    BusProfiler profiler = { full, out, data };
+    for_each_bus(profiler);
+  }
+
   Hip   *hip() { return _hip; }
 
   /* Argument parsing */
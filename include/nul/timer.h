@@ -26,9 +26,46 @@ typedef unsigned long long timevalue;
  * A clock returns the time in different time domains.
  *
  * The reference clock is the CPUs TSC.
+ *
+ * The conversion factors for the first CONVERSIONS frequencies that
+ * are asked for are kept as fixpoint numbers, so that the common
+ * case needs a multiplication instead of a division.  The table is
+ * filled lock-free by whoever asks first.
  */
 class Clock
 {
+  enum { CONVERSIONS = 8 };
+
+  struct Conversion
+  {
+    timevalue freq;
+    timevalue to_factor;        // TSC to freq
+    timevalue from_factor;      // freq to TSC
+    unsigned  to_shift;
+    unsigned  from_shift;
+  };
+
+  Conversion        _conv[CONVERSIONS];
+  volatile unsigned _conv_count;
+  volatile unsigned _conv_ready;
+
+  Conversion *conversion(timevalue freq)
+  {
+    unsigned ready = _conv_ready;
+    for (unsigned i=0; ready >> i; i++)
+      if ((ready >> i) & 1 && _conv[i].freq == freq) return _conv + i;
+
+    if (_conv_count >= CONVERSIONS) return 0;
+    unsigned i = Cpu::atomic_xadd(&_conv_count, 1);
+    if (i >= CONVERSIONS) return 0;
+    Conversion &c = _conv[i];
+    c.freq        = freq;
+    c.to_factor   = Math::fixpoint(freq, _source_freq, c.to_shift);
+    c.from_factor = Math::fixpoint(_source_freq, freq, c.from_shift);
+    __sync_fetch_and_or(&_conv_ready, 1u << i);
+    return &c;
+  }
+
  protected:
   timevalue _source_freq;
  public:
@@ -37,10 +74,28 @@ class Clock
 #endif
   timevalue time() { return Cpu::rdtsc(); }
 
+  /**
+   * Convert a TSC value into freq-time.
+   */
+  timevalue convert_to(timevalue value, timevalue freq)
+  {
+    Conversion *c = conversion(freq);
+    return c ? Math::mulshift(value, c->to_factor, c->to_shift) : Math::muldiv128(value, freq, _source_freq);
+  }
+
+  /**
+   * Convert a freq-time value into TSC time.
+   */
+  timevalue convert_from(timevalue value, timevalue freq)
+  {
+    Conversion *c = conversion(freq);
+    return c ? Math::mulshift(value, c->from_factor, c->from_shift) : Math::muldiv128(value, _source_freq, freq);
+  }
+
   /**
    * Returns the current clock in freq-time.
    */
-  timevalue clock(timevalue freq, timevalue t_cur = 0) { return Math::muldiv128(t_cur == 0 ? time() : t_cur, freq, _source_freq); }
+  timevalue clock(timevalue freq, timevalue t_cur = 0) { return convert_to(t_cur == 0 ? time() : t_cur, freq); }
 
   /**
    * Frequency of the clock.
@@ -56,7 +111,7 @@ class Clock
    *
    * Example: abstime(5, 1000) returns the time of now plus 5 milliseconds.
    */
-  timevalue abstime(timevalue thedelta, timevalue freq) {  return time() + Math::muldiv128(thedelta, _source_freq, freq); }
+  timevalue abstime(timevalue thedelta, timevalue freq) {  return time() + convert_from(thedelta, freq); }
 
 
   /**
@@ -65,10 +120,10 @@ class Clock
   timevalue delta(timevalue theabstime, timevalue freq) {
     timevalue now = time();
     if (now > theabstime) return 0;
-    return Math::muldiv128(theabstime - now, freq, _source_freq);
+    return convert_to(theabstime - now, freq);
   }
 
-  Clock(timevalue source_freq) : _source_freq(source_freq) {}
+  Clock(timevalue source_freq) : _conv_count(0), _conv_ready(0), _source_freq(source_freq) {}
 };
 
 
@@ -76,49 +131,219 @@ class Clock
 
 /**
  * Keeping track of the timeouts.
+ *
+ * The timeouts are kept in a hierarchical timer wheel. Every level
+ * has SLOTS lists and covers SLOT_BITS more bits of the timeout than
+ * the level below. An entry lives on the lowest level where its
+ * timeout and the current time of the wheel differ only in the bits
+ * of this level. Thus all entries of a level expire before those of
+ * the next level, and within a level the slots are ordered.
+ *
+ * request() and cancel() are O(1). When the time advances, expired
+ * entries are moved in one batch to a sorted list from where
+ * trigger() hands them out. Entries that are not yet expired cascade
+ * to lower levels at that point.
+ *
+ * ENTRIES is the initial number of timeouts. The list grows on
+ * demand.
  */
 template <unsigned ENTRIES, typename DATA>
 class TimeoutList
 {
+  enum {
+    GRANULARITY = 10,   // ld of the time units per tick
+    SLOT_BITS   = 5,
+    SLOTS       = 1 << SLOT_BITS,
+    LEVELS      = 8,
+    DUE         = LEVELS * SLOTS,
+    FAR,
+    LISTS,
+    NONE        = ~0u,
+  };
+
   class TimeoutEntry
   {
     friend class TimeoutList<ENTRIES, DATA>;
-    TimeoutEntry *_next;
-    TimeoutEntry *_prev;
+    unsigned  _next;
+    unsigned  _prev;
+    unsigned  _list;
     timevalue _timeout;
     DATA * data;
     bool      _free;
   };
 
-  TimeoutEntry  _entries[ENTRIES];
+  TimeoutEntry *_entries;
+  unsigned      _size;
+  unsigned      _free_list;
+  unsigned      _heads[LISTS];
+  unsigned      _bitmap[LEVELS];
+  timevalue     _base;       // current time of the wheel in ticks
+  unsigned      _first;      // cached earliest entry
+  bool          _first_valid;
+
+  void enqueue(unsigned nr, unsigned list)
+  {
+    TimeoutEntry &e = _entries[nr];
+    e._list = list;
+    e._prev = 0;
+    e._next = _heads[list];
+    if (e._next) _entries[e._next]._prev = nr;
+    _heads[list] = nr;
+    if (list < DUE) _bitmap[list / SLOTS] |= 1u << (list % SLOTS);
+
+    if (_first_valid && (!_first || e._timeout < _entries[_first]._timeout))
+      _first = nr;
+  }
+
+  void dequeue(unsigned nr)
+  {
+    TimeoutEntry &e = _entries[nr];
+    if (e._prev) _entries[e._prev]._next = e._next; else _heads[e._list] = e._next;
+    if (e._next) _entries[e._next]._prev = e._prev;
+    if (e._list < DUE && !_heads[e._list]) _bitmap[e._list / SLOTS] &= ~(1u << (e._list % SLOTS));
+    e._list = NONE;
+    if (nr == _first) _first_valid = false;
+  }
+
+  /**
+   * Expired entries are kept sorted, so that they trigger in order.
+   */
+  void enqueue_due(unsigned nr)
+  {
+    TimeoutEntry &e = _entries[nr];
+    unsigned prev = 0;
+    for (unsigned t = _heads[DUE]; t && _entries[t]._timeout <= e._timeout; t = _entries[t]._next)
+      prev = t;
+    if (!prev) { enqueue(nr, DUE); return; }
+
+    e._list = DUE;
+    e._prev = prev;
+    e._next = _entries[prev]._next;
+    if (e._next) _entries[e._next]._prev = nr;
+    _entries[prev]._next = nr;
+  }
+
+  void place(unsigned nr)
+  {
+    timevalue tick = _entries[nr]._timeout >> GRANULARITY;
+    if (tick < _base) { enqueue_due(nr); return; }
+
+    timevalue diff = tick ^ _base;
+    unsigned level = diff < SLOTS ? 0 : Cpu::bsr64(diff) / SLOT_BITS;
+    if (level >= LEVELS)
+      enqueue(nr, FAR);
+    else
+      enqueue(nr, level * SLOTS + ((tick >> (level * SLOT_BITS)) & (SLOTS - 1)));
+  }
+
+  /**
+   * Requeue all entries of a list.
+   */
+  void requeue(unsigned list, timevalue now)
+  {
+    unsigned next;
+    for (unsigned nr = _heads[list]; nr; nr = next) {
+      next = _entries[nr]._next;
+      dequeue(nr);
+      if (_entries[nr]._timeout <= now) enqueue_due(nr); else place(nr);
+    }
+  }
+
+  /**
+   * Advance the wheel to now and collect the expired entries.
+   */
+  void advance(timevalue now)
+  {
+    timevalue tick = now >> GRANULARITY;
+    if (tick > _base) {
+      if ((tick >> (LEVELS * SLOT_BITS)) != (_base >> (LEVELS * SLOT_BITS))) requeue(FAR, now);
+      timevalue old = _base;
+      _base = tick;
+
+      for (unsigned level = LEVELS; level--;) {
+        unsigned shift = level * SLOT_BITS;
+        unsigned slots = _bitmap[level];
+        if ((tick >> (shift + SLOT_BITS)) == (old >> (shift + SLOT_BITS))) {
+          // only the slots we passed
+          unsigned from = (old  >> shift) & (SLOTS - 1);
+          unsigned to   = (tick >> shift) & (SLOTS - 1);
+          slots &= (~0u << from) & (~0u >> (SLOTS - 1 - to));
+        }
+        for (; slots; slots &= slots - 1)
+          requeue(level * SLOTS + Cpu::bsf(slots), now);
+      }
+    }
+    else
+      // entries in the current tick may have expired in the meantime
+      requeue(_base & (SLOTS - 1), now);
+    _first_valid = false;
+  }
+
+  unsigned first()
+  {
+    if (_first_valid) return _first;
+
+    unsigned list = FAR;
+    if (_heads[DUE])
+      list = DUE;
+    else
+      for (unsigned level = 0; level < LEVELS; level++)
+        if (_bitmap[level]) { list = level * SLOTS + Cpu::bsf(_bitmap[level]); break; }
+
+    // the earliest slot is not sorted
+    _first = _heads[list];
+    if (list != DUE)
+      for (unsigned nr = _first; nr; nr = _entries[nr]._next)
+        if (_entries[nr]._timeout < _entries[_first]._timeout) _first = nr;
+    _first_valid = true;
+    return _first;
+  }
+
+  void grow()
+  {
+    unsigned size = _size ? 2 * _size : (ENTRIES < 2 ? 2 : ENTRIES);
+    TimeoutEntry *entries = new TimeoutEntry[size];
+    for (unsigned i = 0; i < _size; i++) entries[i] = _entries[i];
+    for (unsigned i = size; i-- > VMM_MAX(_size, 1u);) {
+      entries[i]._list  = NONE;
+      entries[i].data   = 0;
+      entries[i]._free  = true;
+      entries[i]._next  = _free_list;
+      _free_list = i;
+    }
+    delete [] _entries;
+    _entries = entries;
+    _size    = size;
+  }
+
 public:
   /**
    * Alloc a new timeout object.
    */
   unsigned alloc(DATA * _data = 0)
   {
-    unsigned i;
-    for (i=1; i < ENTRIES; i++) {
-      if (not _entries[i]._free) continue;
-      _entries[i].data  = _data;
-      _entries[i]._free = false;
-      return i;
-    }
-    Logging::panic("Can't alloc a timer!\n");
-    return 0;
+    if (!_free_list) grow();
+    unsigned i = _free_list;
+    _free_list = _entries[i]._next;
+    _entries[i].data  = _data;
+    _entries[i]._free = false;
+    _entries[i]._list = NONE;
+    return i;
   }
 
   /**
    * Dealloc a timeout object.
    */
   unsigned dealloc(unsigned nr, bool withcancel = false) {
-    if (!nr || nr > ENTRIES - 1) return 0;
+    if (!nr || nr >= _size) return 0;
     if (_entries[nr]._free) return 0;
 
     // should only be done when no no concurrent access happens ...
     if (withcancel) cancel(nr);
     _entries[nr]._free = true;
     _entries[nr].data = 0;
+    _entries[nr]._next = _free_list;
+    _free_list = nr;
     return 1;
   }
 
@@ -127,14 +352,10 @@ public:
    */
   int cancel(unsigned nr)
   {
-    if (!nr || nr >= ENTRIES)  return -1;
-    TimeoutEntry *current = _entries+nr;
-    if (current->_next == current) return -2;
-    int res = _entries[0]._next != current;
-
-    current->_next->_prev =  current->_prev;
-    current->_prev->_next =  current->_next;
-    current->_next = current->_prev = current;
+    if (!nr || nr >= _size)  return -1;
+    if (_entries[nr]._list == NONE) return -2;
+    int res = first() != nr;
+    dequeue(nr);
     return res;
   }
 
@@ -144,20 +365,12 @@ public:
    */
   int request(unsigned nr, timevalue to)
   {
-    if (!nr || nr > ENTRIES)  return -1;
+    if (!nr || nr >= _size)  return -1;
     timevalue old = timeout();
-    TimeoutEntry *current = _entries + nr;
-    cancel(nr);
-
-    // keep a sorted list here
-    TimeoutEntry *t = _entries;
-    do { t = t->_next; }  while (t->_timeout < to);
-
-    current->_timeout = to;
-    current->_next = t;
-    current->_prev = t->_prev;
-    t->_prev->_next = current;
-    t->_prev = current;
+    if (_entries[nr]._list != NONE) dequeue(nr);
+
+    _entries[nr]._timeout = to;
+    place(nr);
     return timeout() == old;
   }
 
@@ -165,27 +378,28 @@ public:
    * Get the head of the queue.
    */
   unsigned  trigger(timevalue now, DATA ** data = 0) {
-    if (now >= timeout()) {
-      unsigned i = _entries[0]._next - _entries;
-      if (data)
-        *data = _entries[i].data;
-      return i;
+    if (!_heads[DUE]) {
+      if (now < timeout()) return 0;
+      advance(now);
     }
-    return 0;
+    unsigned i = _heads[DUE];
+    if (i && data)
+      *data = _entries[i].data;
+    return i;
   }
 
-  timevalue timeout() { assert(_entries[0]._next); return _entries[0]._next->_timeout; }
+  timevalue timeout() { unsigned nr = first(); return nr ? _entries[nr]._timeout : ~0ULL; }
   void init()
   {
-    for (unsigned i = 0; i < ENTRIES; i++)
-      {
-        _entries[i]._prev = _entries + i;
-        _entries[i]._next = _entries + i;
-        _entries[i].data  = 0;
-        _entries[i]._free = true;
-      }
-    _entries[0]._timeout = ~0ULL;
+    for (unsigned i = 0; i < LISTS; i++)  _heads[i] = 0;
+    for (unsigned i = 0; i < LEVELS; i++) _bitmap[i] = 0;
+    for (unsigned i = 1; i < _size; i++)
+      if (!_entries[i]._free) _entries[i]._list = NONE;
+    _base = 0;
+    _first = 0;
+    _first_valid = true;
   }
 
-  TimeoutList() { init(); }
+  TimeoutList() : _entries(0), _size(0), _free_list(0) { grow(); init(); }
+  ~TimeoutList() { delete [] _entries; }
 };
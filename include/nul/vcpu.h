@@ -36,7 +36,8 @@ struct CpuMessage {
     TYPE_WBINVD,
     TYPE_CHECK_IRQ,
     TYPE_CALC_IRQWINDOW,
-    TYPE_SINGLE_STEP
+    TYPE_SINGLE_STEP,
+    TYPE_COUNT
   } type;
   union {
     struct {
@@ -73,6 +74,13 @@ struct CpuMessage {
   : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
 };
 
+/**
+ * CpuMessages are dispatched by their type.  Receivers that handle
+ * only some types add themselves for this range of types, so that
+ * the executor bus does not ask them for the others.
+ */
+static inline bool bus_address(CpuMessage &msg, unsigned long &address) { address = msg.type; return true; }
+
 
 struct CpuEvent {
   unsigned value;
@@ -94,6 +102,10 @@ struct LapicEvent {
 class VCpu
 {
   VCpu *_last;
+  void *_lock;
+  BusLockFunction _lock_func;
+protected:
+  volatile unsigned _event;
 public:
   DBus<CpuMessage>       executor;
   DBus<CpuEvent>         bus_event;
@@ -125,6 +137,65 @@ public:
     EVENT_HOST   = 1 << 20
   };
 
-  unsigned long long inj_count;
-  VCpu (VCpu *last) : _last(last), inj_count(0) {}
+  /**
+   * Check for an event that has to be handled before the next
+   * instruction.  Interrupts only count if the CPU could take them.
+   */
+  bool event_pending(bool irq_window)
+  {
+    unsigned mask = EVENT_MASK | EVENT_DEBUG | EVENT_HOST;
+    if (!irq_window) mask &= ~(EVENT_INTR | EVENT_EXTINT);
+    return _event & mask;
+  }
+
+  /**
+   * Serialize the busses leading to the devices with the given lock.
+   * The executor bus stays unlocked, so that the vCPUs can emulate
+   * instructions in parallel.  Emulators have to take the lock
+   * themselves if they send other messages to the executor.
+   */
+  void set_lock(void *lock, BusLockFunction func)
+  {
+    _lock      = lock;
+    _lock_func = func;
+    bus_lapic.set_lock(lock, func);
+    mem.set_lock(lock, func);
+    memregion.set_lock(lock, func);
+  }
+
+  void lock(bool acquire) { if (_lock_func) _lock_func(_lock, acquire); }
+
+  /**
+   * Profiling counters. Only the thread of this vCPU updates them.
+   */
+  struct Stats {
+    unsigned long long exits[CpuMessage::TYPE_COUNT]; ///< by the frontend
+    unsigned long long instructions;                  ///< by the emulator
+    unsigned long long io;                            ///< port I/O
+    unsigned long long injections;                    ///< by the frontend
+  } stats, dumped_stats;
+
+  /**
+   * Dump the profiling counters. The diff columns show the change
+   * since the last dump.
+   */
+  void profile_dump(const char *name, ProfileFunction out, void *data)
+  {
+    static const char *exit_names[CpuMessage::TYPE_COUNT] = {
+      "cpuid_write", "cpuid", "rdtsc", "rdmsr", "wrmsr", "ioin", "ioout", "triple",
+      "init", "hlt", "invd", "wbinvd", "check_irq", "calc_irqwindow", "single_step" };
+
+    out(data, "%-12s %12llu insns diff %10llu\n", name,
+	stats.instructions, stats.instructions - dumped_stats.instructions);
+    out(data, "  %-32s %10llu       diff %10llu\n", "port I/O", stats.io, stats.io - dumped_stats.io);
+    out(data, "  %-32s %10llu       diff %10llu\n", "injections",
+	stats.injections, stats.injections - dumped_stats.injections);
+    for (unsigned i = 0; i < CpuMessage::TYPE_COUNT; i++)
+      if (stats.exits[i])
+	out(data, "  exit %-27s %10llu       diff %10llu\n", exit_names[i],
+	    stats.exits[i], stats.exits[i] - dumped_stats.exits[i]);
+    dumped_stats = stats;
+  }
+
+  VCpu (VCpu *last) : _last(last), _lock(0), _lock_func(0), _event(0), stats(), dumped_stats() {}
 };
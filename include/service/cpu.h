@@ -75,6 +75,7 @@ class Cpu
 
   /// Finds the position of the most significant "1" bit
   static  unsigned bsr(unsigned value) { return __builtin_clz(value) ^ 0x1F; }
+  static  unsigned bsr64(unsigned long long value) { return __builtin_clzll(value) ^ 0x3F; }
   /// Finds the position of the least significant "1" bit
   static  unsigned bsf(unsigned value) { return __builtin_ctz(value); }
 
@@ -19,6 +19,12 @@
 #pragma once
 #include "elf32.h"
 
+/**
+ * Map len bytes of the ELF file at offset to the page-aligned dst
+ * instead of copying them. Returns false if this is not possible.
+ */
+typedef bool (*ElfMapFn)(void *arg, char *dst, size_t offset, size_t len);
+
 struct Elf
 {
   static unsigned is_not_elf(const eh32 *elf, size_t modsize)
@@ -58,11 +64,13 @@ struct Elf
 
   /**
    * Decode an elf32 binary. I.e. copy the ELF segments from ELF image
-   * pointed by module to the memory at phys_mem.
+   * pointed by module to the memory at phys_mem. Whole pages of
+   * page-aligned segments are mapped instead, if a map function is
+   * given.
    */
   static unsigned  decode_elf(char *module, size_t modsize, char *phys_mem, uintptr_t &rip,
                               size_t &maxptr, size_t mem_size, size_t mem_offset,
-                              unsigned long long magic)
+                              unsigned long long magic, ElfMapFn map = 0, void *map_arg = 0)
   {
     unsigned res;
     struct eh32 *elf = reinterpret_cast<struct eh32 *>(module);
@@ -79,8 +87,13 @@ struct Elf
 	  magic = 0;
 	}
 	check1(9, !(mem_size >= ph->p_paddr + ph->p_memsz - mem_offset), "elf section out of memory %zx vs %x ofs %zx", mem_size, ph->p_paddr + ph->p_memsz, mem_offset);
-	memcpy(phys_mem + ph->p_paddr - mem_offset, module + ph->p_offset, ph->p_filesz);
-	memset(phys_mem + ph->p_paddr - mem_offset + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+	char  *dst    = phys_mem + ph->p_paddr - mem_offset;
+	size_t mapped = 0;
+	if (map && !(reinterpret_cast<uintptr_t>(dst) & 0xfff) && !(ph->p_offset & 0xfff)
+	    && map(map_arg, dst, ph->p_offset, ph->p_filesz & ~0xffful))
+	  mapped = ph->p_filesz & ~0xffful;
+	memcpy(dst + mapped, module + ph->p_offset + mapped, ph->p_filesz - mapped);
+	memset(dst + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
 	if (maxptr < ph->p_memsz + ph->p_paddr - mem_offset)
 	  maxptr = ph->p_paddr + ph->p_memsz - mem_offset;
       }
@@ -47,4 +47,40 @@ struct Math
     lower /= divisor;
     return (upper << 32) + lower;
   }
+
+  /**
+   * Returns (value * factor) >> shift with a 128-bit intermediate.
+   * Together with fixpoint() this replaces muldiv128() if the factor
+   * and divisor are known in advance.
+   */
+  static uint64 mulshift(uint64 value, uint64 factor, unsigned shift) {
+#ifdef __SIZEOF_INT128__
+    return static_cast<uint64>((static_cast<unsigned __int128>(value) * factor) >> shift);
+#else
+    uint64 ll = static_cast<uint64>(static_cast<uint32>(value)) * static_cast<uint32>(factor);
+    uint64 lh = static_cast<uint64>(static_cast<uint32>(value)) * (factor >> 32);
+    uint64 hl = (value >> 32) * static_cast<uint32>(factor);
+    uint64 hh = (value >> 32) * (factor >> 32);
+    uint64 mid = (ll >> 32) + static_cast<uint32>(lh) + static_cast<uint32>(hl);
+    uint64 lo = (mid << 32) | static_cast<uint32>(ll);
+    uint64 hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return shift ? (hi << (64 - shift)) | (lo >> shift) : lo;
+#endif
+  }
+
+  /**
+   * Returns factor/divisor as fixpoint number with 63 significant
+   * bits and the number of fraction bits in shift.  The divisor has
+   * to be less than 1<<63.
+   */
+  static uint64 fixpoint(uint64 factor, uint64 divisor, unsigned &shift) {
+    uint64 res = factor / divisor;
+    uint64 rem = factor % divisor;
+    for (shift = 0; shift < 63 && !(res >> 62); shift++) {
+      rem <<= 1;
+      res = res << 1 | (rem >= divisor);
+      if (rem >= divisor) rem -= divisor;
+    }
+    return res;
+  }
 };
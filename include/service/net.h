@@ -212,6 +212,33 @@ public:
     //Logging::printf("sum() -> %08x %04x %u\n", state, fixup(state), odd);
   }
   
+  /// Update a checksum state with a fragment of the checksummed
+  /// data. offset is the position of the fragment in the data. Unlike
+  /// sum(), this works for fragments at any address and offset.
+  static void
+  sum_fragment(uint8 const *buf, size_t size, size_t offset, uint32 &state)
+  {
+    if (size == 0) return;
+
+    // sum() wants an even address and length. Leading and trailing
+    // bytes are added by hand.
+    unsigned lead   = reinterpret_cast<mword>(buf) & 1;
+    size_t   body   = (size - lead) & ~static_cast<size_t>(1);
+    uint32   part   = 0;
+    bool     odd    = false;
+    sum(buf + lead, body, part, odd);
+
+    uint16 folded = fixup(part);
+    if (lead) folded = folded << 8 | folded >> 8;
+    uint32 local  = folded;
+    if (lead) local += buf[0];
+    if (lead + body < size) local += buf[size - 1] << (lead * 8);
+    folded = fixup(local);
+
+    if (offset & 1) folded = folded << 8 | folded >> 8;
+    state = addoc(state, folded);
+  }
+
   /// Compute an IP checksum.
   static uint16 ipsum(const uint8 *buf, unsigned maclen, unsigned iplen)
   {
@@ -221,16 +248,13 @@ public:
     return ~fixup(state);
   }
 
-  /// Compute TCP/UDP checksum. proto is 17 for UDP and 6 for TCP.
-  static uint16
-  tcpudpsum(const uint8 *buf, uint8 proto,
-	    unsigned maclen, unsigned iplen,
-	    unsigned len, bool ipv6 = false)
+  /// Update a checksum state with the TCP/UDP pseudo header. len is
+  /// the length of the whole packet including the MAC and IP headers.
+  static void
+  pseudo_header(const uint8 *buf, uint8 proto,
+                unsigned maclen, unsigned iplen,
+                unsigned len, bool ipv6, uint32 &state, bool &odd)
   {
-    //Logging::printf("--- tcpudpsum(%p) \n", buf);
-    uint32 state = 0;
-    bool   odd   = false;
-
     if (not ipv6) {
       // IPv4:
       // Source and destination IP addresses (part of pseudo header)
@@ -247,7 +271,20 @@ public:
                                  Endian::hton32(proto) };
       sum(reinterpret_cast<const uint8 *>(pseudo2), sizeof(pseudo2), state, odd);
     }
-      
+  }
+
+  /// Compute TCP/UDP checksum. proto is 17 for UDP and 6 for TCP.
+  static uint16
+  tcpudpsum(const uint8 *buf, uint8 proto,
+	    unsigned maclen, unsigned iplen,
+	    unsigned len, bool ipv6 = false)
+  {
+    //Logging::printf("--- tcpudpsum(%p) \n", buf);
+    uint32 state = 0;
+    bool   odd   = false;
+
+    pseudo_header(buf, proto, maclen, iplen, len, ipv6, state, odd);
+
     // Sum L4 header plus payload
     sum(buf + maclen + iplen, len - maclen - iplen, state, odd);
     return ~fixup(state);
@@ -0,0 +1,196 @@
+/** @file
+ * Lock-free ring for variable-sized packets.
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include "service/cpu.h"
+
+/**
+ * Single-producer/single-consumer ring for variable-sized packets.
+ *
+ * Every packet is a length word followed by the data, padded to
+ * ALIGN bytes. A packet never wraps around the end of the buffer; a
+ * WRAP marker sends the consumer back to the start instead.
+ *
+ * Both sides work on private positions and publish them with
+ * produce_flush() and consume_flush(), so a batch of packets costs
+ * one write to a shared cache line. The positions count bytes and
+ * run freely, the buffer size is a power of two.
+ *
+ * A consumer that runs out of packets calls idle() before it goes to
+ * sleep. The next produce_flush() then returns true and the producer
+ * has to wake it up in whatever way the environment provides. As long
+ * as the consumer is busy, no wakeups are needed.
+ */
+class PacketRing
+{
+  enum {
+    CACHELINE = 64,
+    ALIGN     = 8,
+    HEADER    = sizeof(unsigned),
+    WRAP      = ~0U,
+  };
+
+  // Shared state. Each side writes its own cache line.
+  volatile unsigned _wpos;
+  char              _pad0[CACHELINE - sizeof(unsigned)];
+  volatile unsigned _rpos;
+  volatile unsigned _idle;
+  char              _pad1[CACHELINE - 2*sizeof(unsigned)];
+
+  // Producer-private state.
+  unsigned          _pwpos;
+  unsigned          _prpos;     // cached _rpos
+  char              _pad2[CACHELINE - 2*sizeof(unsigned)];
+
+  // Consumer-private state.
+  unsigned          _crpos;
+  unsigned          _cwpos;     // cached _wpos
+
+  unsigned char    *_buffer;
+  unsigned          _size;
+
+  unsigned &header(unsigned pos) { return *reinterpret_cast<unsigned *>(_buffer + (pos & (_size - 1))); }
+  static unsigned record(unsigned len) { return (HEADER + len + ALIGN - 1) & ~(ALIGN - 1); }
+
+public:
+
+  /**
+   * Returns space for a packet of up to len bytes or 0 if the ring is
+   * full. The packet is not visible until produce() and
+   * produce_flush() are called.
+   */
+  unsigned char *produce_buffer(unsigned len)
+  {
+    unsigned need   = record(len);
+    unsigned offset = _pwpos & (_size - 1);
+    unsigned skip   = (offset + need > _size) ? _size - offset : 0;
+
+    if (need + skip > _size - (_pwpos - _prpos)) {
+      // Look again at the consumer.
+      _prpos = _rpos;
+      if (need + skip > _size - (_pwpos - _prpos)) return 0;
+    }
+
+    if (skip) {
+      header(_pwpos) = WRAP;
+      _pwpos += skip;
+    }
+    return _buffer + (_pwpos & (_size - 1)) + HEADER;
+  }
+
+  /**
+   * Queue a packet of len bytes that was written to the last
+   * produce_buffer().
+   */
+  void produce(unsigned len)
+  {
+    header(_pwpos) = len;
+    _pwpos += record(len);
+  }
+
+  /**
+   * Copy a packet into the ring. Returns false if it is full.
+   */
+  bool produce(const unsigned char *buf, unsigned len)
+  {
+    unsigned char *dst = produce_buffer(len);
+    if (!dst) return false;
+    memcpy(dst, buf, len);
+    produce(len);
+    return true;
+  }
+
+  /**
+   * Make the queued packets visible to the consumer. Returns true if
+   * the consumer is idle and has to be woken up.
+   */
+  bool produce_flush()
+  {
+    if (_wpos == _pwpos) return false;
+    VMM_MEMORY_BARRIER;
+    _wpos = _pwpos;
+    __sync_synchronize();
+    return _idle and __sync_bool_compare_and_swap(&_idle, 1U, 0U);
+  }
+
+  /**
+   * Returns the length of the next packet and points buf to it, or
+   * returns 0 if there is none.
+   */
+  unsigned consume(const unsigned char *&buf)
+  {
+    if (_crpos == _cwpos) {
+      _cwpos = _wpos;
+      if (_crpos == _cwpos) return 0;
+      VMM_MEMORY_BARRIER;
+    }
+
+    unsigned len = header(_crpos);
+    if (len == WRAP) {
+      _crpos += _size - (_crpos & (_size - 1));
+      if (_crpos == _cwpos) return 0;
+      len = header(_crpos);
+    }
+    buf = _buffer + (_crpos & (_size - 1)) + HEADER;
+    return len;
+  }
+
+  /**
+   * Drop the packet returned by the last consume().
+   */
+  void consume_done() { _crpos += record(header(_crpos)); }
+
+  /**
+   * Give the space of the consumed packets back to the producer.
+   */
+  void consume_flush()
+  {
+    VMM_MEMORY_BARRIER;
+    _rpos = _crpos;
+  }
+
+  /**
+   * The consumer wants to sleep. Returns false if packets arrived in
+   * the meantime and the consumer has to continue instead.
+   */
+  bool idle()
+  {
+    consume_flush();
+    _idle = 1;
+    __sync_synchronize();
+    if (_crpos == _wpos) return true;
+
+    // The producer may have seen us idle already. Then we get a
+    // spurious wakeup.
+    __sync_bool_compare_and_swap(&_idle, 1U, 0U);
+    return false;
+  }
+
+  unsigned size() const { return _size; }
+
+  /**
+   * Create a ring with size bytes of storage. size has to be a power
+   * of two.
+   */
+  PacketRing(unsigned size)
+    : _wpos(0), _rpos(0), _idle(1), _pwpos(0), _prpos(0), _crpos(0), _cwpos(0),
+      _buffer(new unsigned char[size]), _size(size)
+  {
+    assert(size and !(size & (size - 1)));
+  }
+};
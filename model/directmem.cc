@@ -43,12 +43,10 @@ class DirectMemDevice : public StaticReceiver<DirectMemDevice>
 
   bool  receive(MessageMem &msg)
   {
-    unsigned *ptr;
-    if (in_range(msg.phys, _phys, _size))
-      ptr = reinterpret_cast<unsigned *>(_ptr + msg.phys - _phys);
-    else return false;
+    if (!msg.covered(_phys, _size)) return false;
+    char *ptr = _ptr + msg.phys - _phys;
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    if (msg.read) memcpy(msg.ptr, ptr, 4 * msg.count); else memcpy(ptr, msg.ptr, 4 * msg.count);
     return true;
   }
 
@@ -78,7 +76,7 @@ PARAM_HANDLER(mio,
 
   DirectMemDevice *dev = new DirectMemDevice(msg.ptr, dest, 1 << size);
   mb.bus_memregion.add(dev,  DirectMemDevice::receive_static<MessageMemRegion>);
-  mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>);
+  mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>, true);
 
 }
 
@@ -24,6 +24,7 @@
 #include <service/net.h>
 #include <service/endian.h>
 #include <service/memory.h>
+#include <service/packetring.h>
 #include <nul/net.h>
 #include <model/pci.h>
 
@@ -46,12 +47,8 @@ using namespace Endian;
 // - RXDCTL.enable (bit 25) may be racy
 // - receive path does not set packet type in RX descriptor
 // - TX legacy descriptors
-// - interrupt thresholds
-// - don't copy packet on TX path if offloading is not used
 // - fancy offloads (SCTP CSO, IPsec, ...)
 // - CSO support with TX legacy descriptors
-// - scatter/gather support in MessageNetwork to avoid packet copy in
-//   TX path.
 
 class Model82576vf : public StaticReceiver<Model82576vf>
 {
@@ -62,6 +59,19 @@ class Model82576vf : public StaticReceiver<Model82576vf>
   DBus<MessageTimer>    &_timer;
   unsigned               _timer_nr;
 
+  // Interrupt moderation: a vector fires at most once per VTEITR
+  // interval. Throttled vectors are sent when _eitr_timer_nr expires.
+  unsigned               _eitr_timer_nr;
+  timevalue              _eitr_last[3];
+  unsigned               _eitr_pending;
+
+  // Received packets whose interrupt waits for the end of the burst.
+  bool                   _rx_pending;
+
+  // Packets from the network backend, if it supports rings.
+  enum { RXRING_SIZE = 256 << 10 };
+  PacketRing             _rxring;
+
   // Guest-physical addresses for MMIO and MSI-X regs.
   uint32 _mem_mmio;
   uint32 _mem_msix;
@@ -121,17 +131,28 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       TDWBAH  = 0x83C/4,
     };
 
-    // We use a huge buffer, because the VM may use segmentation
-    // offload and put a whole TCP window worth of data here.
-    uint8 packet_buf[64 * 1024];
-    unsigned packet_cur;
+    // The packet is sent directly from guest memory. These are the
+    // data buffers of the descriptors collected until EOP.
+    MessageNetwork::Fragment frags[MessageNetwork::MAX_FRAGMENTS];
+    unsigned frag_count;
+    uint32   packet_len;
+
+    // With offloads, the headers are copied and modified here. The
+    // payload stays in guest memory. This is large enough for the
+    // maximum MACLEN, IPLEN and L4LEN of a context descriptor.
+    uint8 header_buf[1024] __attribute__((aligned(16)));
+
+    // The packet or segment we send: header_buf followed by the
+    // payload fragments.
+    MessageNetwork::Fragment segment[MessageNetwork::MAX_FRAGMENTS + 1];
 
     void reset()
     {
       memset(const_cast<uint32 *>(regs), 0, 0x100);
       regs[TXDCTL] = (n == 0) ? (1<<25) : 0;
       txdctl_old = regs[TXDCTL];
-      packet_cur = 0;
+      frag_count = 0;
+      packet_len = 0;
 
       regs[TDBAL] = 0;
       regs[TDBAH] = 0;
@@ -158,8 +179,41 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       ctx[desc.idx()] = desc;
     }
 
-    void apply_segmentation(uint8 *packet, uint32 packet_len,
-			    const tx_desc &desc, bool tse)
+    /// Copy the first len bytes of the current packet to header_buf.
+    void copy_header(uint32 len)
+    {
+      MessageNetwork m(frags, frag_count, packet_len, 0);
+      m.copy(header_buf, len);
+    }
+
+    /// Send header_len bytes from header_buf followed by payload_len
+    /// bytes of the current packet starting at offset.
+    void send_segment(const tx_desc &desc, uint32 header_len, uint32 offset, uint32 payload_len)
+    {
+      unsigned count = 0;
+      uint32   len   = header_len + payload_len;
+
+      segment[count].buffer = header_buf;
+      segment[count++].len  = header_len;
+      for (unsigned i = 0; i < frag_count && payload_len; i++) {
+        if (offset >= frags[i].len) {
+          offset -= frags[i].len;
+          continue;
+        }
+        uint32 chunk = frags[i].len - offset;
+        if (chunk > payload_len) chunk = payload_len;
+        segment[count].buffer = frags[i].buffer + offset;
+        segment[count++].len  = chunk;
+        payload_len -= chunk;
+        offset = 0;
+      }
+
+      apply_offload(count, len, desc);
+      MessageNetwork m(segment, count, len, 0);
+      parent->_net.send(m);
+    }
+
+    void apply_segmentation(const tx_desc &desc, bool tse)
     {
       uint32 payload_len = desc.paylen();
 
@@ -169,9 +223,21 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	  Logging::printf("XXX Got %x bytes, but payload size is %x. Huh? Ignoring packet.\n", packet_len, payload_len);
 	  return;
 	}
-	apply_offload(packet, payload_len, desc);
-        MessageNetwork m(packet, packet_len, 0);
-	parent->_net.send(m);
+
+	if ((desc.popts() & 7) == 0) {
+	  // No offloads. Send the packet as it is.
+	  MessageNetwork m(frags, frag_count, packet_len, 0);
+	  parent->_net.send(m);
+	  return;
+	}
+
+	// Copy everything the offloads may touch: the MAC and IP
+	// headers and a TCP header with all options.
+	const tx_desc &cur_ctx = ctx[desc.idx()];
+	uint32 header_len = cur_ctx.maclen() + cur_ctx.iplen() + 60;
+	if (header_len > packet_len) header_len = packet_len;
+	copy_header(header_len);
+	send_segment(desc, header_len, header_len, packet_len - header_len);
       } else {
 	// TCP segmentation is a bit weird, because the payload length
 	// in the TX descriptor does not include the prototype header.
@@ -200,13 +266,22 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	  return;
 	}
 
+	if ((payload_len > packet_len) || (header_len > sizeof(header_buf)) ||
+	    (maclen + iplen + 20U > header_len)) {
+	  Logging::printf("XXX Bad TSO header length %x. Ignoring packet.\n", header_len);
+	  return;
+	}
+
+	// Only the header is copied. It is modified for every segment,
+	// while the payload is sent from guest memory.
+	copy_header(header_len);
+	uint8  *packet = header_buf;
 	uint16 &packet_ip4_id  = *reinterpret_cast<uint16 *>(packet + maclen + 4);
 	uint16 &packet_ip_len  = *reinterpret_cast<uint16 *>(packet + maclen + (ipv6 ? 4 : 2));
 	uint32 &packet_tcp_seq = *reinterpret_cast<uint32 *>(packet + maclen + iplen + 4);
 	uint8  &packet_tcp_flg = packet[maclen + iplen + 13];
 	uint8  tcp_orig_flg    = packet_tcp_flg;
 
-	unsigned i = 0;
 	while (data_left > 0) {
 	  uint16 chunk_size = (data_left > mss) ? mss : data_left;
 	  data_left -= chunk_size;
@@ -217,29 +292,21 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	    packet_tcp_flg = tcp_orig_flg &
 	      ((data_left == 0) ? /* last */ 0xFF : /* intermediate: set FIN/PSH */ ~9);
 
-	  // Move packet data
-	  if (data_sent != 0) memmove(packet + header_len,
-				      packet + header_len + data_sent,
-				      chunk_size);
-	  
-	  // At this point we have prepared the final packet, we just
+	  // At this point we have prepared the final header, we just
 	  // need to fix checksums and off it goes...
-	  uint32 segment_len = header_len + chunk_size;
-	  apply_offload(packet, segment_len, desc);
-	  MessageNetwork m(packet, segment_len, 0);
-	  parent->_net.send(m);
+	  send_segment(desc, header_len, header_len + data_sent, chunk_size);
 
 	  // Prepare next chunk
 	  data_sent += chunk_size;
 	  if (!ipv6) packet_ip4_id = hton16(ntoh16(packet_ip4_id) + 1);
 	  if (l4t == tx_desc::L4T_TCP) packet_tcp_seq = hton32(ntoh32(packet_tcp_seq) + chunk_size);
-	  i++;
 	}
-	//Logging::panic("INSPECT");
       }
     }
 
-    void apply_offload(uint8 *packet, uint32 packet_len,
+    /// Apply offloads to the count fragments in segment. Only
+    /// header_buf, the first fragment, is modified.
+    void apply_offload(unsigned count, uint32 packet_len,
                        const tx_desc &tx_desc)
     {
       uint8 popts = tx_desc.popts();
@@ -250,10 +317,12 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       uint16 tucmd = ctx[cc].tucmd();
       uint16 iplen = ctx[cc].iplen();
       uint8 maclen = ctx[cc].maclen();
+      uint8 *packet = header_buf;
+      uint32 header_len = segment[0].len;
 
       // Sanity check maclen and iplen. We only cover the case that is
       // harmful to us.
-      if ((maclen+iplen > packet_len)) 
+      if ((maclen+iplen > header_len))
 	return;
 
       if ((popts & 4) != 0 /* IPSEC */) {
@@ -277,10 +346,25 @@ class Model82576vf : public StaticReceiver<Model82576vf>
         case tx_desc::L4T_UDP:		// UDP
         case tx_desc::L4T_TCP:		// TCP
           {
-            uint8 *l4_sum = packet + maclen + iplen + ((l4t == tx_desc::L4T_UDP) ? 6 : 16);
+            uint32 l4_off = maclen + iplen;
+            uint8 *l4_sum = packet + l4_off + ((l4t == tx_desc::L4T_UDP) ? 6 : 16);
+            if (l4_sum + 2 > packet + header_len) break;
             l4_sum[0] = l4_sum[1] = 0;
-            uint16 sum = IPChecksum::tcpudpsum(packet, (l4t == tx_desc::L4T_UDP) ? 17 : 6, maclen, iplen, packet_len,
-                                               (tucmd & 2 /* IPv4 */) == 0);
+
+            // Sum the pseudo header, the L4 header and then the
+            // payload fragments.
+            uint32 state = 0;
+            bool   odd   = false;
+            IPChecksum::pseudo_header(packet, (l4t == tx_desc::L4T_UDP) ? 17 : 6, maclen, iplen, packet_len,
+                                      (tucmd & 2 /* IPv4 */) == 0, state, odd);
+            uint32 pos = 0;
+            IPChecksum::sum_fragment(packet + l4_off, header_len - l4_off, pos, state);
+            pos += header_len - l4_off;
+            for (unsigned i = 1; i < count; i++) {
+              IPChecksum::sum_fragment(segment[i].buffer, segment[i].len, pos, state);
+              pos += segment[i].len;
+            }
+            uint16 sum = ~IPChecksum::fixup(state);
 	    l4_sum[0] = sum;
 	    l4_sum[1] = sum>>8;
           }
@@ -295,14 +379,15 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       }
     }
 
-    void handle_dta(uint64 addr, tx_desc &desc)
+    /// Returns true if the descriptor wants an interrupt.
+    bool handle_dta(uint64 addr, tx_desc &desc)
     {
       uint32 data_len = desc.dtalen();
       uint8  dcmd = desc.dcmd();
 
       if ((dcmd & (1<<5)) == 0) {
         // Logging::printf("TX bad descriptor\n");
-	return;
+	return false;
       }
 
       enum {
@@ -318,28 +403,30 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       if ((dcmd & IFCS) == 0)
         Logging::printf("IFCS not set, but we append FCS anyway in host82576vf.\n");
 
-      // XXX Check if offloading is used. If not -> send directly from
-      // guestmem.
-      if ((packet_cur + data_len) > sizeof(packet_buf)) {
-	Logging::printf("XXX Packet buffer too small? Skipping packet\n");
-	packet_cur = 0;
+      if (frag_count == MessageNetwork::MAX_FRAGMENTS) {
+	Logging::printf("XXX Too many descriptors for one packet? Skipping packet\n");
+	frag_count = 0;
+	packet_len = 0;
 	goto done;
       }
 
-      memcpy(packet_buf + packet_cur, data, data_len);
-      packet_cur += data_len;
+      // Remember where the data is. It is not copied.
+      frags[frag_count].buffer = data;
+      frags[frag_count].len    = data_len;
+      frag_count++;
+      packet_len += data_len;
 
       if (dcmd & EOP) {
-	apply_segmentation(packet_buf, packet_cur, desc, (dcmd & TSE) != 0);
-        packet_cur = 0;
+	apply_segmentation(desc, (dcmd & TSE) != 0);
+	frag_count = 0;
+	packet_len = 0;
       }
 
     done:
       // Descriptor is done
       desc.set_done();
       parent->copy_out(addr, desc.raw, sizeof(desc));
-      if ((dcmd & (1<<3) /* Report Status */) != 0)
-        parent->TX_irq(n);
+      return (dcmd & RS) != 0;
     }
 
     void tdt_poll()
@@ -357,8 +444,10 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       uint32 tdbah = regs[TDBAH];
       uint32 tdbal = regs[TDBAL];
 
-      // Packet send loop.
+      // Packet send loop. The interrupt is raised once for all
+      // descriptors we process here.
       uint32 tdh;
+      bool irq = false;
       while ((tdh = regs[TDH]) != regs[TDT]) {
 	uint64 addr = (static_cast<uint64>(tdbah)<<32 | tdbal) + ((tdh*16) % tdlen);
 	tx_desc desc;
@@ -371,7 +460,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	  uint8 dtyp = (desc.raw[1] >> 20) & 0xF;
 	  switch (dtyp) {
 	  case 2: handle_ctx(addr, desc); break;
-	  case 3: handle_dta(addr, desc); break;
+	  case 3: irq |= handle_dta(addr, desc); break;
 	  default:
 	    Logging::printf("TX unknown descriptor?\n");
 	  }
@@ -381,6 +470,8 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	VMM_MEMORY_BARRIER;
 	regs[TDH] = (((tdh+1)*16 ) % tdlen) / 16;
       }
+
+      if (irq) parent->TX_irq(n);
     }
 
     uint32 read(uint32 offset)
@@ -471,7 +562,9 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       rxdctl_old = rxdctl_new;
     }
 
-    void receive_packet(uint8 *buf, size_t size)
+    /// Put a packet into the next RX descriptor. Returns true if the
+    /// packet was delivered. The caller raises the interrupt.
+    bool receive_packet(uint8 *buf, size_t size)
     {
       // Check early if this packet is for us.
 
@@ -482,7 +575,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 	// Logging::printf("Dropping packet to " MAC_FMT " (%04x) (" MAC_FMT ")\n",
 	//  		MAC_SPLIT(&dst), parent->_mta.hash(dst),
 	//  		MAC_SPLIT(&parent->_mac));
-	return;
+	return false;
       }
 
       rxdctl_poll();
@@ -498,7 +591,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       if (((rxdctl & (1<<25)) == 0 /* Queue disabled? */)
 	  || (rdlen == 0) || (rdt == rdh)) {
 	// Drop
-      	return;
+      	return false;
       }
 
       //Logging::printf("RECV %08x %08x %04x %04x\n", rdbal, rdlen, rdt, rdh);
@@ -507,7 +600,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 
       //Logging::printf("RX descriptor at %llx\n", addr);
       if (!parent->copy_in(addr, desc.raw, sizeof(desc)))
-	return;
+	return false;
 
       // Which descriptor type?
       uint8 desc_type = (srrctl >> 25) & 0xF;
@@ -546,8 +639,7 @@ class Model82576vf : public StaticReceiver<Model82576vf>
       // Advance queue head
       VMM_MEMORY_BARRIER;
       regs[RDH] = (((rdh+1)*16 ) % rdlen) / 16;
-
-      parent->RX_irq(n);
+      return true;
     }
   };
   
@@ -592,17 +684,50 @@ class Model82576vf : public StaticReceiver<Model82576vf>
     return msg.ptr + addr - (msg.start_page << 12);
   }
 
-  // Generate a MSI-X IRQ.
-  void MSIX_irq(unsigned nr)
+  /// The minimum interrupt interval of a vector in clock ticks.
+  timevalue EITR_interval(unsigned nr)
+  {
+    uint32 eitr = (nr == 0) ? rVTEITR0 : ((nr == 1) ? rVTEITR1 : rVTEITR2);
+    // The interval is in bits 14:2 and counts microseconds.
+    uint32 us = (eitr >> 2) & 0x1FFF;
+    return us ? _clock->convert_from(us, 1000000) : 0;
+  }
+
+  void EITR_reprogram()
+  {
+    timevalue next = ~0ULL;
+    for (unsigned i = 0; i < 3; i++)
+      if ((_eitr_pending & (1<<i)) != 0 && _eitr_last[i] + EITR_interval(i) < next)
+	next = _eitr_last[i] + EITR_interval(i);
+    if (next == ~0ULL) return;
+
+    MessageTimer msgn(_eitr_timer_nr, next);
+    if (!_timer.send(msgn))
+      Logging::panic("%s could not program timer.", __PRETTY_FUNCTION__);
+  }
+
+  // Send the MSI-X message of a vector, unless it was masked or
+  // cleared in the meantime or is throttled by its VTEITR.
+  void MSIX_send(unsigned nr)
   {
-    // Logging::printf("MSI-X IRQ %d | EIMS %02x | EIAC %02x | EIAM %02x | C %02x\n", nr,
-    // 		    rVTEIMS, rVTEIAC, rVTEIAM, _msix.table[nr].vector_control);
     uint32 mask = 1<<nr;
-    // Set interrupt cause.
-    rVTEICR |= mask;
+    if ((rVTEICR & mask) == 0) return;
 
     if ((mask & rVTEIMS) != 0) {
       if ((_msix.table[nr].vector_control & 1) == 0) {
+	timevalue interval = EITR_interval(nr);
+	if (interval) {
+	  timevalue now = _clock->time();
+	  if (now - _eitr_last[nr] < interval) {
+	    if ((_eitr_pending & mask) == 0) {
+	      _eitr_pending |= mask;
+	      EITR_reprogram();
+	    }
+	    return;
+	  }
+	  _eitr_last[nr] = now;
+	}
+
 	// Logging::printf("Generating MSI-X IRQ %d (%02x)\n", nr, _msix.table[nr].msg_data & 0xFF);
 	MessageMem msg(false, _msix.table[nr].msg_addr, &_msix.table[nr].msg_data);
 	_bus_mem->send(msg);
@@ -617,6 +742,16 @@ class Model82576vf : public StaticReceiver<Model82576vf>
     }
   }
 
+  // Generate a MSI-X IRQ.
+  void MSIX_irq(unsigned nr)
+  {
+    // Logging::printf("MSI-X IRQ %d | EIMS %02x | EIAC %02x | EIAM %02x | C %02x\n", nr,
+    // 		    rVTEIMS, rVTEIAC, rVTEIAM, _msix.table[nr].vector_control);
+    // Set interrupt cause.
+    rVTEICR |= 1<<nr;
+    MSIX_send(nr);
+  }
+
   /// Generate a mailbox/misc IRQ.
   void MISC_irq()
   {
@@ -640,7 +775,8 @@ class Model82576vf : public StaticReceiver<Model82576vf>
 
   void VTEITR_cb(uint32 old, uint32 val)
   {
-    // Do nothing. Not implemented.
+    // A throttled interrupt may be due earlier now.
+    if (_eitr_pending) EITR_reprogram();
   }
 
   void VMMB_cb(uint32 old, uint32 val)
@@ -790,16 +926,58 @@ public:
     return true;
   }
 
+  /**
+   * Take all packets from the ring until it runs dry.
+   */
+  void rx_drain()
+  {
+    do {
+      const uint8 *buf;
+      unsigned len;
+      while ((len = _rxring.consume(buf))) {
+	_rx_pending |= _rx_queues[0].receive_packet(const_cast<uint8 *>(buf), len);
+	_rxring.consume_done();
+      }
+      _rxring.consume_flush();
+
+      if (_rx_pending) {
+	_rx_pending = false;
+	RX_irq(0);
+      }
+    } while (!_rxring.idle());
+  }
+
   bool receive(MessageNetwork &msg)
   {
-    // XXX Hack. Avoid our own packets.
-    if (!(((msg.buffer < _tx_queues[0].packet_buf) ||
-	   (msg.buffer >= (_tx_queues[0].packet_buf + sizeof(_tx_queues[0].packet_buf)))) &&
-	  ((msg.buffer < _tx_queues[1].packet_buf) ||
-	   (msg.buffer >= (_tx_queues[1].packet_buf + sizeof(_tx_queues[1].packet_buf))))))
+    switch (msg.type) {
+    case MessageNetwork::RING_NOTIFY:
+      if (msg.ring != &_rxring) return false;
+      rx_drain();
+      return true;
+    case MessageNetwork::PACKET:
+      break;
+    default:
       return false;
+    }
 
-    _rx_queues[0].receive_packet(const_cast<uint8 *>(msg.buffer), msg.len);
+    // Avoid our own packets. We always send them as fragments.
+    for (unsigned i = 0; i < 2; i++)
+      if ((msg.fragments == _tx_queues[i].frags) ||
+	  (msg.fragments == _tx_queues[i].segment))
+	return false;
+
+    if (msg.fragcount) {
+      uint8 packet[16384];
+      if (msg.len <= sizeof(packet))
+	_rx_pending |= _rx_queues[0].receive_packet(packet, msg.copy(packet, sizeof(packet)));
+    } else
+      _rx_pending |= _rx_queues[0].receive_packet(const_cast<uint8 *>(msg.buffer), msg.len);
+
+    // Raise one interrupt for a burst of packets.
+    if (_rx_pending && !msg.more) {
+      _rx_pending = false;
+      RX_irq(0);
+    }
     return true;
   }
 
@@ -844,6 +1022,13 @@ public:
 
   bool receive(MessageTimeout &msg)
   {
+    if (msg.nr == _eitr_timer_nr) {
+      unsigned pending = _eitr_pending;
+      _eitr_pending = 0;
+      for (unsigned i = 0; i < 3; i++)
+	if ((pending & (1<<i)) != 0) MSIX_send(i);
+      return true;
+    }
     if (msg.nr != _timer_nr) return false;
 
     for (unsigned i = 0; i < 2; i++) {
@@ -872,6 +1057,10 @@ public:
     _mta.clear();
     _promisc = _promisc_default;
 
+    for (unsigned i = 0; i < 3; i++) _eitr_last[i] = 0;
+    _eitr_pending = 0;
+    _rx_pending   = false;
+
     for (unsigned i = 0; i < 2; i++) {
       _tx_queues[i].reset();
       _rx_queues[i].reset();
@@ -892,7 +1081,7 @@ public:
 	       uint32 mem_mmio, uint32 mem_msix, unsigned txpoll_us, bool map_rx, unsigned bdf,
 	       bool promisc_default)
     : _mac(mac), _net(net), _bus_memregion(bus_memregion), _bus_mem(bus_mem),
-      _clock(clock), _timer(timer),
+      _clock(clock), _timer(timer), _rxring(RXRING_SIZE),
       _mem_mmio(mem_mmio), _mem_msix(mem_msix),
       _txpoll_us(txpoll_us), _map_rx(map_rx), _bdf(bdf),
       _promisc_default(promisc_default)
@@ -916,6 +1105,16 @@ public:
     if (!_timer.send(msgt))
       Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
     _timer_nr = msgt.nr;
+
+    MessageTimer msge;
+    if (!_timer.send(msge))
+      Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
+    _eitr_timer_nr = msge.nr;
+
+    // Without a ring, packets come as MessageNetwork::PACKET.
+    MessageNetwork msgr(MessageNetwork::RING_ATTACH, 0);
+    msgr.ring = &_rxring;
+    _net.send(msgr);
   }
 
 };
@@ -25,7 +25,7 @@
  * Lapic model.
  *
  * State: testing
- * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
+ * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, TSC-deadline timer, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
  * Missing:  focus checking, CR8/TPR setting
  * Difference:  no interrupt polarity, lowest prio is round-robin
  * Documentation: Intel SDM Volume 3a Chapter 10 253668-033.
@@ -37,6 +37,10 @@ class Lapic : public DiscoveryHelper<Lapic>, public StaticReceiver<Lapic>
   enum {
     MAX_FREQ   = 200000000,
     LVT_MASK_BIT = 16,
+    TIMER_MODE_SHIFT = 17,
+    TIMER_PERIODIC = 1,
+    TIMER_TSC_DEADLINE = 2,
+    MSR_TSC_DEADLINE = 0x6e0,
     OFS_ISR   = 0,
     OFS_TMR   = 256,
     OFS_IRR   = 512,
@@ -56,6 +60,8 @@ private:
   // dynamic state
   unsigned  _timer_dcr_shift;
   timevalue _timer_start;
+  timevalue _tsc_deadline;      // in host TSC, 0 if disarmed
+  timevalue _timer_programmed;  // host timer, 0 if not running
   unsigned long long _msr;
   unsigned  _vector[8*3];
   unsigned  _esr_shadow;
@@ -68,6 +74,7 @@ private:
   bool sw_disabled() { return ~_SVR & 0x100; }
   bool hw_disabled() { return ~_msr & 0x800; }
   bool x2apic_mode() { return  (_msr & 0xc00) == 0xc00; }
+  unsigned timer_mode() { return (_TIMER >> TIMER_MODE_SHIFT) & 3; }
   unsigned x2apic_ldr() { return ((_initial_apic_id & ~0xf) << 12) | ( 1 << (_initial_apic_id & 0xf)); }
 
 
@@ -84,6 +91,8 @@ private:
 
     // init dynamic state
     _timer_dcr_shift = 1 + _timer_clock_shift;
+    _tsc_deadline = 0;
+    _timer_programmed = 0;
     memset(_vector,  0, sizeof(_vector));
     memset(_lvtds,   0, sizeof(_lvtds));
     memset(_rirr,    0, sizeof(_rirr));
@@ -162,7 +171,7 @@ private:
     trigger_lvt(_TIMER_offset - LVT_BASE);
 
     // one shot?
-    if (~_TIMER & (1 << 17))  {
+    if (timer_mode() != TIMER_PERIODIC)  {
       _timer_start = 0;
       return 0;
     }
@@ -175,15 +184,49 @@ private:
   }
 
   /**
-   * Reprogram a new host timer.
+   * Trigger the timer LVT if the TSC deadline has passed.
+   */
+  void check_deadline(timevalue now) {
+    if (!_tsc_deadline || now < _tsc_deadline) return;
+    _tsc_deadline = 0;
+    trigger_lvt(_TIMER_offset - LVT_BASE);
+  }
+
+  /**
+   * Reprogram a new host timer.  The host timer is left alone if it
+   * already runs to the same deadline.
    */
   void update_timer(timevalue now) {
-    unsigned value = get_ccr(now);
-    if (!value || _TIMER & (1 << LVT_MASK_BIT)) return;
-    MessageTimer msg(_timer, now + (timevalue(value) << _timer_dcr_shift));
+    timevalue to;
+    if (timer_mode() == TIMER_TSC_DEADLINE) {
+      check_deadline(now);
+      to = _tsc_deadline;
+    }
+    else
+      to = get_ccr(now) ? _timer_start + (timevalue(_ICT) << _timer_dcr_shift) : 0;
+
+    if (!to || _TIMER & (1 << LVT_MASK_BIT) || to == _timer_programmed) return;
+    COUNTER_INC("lapic timer");
+    _timer_programmed = to;
+    MessageTimer msg(_timer, to);
     _mb.bus_timer.send(msg);
   }
 
+  /**
+   * The offset from the host to the guest TSC.  We ask the VCPU for
+   * the guest TSC, as only it knows the offset.  It works on a copy
+   * of the state, so that this message is not changed.
+   */
+  long long tsc_off(CpuMessage &msg) {
+    if (~msg.mtr_in & MTD_TSC) return 0;
+    CpuState state = *msg.cpu;
+    CpuMessage msg2(CpuMessage::TYPE_RDTSC, &state, msg.mtr_in);
+    msg2.mtr_out = msg.mtr_out;
+    msg2.current_tsc_off = msg.current_tsc_off;
+    if (!_vcpu->executor.send(msg2, true)) return 0;
+    return state.edx_eax() - _mb.clock()->time();
+  }
+
 
   /**
    * We send an IPI.
@@ -378,6 +421,7 @@ private:
 
   bool register_write(unsigned offset, unsigned value, bool strict) {
     bool res;
+    unsigned old_mode = timer_mode();
     COUNTER_INC("lapic write");
 
     // XXX
@@ -415,6 +459,13 @@ private:
 	register_write(i + LVT_BASE, value, false);
       }
 
+    // switching the timer mode disarms the timer
+    if (offset == _TIMER_offset && timer_mode() != old_mode) {
+      _ICT = 0;
+      _timer_start = 0;
+      _tsc_deadline = 0;
+    }
+
     // do side effects of a changed LVT entry
     if (in_range(offset, LVT_BASE, NUM_LVT)) {
       if (_lvtds[offset - LVT_BASE]) trigger_lvt(offset - LVT_BASE);
@@ -517,14 +568,23 @@ public:
    */
   bool  receive(MessageMem &msg)
   {
-    if (((_msr & 0xc00) != 0x800) || !in_range(msg.phys, _msr & ~0xfffull, 0x1000)) return false;
-    if ((msg.phys & 0xf) || (msg.phys & 0xfff) >= 0x400) return false;
-
+    if (((_msr & 0xc00) != 0x800) || !msg.covered(_msr & ~0xfffull, 0x400) || (msg.phys & 0xf)) return false;
+
+    // A burst has to start at a register and stay in the register
+    // window, otherwise the bus splits it.  The dwords between the
+    // registers are reserved: they read as zero and ignore writes.
+    for (unsigned i=0; i < msg.count; i++) {
+      uintptr_t phys = msg.phys + 4 * i;
+      if (phys & 0xf) {
+	if (msg.read) msg.ptr[i] = 0;
+	continue;
+      }
 
-    if (msg.read)
-      register_read((msg.phys >> 4) & 0x3f, *msg.ptr);
-    else
-      register_write((msg.phys >> 4) & 0x3f, *msg.ptr, false);
+      if (msg.read)
+	register_read((phys >> 4) & 0x3f, msg.ptr[i]);
+      else
+	register_write((phys >> 4) & 0x3f, msg.ptr[i], false);
+    }
     return true;
   }
 
@@ -549,9 +609,14 @@ public:
   bool  receive(MessageTimeout &msg) {
     if (hw_disabled() || msg.nr != _timer) return false;
 
+    _timer_programmed = 0;
+
     // no need to call update timer here, as the CPU needs to do an
     // EOI first
-    get_ccr(_mb.clock()->time());
+    if (timer_mode() == TIMER_TSC_DEADLINE)
+      update_timer(_mb.clock()->time());
+    else
+      get_ccr(_mb.clock()->time());
     return true;
   }
 
@@ -622,6 +687,12 @@ public:
       // handle APIC base MSR
       if (msg.cpu->ecx == 0x1b) { msg.cpu->edx_eax(_msr); return true; }
 
+      // the deadline reads as zero once the timer fired
+      if (msg.cpu->ecx == MSR_TSC_DEADLINE) {
+	msg.cpu->edx_eax(_tsc_deadline ? _tsc_deadline + tsc_off(msg) : 0);
+	return true;
+      }
+
       // check whether the register is available
       if (!in_range(msg.cpu->ecx, 0x800, 64)
 	  || !x2apic_mode()
@@ -644,6 +715,18 @@ public:
       // handle APIC base MSR
       if (msg.cpu->ecx == 0x1b)  return set_base_msr(msg.cpu->edx_eax());
 
+      // arm the TSC deadline, writes are ignored in other modes
+      if (msg.cpu->ecx == MSR_TSC_DEADLINE) {
+	if (hw_disabled() || timer_mode() != TIMER_TSC_DEADLINE) return true;
+	COUNTER_INC("lapic deadline");
+	unsigned long long value = msg.cpu->edx_eax();
+	long long host = value - tsc_off(msg);
+	// deadlines before the start of the host TSC fire at once
+	_tsc_deadline = value ? (host > 0 ? host : 1) : 0;
+	update_timer(_mb.clock()->time());
+	return true;
+      }
+
 
       // check whether the register is available
       if (!in_range(msg.cpu->ecx, 0x800, 64)
@@ -752,6 +835,8 @@ public:
       CpuMessage(11, 3, 0, _initial_apic_id),
       // support for APIC timer that does not sleep in C-states
       CpuMessage(6, 0, ~(1 << 2), 1 << 2),
+      // support for the TSC-deadline timer
+      CpuMessage(1,  2, ~(1 << 24), 1 << 24),
     };
     for (unsigned i=0; i < sizeof(msg) / sizeof(*msg); i++)
       _vcpu->executor.send(msg[i]);
@@ -762,8 +847,8 @@ public:
     mb.bus_apic.add(this,     receive_static<MessageApic>);
     mb.bus_timeout.add(this,  receive_static<MessageTimeout>);
     mb.bus_discovery.add(this,discover);
-    vcpu->executor.add(this,  receive_static<CpuMessage>);
-    vcpu->mem.add(this,       receive_static<MessageMem>);
+    vcpu->executor.add(this,  receive_static<CpuMessage>, CpuMessage::TYPE_RDMSR, 2); // and WRMSR
+    vcpu->mem.add(this,       receive_static<MessageMem>, true);
     vcpu->memregion.add(this, receive_static<MessageMemRegion>);
     vcpu->bus_lapic.add(this, receive_static<LapicEvent>);
 
@@ -801,7 +886,7 @@ VMM_REGSET(Lapic,
        VMM_REG_RW(_ESR,           0x28,          0, 0xffffffff, _ESR = Cpu::xchg(&_esr_shadow, 0U); return !value; )
        VMM_REG_RW(_ICR,           0x30,          0, 0x000ccfff, if (!send_ipi(_ICR, _ICR1)) COUNTER_INC("IPI missed");)
        VMM_REG_RW(_ICR1,          0x31,          0, 0xff000000,)
-       VMM_REG_RW(_TIMER,         0x32, 0x00010000, 0x310ff, )
+       VMM_REG_RW(_TIMER,         0x32, 0x00010000, 0x710ff, )
        VMM_REG_RW(_TERM,          0x33, 0x00010000, 0x117ff, )
        VMM_REG_RW(_PERF,          0x34, 0x00010000, 0x117ff, )
        VMM_REG_RW(_LINT0,         0x35, 0x00010000, 0x1b7ff, )
@@ -809,8 +894,12 @@ VMM_REGSET(Lapic,
        VMM_REG_RW(_ERROR,         0x37, 0x00010000, 0x110ff, )
        VMM_REG_RW(_ICT,           0x38,          0, ~0u,
 	      COUNTER_INC("lapic ict");
-	      _timer_start = _mb.clock()->time();
-	      update_timer(_timer_start); )
+	      // ignored in TSC-deadline mode
+	      if (timer_mode() == TIMER_TSC_DEADLINE) _ICT = 0;
+	      else {
+		_timer_start = _mb.clock()->time();
+		update_timer(_timer_start);
+	      } )
        VMM_REG_RW(_DCR,           0x3e,          0, 0xb
 ,
 	      {
@@ -23,6 +23,7 @@ class MemoryController : public StaticReceiver<MemoryController>
   char *_physmem;
   uintptr_t _start;
   uintptr_t _end;
+  unsigned *_gen;
 
 
 public:
@@ -31,10 +32,14 @@ public:
   /****************************************************/
   bool  receive(MessageMem &msg)
   {
-    if ((msg.phys < _start) || (msg.phys >= (_end - 4)))  return false;
-    unsigned *ptr = reinterpret_cast<unsigned *>(_physmem + msg.phys);
+    if ((msg.phys < _start) || (msg.phys >= (_end - 4 * msg.count)))  return false;
+    char *ptr = _physmem + msg.phys;
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    if (msg.read) memcpy(msg.ptr, ptr, 4 * msg.count);
+    else {
+      memcpy(ptr, msg.ptr, 4 * msg.count);
+      if (_gen) Cpu::atomic_xadd(_gen + ((msg.phys - _start) >> 12), 1);
+    }
     return true;
   }
 
@@ -45,11 +50,29 @@ public:
     msg.start_page = _start >> 12;
     msg.count = (_end - _start) >> 12;
     msg.ptr = _physmem + _start;
+    msg.gen = _gen;
     return true;
   }
 
 
-  MemoryController(char *physmem, uintptr_t start, uintptr_t end) : _physmem(physmem), _start(start), _end(end) {}
+  /**
+   * The memory is reloaded behind our back on reset, thus all decoded
+   * instructions become invalid.
+   */
+  bool  receive(MessageLegacy &msg)
+  {
+    if (msg.type != MessageLegacy::RESET) return false;
+    for (unsigned i=0; _gen && i < ((_end - _start) >> 12); i++)  Cpu::atomic_xadd(_gen + i, 1);
+    return true;
+  }
+
+
+  /**
+   * Write generations are only handed out if tracked is set, i.e. the
+   * host sees every write of the guest.
+   */
+  MemoryController(char *physmem, uintptr_t start, uintptr_t end, bool tracked)
+    : _physmem(physmem), _start(start), _end(end), _gen(tracked ? new unsigned[(end - start) >> 12]() : 0) {}
 };
 
 
@@ -65,8 +88,10 @@ PARAM_HANDLER(mem,
   uintptr_t start = ~argv[0] ? argv[0] : 0;
   uintptr_t end   = argv[1] > msg.len ? msg.len : argv[1];
   Logging::printf("physmem: %zx [%zx, %zx]\n", size_t(msg.value), start, end);
-  MemoryController *dev = new MemoryController(msg.ptr, start, end);
+  MessageHostOp msg2(MessageHostOp::OP_GUEST_MEM_TRACKED, 0UL);
+  MemoryController *dev = new MemoryController(msg.ptr, start, end, mb.bus_hostop.send(msg2));
   // physmem access
-  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>);
+  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>, start, end - start, true);
   mb.bus_memregion.add(dev, MemoryController::receive_static<MessageMemRegion>);
+  mb.bus_legacy.add(dev,    MemoryController::receive_static<MessageLegacy>);
 }
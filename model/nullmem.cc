@@ -33,8 +33,8 @@ public:
   NullMemDevice(uintptr_t base, size_t size) : _base(base), _size(size) {}
   bool  receive(MessageMem &msg)
   {
-    if (!in_range(msg.phys, _base, _size)) return false;
-    if (msg.read) *msg.ptr = 0xffffffff;
+    if (!msg.covered(_base, _size)) return false;
+    if (msg.read) memset(msg.ptr, 0xff, 4 * msg.count);
     return true;
   }
 };
@@ -44,6 +44,6 @@ PARAM_HANDLER(nullmem,
       "nullmem:<range> - ignore Memory access to the given physical address range.",
       "Example: 'nullmem:0xfee00000,0x1000'.")
 {
-  mb.bus_mem.add(new NullMemDevice(argv[0], argv[1]), NullMemDevice::receive_static<MessageMem>);
+  mb.bus_mem.add(new NullMemDevice(argv[0], argv[1]), NullMemDevice::receive_static<MessageMem>, true);
 }
 
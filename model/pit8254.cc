@@ -446,7 +446,7 @@ PARAM_HANDLER(pit,
 				 argv[1],
 				 pit_count++);
 
-  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>,  argv[0], 4);
+  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>, argv[0], 4);
   mb.bus_pit.add(dev,   PitDevice::receive_static<MessagePit>);
 } 
@@ -54,7 +54,7 @@ public:
 
   PmTimer(Motherboard &mb, unsigned iobase) : _mb(mb), _iobase(iobase) {
 
-    _mb.bus_ioin.add(this,      receive_static<MessageIOIn>);
+    _mb.bus_ioin.add(this,      receive_static<MessageIOIn>, _iobase, 1);
     _mb.bus_discovery.add(this, discover);
   }
 };
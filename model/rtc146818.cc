@@ -434,8 +434,8 @@ PARAM_HANDLER(rtc,
   if (!mb.bus_time.send(msg1))
     Logging::printf("could not get wallclock time!\n");
   rtc->reset(msg1);
-  mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>);
-  mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>);
+  mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>,  argv[0], 8);
+  mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>, argv[0], 8);
   mb.bus_timeout.  add(rtc, Rtc146818::receive_static<MessageTimeout>);
   mb.bus_irqnotify.add(rtc, Rtc146818::receive_static<MessageIrqNotify>);
 }
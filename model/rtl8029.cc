@@ -18,6 +18,7 @@
 
 #include "nul/motherboard.h"
 #include "model/pci.h"
+#include "service/packetring.h"
 
 /**
  * RTL8029 device model.
@@ -65,6 +66,8 @@ class Rtl8029: public StaticReceiver<Rtl8029>
     unsigned char imr;
   } __attribute__((packed)) _regs;
   unsigned char _mem[65536];
+  enum { RXRING_SIZE = 64 << 10 };
+  PacketRing _rxring;
 #define  VMM_REGBASE "../model/rtl8029.cc"
 #include "model/reg.h"
 
@@ -272,10 +275,32 @@ class Rtl8029: public StaticReceiver<Rtl8029>
     return res;
   }
 
+  void rx_drain()
+  {
+    do {
+      const unsigned char *buf;
+      unsigned len;
+      while ((len = _rxring.consume(buf))) {
+	receive_packet(buf, len);
+	_rxring.consume_done();
+      }
+    } while (!_rxring.idle());
+  }
+
 public:
   bool  receive(MessageNetwork &msg)
   {
+    if (msg.type == MessageNetwork::RING_NOTIFY && msg.ring == &_rxring) {
+      rx_drain();
+      return true;
+    }
+    if (msg.type != MessageNetwork::PACKET) return false;
     if (msg.buffer >= _mem && msg.buffer < _mem + sizeof(_mem)) return false;
+    if (msg.fragcount) {
+      unsigned char packet[2048];
+      if (msg.len > sizeof(packet)) return false;
+      return receive_packet(packet, msg.copy(packet, sizeof(packet)));
+    }
     return receive_packet(msg.buffer, msg.len);
   }
 
@@ -308,7 +333,7 @@ public:
 
 
   Rtl8029(DBus<MessageNetwork> &bus_network, DBus<MessageIrqLines> &bus_irqlines, unsigned char irq, unsigned long long mac, unsigned bdf) :
-    _bus_network(bus_network), _bus_irqlines(bus_irqlines),  _irq(irq), _mac(mac), _bdf(bdf)
+    _bus_network(bus_network), _bus_irqlines(bus_irqlines),  _irq(irq), _mac(mac), _bdf(bdf), _rxring(RXRING_SIZE)
   {
     PCI_reset();
 
@@ -324,6 +349,10 @@ public:
 
     // and the read-only regs
     _regs.id8029 = 0x4350;
+
+    MessageNetwork msg(MessageNetwork::RING_ATTACH, 0);
+    msg.ring = &_rxring;
+    _bus_network.send(msg);
   }
 };
 
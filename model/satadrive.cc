@@ -27,7 +27,7 @@
  * speaks the SATA transport layer protocol with its FISes.
  *
  * State: unstable
- * Features: read,write,identify
+ * Features: read,write,identify,ncq
  * Missing: better error handling, many commands
  */
 class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
@@ -42,6 +42,10 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   unsigned char _error;
   unsigned _dsf[7];
   unsigned _splits[32];
+  unsigned _queued;
+  unsigned char _tags[32];
+  // bumped by a COMRESET, older requests carry it in their usertag
+  unsigned _reset_gen;
   DiskParameter _params;
   static unsigned const DMA_DESCRIPTORS = 64;
   DmaDescriptor _dma[DMA_DESCRIPTORS];
@@ -51,13 +55,13 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
    * A command is completed.
    * We send a register d2h FIS to the host.
    */
-  void complete_command()
+  void complete_command(bool irq = true)
   {
     // remove DRQ
     _status = _status & ~0x8;
 
     unsigned d2h[5];
-    d2h[0] = _error << 24 | _status << 16 | 0x4000 | _regs[0] & 0x0f00 | 0x34;
+    d2h[0] = _error << 24 | _status << 16 | (irq ? 0x4000 : 0) | _regs[0] & 0x0f00 | 0x34;
     d2h[1] = _regs[1];
     d2h[2] = _regs[2];
     d2h[3] = _regs[3] & 0xffff;
@@ -86,14 +90,28 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   }
 
 
-  void send_dma_setup_fis(bool direction)
+  void send_dma_setup_fis(bool direction, unsigned tag = 0)
   {
     unsigned dsf[7];
     memset(dsf, 0, sizeof(dsf));
     dsf[0] = 0x800 /* interrupt */ | (direction ? 0x200 : 0)| 0x41;
+    dsf[1] = tag;
     _peer->receive_fis(7, dsf);
   };
 
+
+  /**
+   * Queued commands are completed.
+   * We send a set device bits FIS with their tags to the host.
+   */
+  void send_sdb_fis(unsigned tags)
+  {
+    unsigned sdb[2];
+    sdb[0] = _error << 24 | (_status & 0x77) << 16 | 0x4000 | 0xa1;
+    sdb[1] = tags;
+    _peer->receive_fis(2, sdb);
+  }
+
   /**
    * We build the identify response in a buffer to allow to use push_data.
    */
@@ -112,7 +130,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     identify[61] = maxlba28 >> 16;
     identify[64] = 3;      // pio 3+4
     identify[75] = 0x1f;   // NCQ depth 32
-    identify[76] = 0x002;   // disabled NCQ + 1.5gbit
+    identify[76] = 0x102;   // NCQ + 1.5gbit
     identify[80] = 1 << 6; // major version number: ata-6
     identify[83] = 0x4000 | 1 << 10; // lba48
     identify[86] = 1 << 10; // lba48 enabled
@@ -177,8 +195,8 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     if (!_dsf[3]) return 0;
     uintptr_t prdbase = union64(_dsf[2], _dsf[1]);
 
-    assert(_dsf[6] < 32);
-    assert(_splits[_dsf[6]] == 0);
+    assert(_dsf[6] && _dsf[6] <= 32);
+    assert(_splits[_dsf[6] - 1] == 0);
 
     size_t prd = 0;
     size_t lastoffset = 0;
@@ -229,9 +247,9 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	if (!dmacount)
 	  Logging::panic("single sector transfer unimplemented!");
 
-	_splits[_dsf[6]]++;
+	_splits[_dsf[6] - 1]++;
 
-	MessageDisk msg(read ? MessageDisk::DISK_READ : MessageDisk::DISK_WRITE, _hostdisk, _dsf[6], sector, dmacount, _dma, 0, ~0ul);
+	MessageDisk msg(read ? MessageDisk::DISK_READ : MessageDisk::DISK_WRITE, _hostdisk, _reset_gen << 8 | _dsf[6], sector, dmacount, _dma, 0, ~0ul);
 	check1(1, !_bus_disk.send(msg), "DISK operation failed");
 
 	sector += transfer >> 9;
@@ -291,8 +309,29 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  _regs[3] = _regs[3] & 0xffff0000 | count;
 	  _regs[0] = _regs[0] & 0x00ffffff | (feature << 24);
 	  _regs[2] = _regs[2] & 0x00ffffff | (feature << 16) & 0xff000000;
-	  send_dma_setup_fis(read);
+
+	  // the tag lives in the sector count register
+	  unsigned slot = _dsf[6] - 1;
+	  assert(slot < 32 && ~_queued & (1 << slot));
+	  _tags[slot] = (feature >> 3) & 0x1f;
+	  _queued |= 1 << slot;
+
+	  send_dma_setup_fis(read, _tags[slot]);
+
+	  // Synchronous backends commit while we submit. Hold a split
+	  // ourselves, so that the set device bits FIS cannot overtake
+	  // the D2H FIS that releases the command slot.
+	  _splits[slot]++;
 	  readwrite_sectors(read, true);
+
+	  // release the bus, the command completes with a set device bits FIS
+	  complete_command(false);
+	  if (!--_splits[slot])
+	    {
+	      // everything is committed or nothing was transferred
+	      _queued &= ~(1 << slot);
+	      send_sdb_fis(1 << _tags[slot]);
+	    }
 	}
 	break;
       case 0xc6: // SET MULTIPLE
@@ -341,6 +380,9 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     _error = 1;
     _ctrl = _regs[3] >> 24;
     memset(_splits, 0, sizeof(_splits));
+    _queued = 0;
+    // requests may still be in flight, their commits are dropped
+    _reset_gen = (_reset_gen + 1) & 0xffffff;
     complete_command();
   };
 
@@ -389,22 +431,33 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 
   bool receive(MessageDiskCommit &msg)
   {
-    if (msg.disknr != _hostdisk || msg.usertag > 32) return false;
-    // we are done
-    _status = _status & ~0x8;
-    assert(_splits[msg.usertag]);
+    unsigned tag = msg.usertag & 0xff;
+    if (msg.disknr != _hostdisk || !tag || tag > 32) return false;
+    unsigned slot = tag - 1;
+
+    // the command was aborted by a COMRESET
+    if ((msg.usertag >> 8) != _reset_gen || !_splits[slot]) return true;
     assert(!msg.status);
-    if (!--_splits[msg.usertag])
+    if (--_splits[slot]) return true;
+
+    // queued commands complete in any order
+    if (_queued & (1 << slot))
       {
-	_dsf[6] = msg.usertag;
-	complete_command();
+	_queued &= ~(1 << slot);
+	send_sdb_fis(1 << _tags[slot]);
+	return true;
       }
+
+    // we are done
+    _status = _status & ~0x8;
+    _dsf[6] = tag;
+    complete_command();
     return true;
   }
 
 
   SataDrive(DBus<MessageDisk> &bus_disk, DBus<MessageMemRegion> *bus_memregion, DBus<MessageMem> *bus_mem, unsigned hostdisk, DiskParameter params)
-    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _regs(), _ctrl(0), _status(), _error(), _dsf(), _splits(), _params(params), _dma()
+    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _regs(), _ctrl(0), _status(), _error(), _dsf(), _splits(), _queued(), _tags(), _reset_gen(), _params(params), _dma()
   {
     Logging::printf("SATA disk %x flags %x sectors %zx\n", hostdisk, _params.flags, size_t(_params.sectors));
   }
@@ -76,8 +76,8 @@ public:
    */
   bool receive(MessageMem &msg)
   {
-    if (!msg.read || !in_range(msg.phys, 0xfffffff0, 0x10) && !in_range(msg.phys, BIOS_BASE + 0xfff0, 0x10))  return false;
-    *msg.ptr = *reinterpret_cast<unsigned *>(_resetvector + (msg.phys & 0xc));
+    if (!msg.read || !msg.covered(0xfffffff0, 0x10) && !msg.covered(BIOS_BASE + 0xfff0, 0x10))  return false;
+    memcpy(msg.ptr, _resetvector + (msg.phys & 0xc), 4 * msg.count);
     return true;
   }
 
@@ -114,8 +114,8 @@ public:
 
     // the iret that is the default operation
     _resetvector[0xf] = 0xcf;
-    _vcpu->executor.add(this,   VBios::receive_static<CpuMessage>);
-    _vcpu->mem.add(this,        VBios::receive_static<MessageMem>);
+    _vcpu->executor.add(this,   VBios::receive_static<CpuMessage>, CpuMessage::TYPE_SINGLE_STEP, 1);
+    _vcpu->mem.add(this,        VBios::receive_static<MessageMem>, true);
     _mb.bus_discovery.add(this, VBios::receive_static<MessageDiscovery>);
 
   }
@@ -30,7 +30,6 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
   Motherboard &_mb;
   long long _reset_tsc_off;
 
-  volatile unsigned _event;
   volatile unsigned _sipi;
 
   unsigned char debugioin[8192];
@@ -284,6 +283,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
   }
 
   void handle_ioin(CpuMessage &msg) {
+    stats.io++;
     MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
     bool res = _mb.bus_ioin.send(msg2);
 
@@ -298,6 +298,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
 
   void handle_ioout(CpuMessage &msg) {
+    stats.io++;
     MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
     Cpu::move(&msg2.value, msg.dst, msg.io_order);
 
@@ -340,9 +341,11 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
 public:
   /**
-   * Forward MEM requests to the motherboard.
+   * Forward MEM requests to the motherboard.  Bursts that no device
+   * there takes as a whole are split by our own bus, so that every
+   * piece is delivered once.
    */
-  bool receive(MessageMem &msg) { return _mb.bus_mem.send(msg, true); }
+  bool receive(MessageMem &msg) { return _mb.bus_mem.send_unsplit(msg, true); }
   bool receive(MessageMemRegion &msg) { return _mb.bus_memregion.send(msg, true); }
 
 
@@ -461,7 +464,7 @@ public:
     return true;
   }
 
-  VirtualCpu(VCpu *_last, Motherboard &mb) : VCpu(_last), _mb(mb), _event(0), _sipi(~0u) {
+  VirtualCpu(VCpu *_last, Motherboard &mb) : VCpu(_last), _mb(mb), _sipi(~0u) {
     MessageHostOp msg(this);
     if (!mb.bus_hostop.send(msg)) Logging::panic("could not create VCpu backend.");
     _hostop_id = msg.value;
@@ -470,7 +473,7 @@ public:
     // add to the busses
     executor. add(this, VirtualCpu::receive_static<CpuMessage>);
     bus_event.add(this, VirtualCpu::receive_static<CpuEvent>);
-    mem.      add(this, VirtualCpu::receive_static<MessageMem>);
+    mem.      add(this, VirtualCpu::receive_static<MessageMem>, true);
     memregion.add(this, VirtualCpu::receive_static<MessageMemRegion>);
     mb.bus_legacy.add(this, VirtualCpu::receive_static<MessageLegacy>);
     bus_lapic.add(this, VirtualCpu::receive_static<LapicEvent>);
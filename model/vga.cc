@@ -470,14 +470,14 @@ public:
 
   bool  receive(MessageMem &msg)
   {
-    unsigned *ptr;
-    if (in_range(msg.phys, _framebuffer_phys, _framebuffer_size))
-      ptr = reinterpret_cast<unsigned *>(_framebuffer_ptr + msg.phys - _framebuffer_phys);
-    else if (in_range(msg.phys, LOW_BASE, LOW_SIZE))
-      ptr = reinterpret_cast<unsigned *>(_framebuffer_ptr + msg.phys - LOW_BASE);
+    char *ptr;
+    if (msg.covered(_framebuffer_phys, _framebuffer_size))
+      ptr = _framebuffer_ptr + msg.phys - _framebuffer_phys;
+    else if (msg.covered(LOW_BASE, LOW_SIZE))
+      ptr = _framebuffer_ptr + msg.phys - LOW_BASE;
     else return false;
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    if (msg.read) memcpy(msg.ptr, ptr, 4 * msg.count); else memcpy(ptr, msg.ptr, 4 * msg.count);
     return true;
   }
 
@@ -570,10 +570,13 @@ PARAM_HANDLER(vga,
     Logging::panic("%s failed to alloc %zd from guest memory\n", __PRETTY_FUNCTION__, fbsize);
 
   Vga *dev = new Vga(mb, argv[0], msg2.ptr + msg.phys, msg.phys, fbsize);
-  mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>);
-  mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>);
+  // word and dword accesses may start below the iobase
+  mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>,  argv[0] - 3, 32 + 3);
+  mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>, argv[0] - 3, 32 + 3);
   mb.bus_bios     .add(dev, Vga::receive_static<MessageBios>);
-  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>);
+  // the framebuffer and the legacy window
+  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>, msg.phys, fbsize);
+  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>, 0xa0000, 0x20000);
   mb.bus_memregion.add(dev, Vga::receive_static<MessageMemRegion>);
   mb.bus_discovery.add(dev, Vga::receive_static<MessageDiscovery>);
 }
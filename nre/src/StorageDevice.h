@@ -26,8 +26,9 @@
 
 class StorageDevice {
 public:
-    explicit StorageDevice(DBus<MessageDiskCommit> &bus, nre::DataSpace &guestmem, size_t no)
-        : _no(no), _bus(bus), _sess("storage", guestmem, no) {
+    explicit StorageDevice(DBus<MessageDiskCommit> &bus, DBus<MessageMemRegion> &memregion,
+                           nre::DataSpace &guestmem, size_t no)
+        : _no(no), _bus(bus), _memregion(memregion), _reads(), _sess("storage", guestmem, no) {
         char buffer[32];
         nre::OStringStream os(buffer, sizeof(buffer));
         os << "vmm-storage-" << no;
@@ -50,6 +51,15 @@ public:
     }
 
     void read(unsigned long tag, unsigned long long sector, const DmaDescriptor *dma, size_t count) {
+        // remember where the data goes to note the writes when it is there
+        Read *r = new Read;
+        r->tag = tag;
+        r->dma = new DmaDescriptor[count];
+        r->count = count;
+        memcpy(r->dma, dma, count * sizeof(*dma));
+        r->next = _reads;
+        _reads = r;
+
         nre::Storage::dma_type sdma;
         convert_dma(sdma, dma, count);
         _sess.read(tag, sector, sdma);
@@ -65,6 +75,34 @@ public:
     }
 
 private:
+    struct Read {
+        Read *next;
+        unsigned long tag;
+        DmaDescriptor *dma;
+        size_t count;
+    };
+
+    /**
+     * Let the instruction emulator know about code that a finished read
+     * overwrote.
+     */
+    void written(unsigned long tag) {
+        for(Read **r = &_reads; *r; r = &(*r)->next) {
+            if((*r)->tag != tag)
+                continue;
+            Read *done = *r;
+            *r = done->next;
+            for(size_t i = 0; i < done->count; i++) {
+                MessageMemRegion msg(done->dma[i].byteoffset >> 12);
+                if(_memregion.send(msg, true))
+                    msg.written(done->dma[i].byteoffset, done->dma[i].bytecount);
+            }
+            delete[] done->dma;
+            delete done;
+            return;
+        }
+    }
+
     void convert_dma(nre::Storage::dma_type &dst, const DmaDescriptor *dma, size_t count) {
         while(count-- > 0) {
             dst.push(nre::DMADesc(dma->byteoffset, dma->bytecount));
@@ -79,6 +117,7 @@ private:
             // the status isn't used anyway
             {
                 nre::ScopedLock<nre::UserSm> guard(&globalsm);
+                sd->written(pk->tag);
                 MessageDiskCommit msg(sd->_no, pk->tag, MessageDisk::DISK_OK);
                 sd->_bus.send(msg);
             }
@@ -88,5 +127,8 @@ private:
 
     size_t _no;
     DBus<MessageDiskCommit> &_bus;
+    DBus<MessageMemRegion> &_memregion;
+    // reads in flight, protected by globalsm
+    Read *_reads;
     nre::StorageSession _sess;
 };
@@ -121,7 +121,7 @@ void VCPUBackend::handle_vcpu(capsel_t pid, bool skip, CpuMessage::Type type) {
      * If the IRQ injection is performed, recalc the IRQ window.
      */
     if(msg.mtr_out & Mtd::INJ) {
-        vcpu->inj_count++;
+        vcpu->stats.injections++;
 
         msg.type = CpuMessage::TYPE_CALC_IRQWINDOW;
         if(!vcpu->executor.send(msg, true))
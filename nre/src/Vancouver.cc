@@ -201,6 +201,19 @@ bool Vancouver::receive(MessageHostOp &msg) {
         }
         break;
 
+        case MessageHostOp::OP_MAP_MODULE:
+            // modules are copied
+            return false;
+
+        case MessageHostOp::OP_ALLOC_CODE:
+            // guest code is interpreted
+            return false;
+
+        case MessageHostOp::OP_GUEST_MEM_TRACKED:
+        case MessageHostOp::OP_VCPU_EMULATED:
+            // the guest runs natively, we do not see its writes
+            return false;
+
         case MessageHostOp::OP_GET_MAC:
             msg.mac = generate_mac();
             res = true;
@@ -351,7 +364,7 @@ bool Vancouver::receive(MessageDisk &msg) {
     // storage is optional
     if(!_stdevs[msg.disknr]) {
         try {
-            _stdevs[msg.disknr] = new StorageDevice(_mb.bus_diskcommit, *guest_mem, msg.disknr);
+            _stdevs[msg.disknr] = new StorageDevice(_mb.bus_diskcommit, _mb.bus_memregion, *guest_mem, msg.disknr);
         }
         catch(const Exception &e) {
             Serial::get() << "Disk connect failed: " << e.msg() << "\n";
@@ -393,6 +406,12 @@ bool Vancouver::receive(MessageNetwork &msg) {
             if(addr >= _netsess->inbuf().virt() &&
                     addr + msg.len <= _netsess->inbuf().virt() + _netsess->inbuf().size())
                 return false;
+            if(msg.fragcount) {
+                unsigned char packet[16384];
+                if(msg.len > sizeof(packet))
+                    return false;
+                return _netsess->send(packet, msg.copy(packet, sizeof(packet)));
+            }
             return _netsess->send(msg.buffer, msg.len);
         }
         case MessageNetwork::QUERY_MAC: {
@@ -0,0 +1,248 @@
+/**
+ * ALU instruction check and micro-benchmark
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Runs the portable ALU instructions of the emulator and the same
+ * instructions on the host CPU, like the emulator did before, on
+ * corner cases and random operands and incoming flags. Results and
+ * flags have to match, except for the flags the architecture leaves
+ * undefined. Then it measures both.
+ *
+ * Usage: alubench [random cases]
+ */
+
+#include <service/cpu.h>
+#include "../../executor/alu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Run an instruction on the host with the arithmetic flags from efl.
+ * The red zone below the stack pointer is skipped before pushing.
+ */
+#define NATIVE_ASM(INSN, OPS)						\
+  asm volatile ("lea -128(%%rsp), %%rsp; push %2; popf;" INSN " " OPS "; pushf; pop %2; lea 128(%%rsp), %%rsp" \
+		: "+r"(d), "+c"(s), "+r"(flags))
+
+#define BINARY(R) "%" #R "1, %" #R "0"
+#define SHIFT(R)  "%%cl, %" #R "0"
+#define UNARY(R)  "%" #R "0"
+
+#define NATIVE(NAME, INSN, OPS)						\
+  static unsigned native_##NAME(unsigned &d, unsigned &s, unsigned efl, unsigned size) \
+  {									\
+    unsigned long flags = efl;						\
+    switch (size) {							\
+    case 0:  NATIVE_ASM(INSN "b", OPS(b)); break;			\
+    case 1:  NATIVE_ASM(INSN "w", OPS(w)); break;			\
+    default: NATIVE_ASM(INSN "l", OPS(k)); break;			\
+    }									\
+    return flags;							\
+  }
+
+// There is no byte form of the bit instructions.
+#define NATIVE_BIT(NAME, INSN)						\
+  static unsigned native_##NAME(unsigned &d, unsigned &s, unsigned efl, unsigned size) \
+  {									\
+    unsigned long flags = efl;						\
+    if (size == 1) NATIVE_ASM(INSN "w", BINARY(w));			\
+    else           NATIVE_ASM(INSN "l", BINARY(k));			\
+    return flags;							\
+  }
+
+NATIVE(add,  "add",  BINARY)
+NATIVE(or,   "or",   BINARY)
+NATIVE(adc,  "adc",  BINARY)
+NATIVE(sbb,  "sbb",  BINARY)
+NATIVE(and,  "and",  BINARY)
+NATIVE(sub,  "sub",  BINARY)
+NATIVE(xor,  "xor",  BINARY)
+NATIVE(cmp,  "cmp",  BINARY)
+NATIVE(test, "test", BINARY)
+NATIVE(xadd, "xadd", BINARY)
+NATIVE(inc,  "inc",  UNARY)
+NATIVE(dec,  "dec",  UNARY)
+NATIVE(neg,  "neg",  UNARY)
+NATIVE(not,  "not",  UNARY)
+NATIVE(rol,  "rol",  SHIFT)
+NATIVE(ror,  "ror",  SHIFT)
+NATIVE(rcl,  "rcl",  SHIFT)
+NATIVE(rcr,  "rcr",  SHIFT)
+NATIVE(shl,  "shl",  SHIFT)
+NATIVE(shr,  "shr",  SHIFT)
+NATIVE(sar,  "sar",  SHIFT)
+NATIVE_BIT(bt,  "bt")
+NATIVE_BIT(bts, "bts")
+NATIVE_BIT(btr, "btr")
+NATIVE_BIT(btc, "btc")
+
+/**
+ * The same for the portable instructions, like the emulator runs them.
+ */
+template<class OP, typename T>
+static unsigned portable(unsigned &d, unsigned &s, unsigned efl)
+{
+  T td = d, ts = s;
+  T r = OP::result(td, ts, efl);
+  if (OP::STORE)    d = (d & ~T(~0U)) | r;
+  if (OP::EXCHANGE) s = (s & ~T(~0U)) | td;
+  if (OP::FLAGS == Alu::FLAGS_NONE) return efl;
+  return (efl & ~Alu::ARITH) | OP::flags(td, ts, r, efl);
+}
+
+template<class OP>
+static unsigned portable(unsigned &d, unsigned &s, unsigned efl, unsigned size)
+{
+  switch (size) {
+  case 0:  return portable<OP, unsigned char>(d, s, efl);
+  case 1:  return portable<OP, unsigned short>(d, s, efl);
+  default: return portable<OP, unsigned>(d, s, efl);
+  }
+}
+
+enum Undefined {
+  UNDEF_NONE,
+  UNDEF_AF,        // logical operations
+  UNDEF_SHIFT,     // AF, OF unless the count is one, CF for large counts
+  UNDEF_ROTATE,    // OF unless the count is one
+  UNDEF_BIT,       // everything but CF and ZF
+};
+
+static unsigned undefined(Undefined undef, unsigned s, unsigned size)
+{
+  unsigned count = s & 0x1f;
+  switch (undef) {
+  case UNDEF_AF:     return Alu::AF;
+  case UNDEF_SHIFT:
+    if (!count) return 0;
+    return Alu::AF | (count != 1 ? Alu::OF : 0) | (count >= (8U << size) ? Alu::CF : 0);
+  case UNDEF_ROTATE: return count != 1 ? Alu::OF : 0;
+  case UNDEF_BIT:    return Alu::OF | Alu::SF | Alu::AF | Alu::PF;
+  default:           return 0;
+  }
+}
+
+struct Instruction {
+  const char *name;
+  unsigned (*native)(unsigned &d, unsigned &s, unsigned efl, unsigned size);
+  unsigned (*portable)(unsigned &d, unsigned &s, unsigned efl, unsigned size);
+  Undefined undef;
+  unsigned min_size;
+};
+
+static const Instruction instructions[] = {
+  { "add",  native_add,  portable<AluAdd>,  UNDEF_NONE,   0 },
+  { "or",   native_or,   portable<AluOr>,   UNDEF_AF,     0 },
+  { "adc",  native_adc,  portable<AluAdc>,  UNDEF_NONE,   0 },
+  { "sbb",  native_sbb,  portable<AluSbb>,  UNDEF_NONE,   0 },
+  { "and",  native_and,  portable<AluAnd>,  UNDEF_AF,     0 },
+  { "sub",  native_sub,  portable<AluSub>,  UNDEF_NONE,   0 },
+  { "xor",  native_xor,  portable<AluXor>,  UNDEF_AF,     0 },
+  { "cmp",  native_cmp,  portable<AluCmp>,  UNDEF_NONE,   0 },
+  { "test", native_test, portable<AluTest>, UNDEF_AF,     0 },
+  { "xadd", native_xadd, portable<AluXadd>, UNDEF_NONE,   0 },
+  { "inc",  native_inc,  portable<AluInc>,  UNDEF_NONE,   0 },
+  { "dec",  native_dec,  portable<AluDec>,  UNDEF_NONE,   0 },
+  { "neg",  native_neg,  portable<AluNeg>,  UNDEF_NONE,   0 },
+  { "not",  native_not,  portable<AluNot>,  UNDEF_NONE,   0 },
+  { "rol",  native_rol,  portable<AluRol>,  UNDEF_ROTATE, 0 },
+  { "ror",  native_ror,  portable<AluRor>,  UNDEF_ROTATE, 0 },
+  { "rcl",  native_rcl,  portable<AluRcl>,  UNDEF_ROTATE, 0 },
+  { "rcr",  native_rcr,  portable<AluRcr>,  UNDEF_ROTATE, 0 },
+  { "shl",  native_shl,  portable<AluShl>,  UNDEF_SHIFT,  0 },
+  { "shr",  native_shr,  portable<AluShr>,  UNDEF_SHIFT,  0 },
+  { "sar",  native_sar,  portable<AluSar>,  UNDEF_SHIFT,  0 },
+  { "bt",   native_bt,   portable<AluBt>,   UNDEF_BIT,    1 },
+  { "bts",  native_bts,  portable<AluBts>,  UNDEF_BIT,    1 },
+  { "btr",  native_btr,  portable<AluBtr>,  UNDEF_BIT,    1 },
+  { "btc",  native_btc,  portable<AluBtc>,  UNDEF_BIT,    1 },
+};
+
+static const unsigned corners[] = {
+  0, 1, 2, 7, 8, 9, 15, 16, 17, 31, 32, 33, 0x7f, 0x80, 0xff, 0x100,
+  0x7fff, 0x8000, 0xffff, 0x10000, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff,
+};
+
+static unsigned random_state = 0x12345678;
+static unsigned random32()
+{
+  // xorshift32
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+static unsigned long failures;
+
+static void check(const Instruction &insn, unsigned size, unsigned d, unsigned s, unsigned efl)
+{
+  unsigned mask = size == 0 ? 0xff : size == 1 ? 0xffff : ~0U;
+  unsigned nd = d, ns = s, pd = d, ps = s;
+  unsigned nflags = insn.native(nd, ns, efl, size);
+  unsigned pflags = insn.portable(pd, ps, efl, size);
+  unsigned defined = Alu::ARITH & ~undefined(insn.undef, s, size);
+
+  if ((nd & mask) == (pd & mask) && (ns & mask) == (ps & mask) && !((nflags ^ pflags) & defined))
+    return;
+  if (failures++ < 20)
+    printf("%-4s %u: dst %08x src %08x efl %03x: host %08x %08x %03x, portable %08x %08x %03x\n",
+	   insn.name, 8 << size, d, s, efl, nd & mask, ns & mask, nflags & defined,
+	   pd & mask, ps & mask, pflags & defined);
+}
+
+static unsigned long long measure(const Instruction &insn, bool native, unsigned n)
+{
+  unsigned d = 0x12345678, s = 3, efl = 2;
+  unsigned long long start = Cpu::rdtsc();
+  for (unsigned i = 0; i < n; i++) {
+    efl = native ? insn.native(d, s, efl, 2) : insn.portable(d, s, efl, 2);
+    // Keep the shift counts small and the value alive.
+    s = (s + 1) & 7;
+  }
+  return Cpu::rdtsc() - start;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned cases = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  unsigned long checked = 0;
+  const unsigned ncorners = sizeof(corners) / sizeof(*corners);
+  for (const Instruction &insn : instructions)
+    for (unsigned size = insn.min_size; size < 3; size++) {
+      for (unsigned i = 0; i < ncorners; i++)
+	for (unsigned j = 0; j < ncorners; j++)
+	  for (unsigned efl = 0; efl < 2; efl++, checked++)
+	    check(insn, size, corners[i], corners[j], 2 | (efl ? Alu::ARITH : 0));
+      for (unsigned i = 0; i < cases; i++, checked++)
+	check(insn, size, random32(), random32(), 2 | (random32() & Alu::ARITH));
+    }
+
+  printf("%lu cases checked, %lu failed\n\n", checked, failures);
+  printf("%-6s %12s %12s\n", "insn", "host", "portable");
+  for (const Instruction &insn : instructions) {
+    const unsigned n = 1000000;
+    printf("%-6s %8.1f cyc %8.1f cyc\n", insn.name,
+	   double(measure(insn, true, n)) / n, double(measure(insn, false, n)) / n);
+  }
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// EOF
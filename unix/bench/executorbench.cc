@@ -0,0 +1,145 @@
+/**
+ * Executor dispatch micro-benchmark
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Measures what it costs to get a CpuMessage to its receiver on the
+ * executor bus of a VCpu. The receivers stand in for those of the
+ * unix frontend and check the message type like the real ones: the
+ * LAPIC takes MSRs, the VBIOS looks at single steps, the emulator
+ * takes them and the VCPU gets everything else.
+ *
+ * They are added once for every message type, as the executor bus
+ * used to work, and once only for the types they handle.
+ *
+ * Usage: executorbench [messages]
+ */
+
+#include <nul/vcpu.h>
+#include <service/helper.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+void Logging::panic(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  abort();
+}
+
+void Logging::printf(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+}
+
+void Logging::vprintf(const char *format, va_list &ap)
+{
+  vfprintf(stderr, format, ap);
+}
+
+static unsigned long steps, others;
+
+static bool lapic(Device *, CpuMessage &msg)
+{
+  if (msg.type != CpuMessage::TYPE_RDMSR && msg.type != CpuMessage::TYPE_WRMSR) return false;
+  return msg.cpu->ecx == 0x1b;
+}
+
+static bool vbios(Device *, CpuMessage &msg)
+{
+  if (msg.type != CpuMessage::TYPE_SINGLE_STEP) return false;
+  CpuState *cpu = msg.cpu;
+  return !(cpu->pm() && !cpu->v86()) && in_range(cpu->cs.base + cpu->eip, 0xf0000, 0x100);
+}
+
+static bool emulator(Device *, CpuMessage &msg)
+{
+  if (msg.type != CpuMessage::TYPE_SINGLE_STEP) return false;
+  steps++;
+  return true;
+}
+
+static bool vcpu(Device *, CpuMessage &msg)
+{
+  if (msg.type == CpuMessage::TYPE_SINGLE_STEP) return false;
+  others++;
+  return true;
+}
+
+static double run(DBus<CpuMessage> &executor, CpuMessage::Type type, unsigned long count)
+{
+  CpuState cpu;
+  cpu.clear();
+  cpu.cr0 = 0x11;
+  CpuMessage msg(type, &cpu, ~0U);
+
+  unsigned long long start = Cpu::rdtsc();
+  for (unsigned long i = 0; i < count; i++)
+    if (!executor.send(msg, true)) Logging::panic("nobody took message %u\n", type);
+  return double(Cpu::rdtsc() - start) / count;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long count = argc > 1 ? atol(argv[1]) : 10000000;
+  if (!count) {
+    fprintf(stderr, "Usage: executorbench [messages]\n");
+    return EXIT_FAILURE;
+  }
+
+  // In the order the unix frontend creates them.
+  VCpu broadcast(nullptr);
+  broadcast.executor.add(nullptr, vcpu);
+  broadcast.executor.add(nullptr, emulator);
+  broadcast.executor.add(nullptr, vbios);
+  broadcast.executor.add(nullptr, lapic);
+
+  VCpu typed(nullptr);
+  typed.executor.add(nullptr, vcpu);
+  typed.executor.add(nullptr, emulator, CpuMessage::TYPE_SINGLE_STEP, 1);
+  typed.executor.add(nullptr, vbios,    CpuMessage::TYPE_SINGLE_STEP, 1);
+  typed.executor.add(nullptr, lapic,    CpuMessage::TYPE_RDMSR, 2);
+
+  struct {
+    const char *name;
+    CpuMessage::Type type;
+  } messages[] = {
+    { "single_step", CpuMessage::TYPE_SINGLE_STEP },
+    { "check_irq",   CpuMessage::TYPE_CHECK_IRQ },
+    { "ioin",        CpuMessage::TYPE_IOIN },
+  };
+
+  printf("%-12s %12s %12s\n", "message", "broadcast", "typed");
+  for (auto &m : messages)
+    printf("%-12s %9.1f cyc %9.1f cyc\n", m.name,
+           run(broadcast.executor, m.type, count), run(typed.executor, m.type, count));
+
+  if (steps != 2 * count || others != 4 * count) {
+    printf("FAILED: %lu steps and %lu other messages received\n", steps, others);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// EOF
@@ -0,0 +1,458 @@
+/**
+ * Halifax throughput benchmark
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Runs canned 32-bit guest programs on the instruction emulator,
+ * without devices, timers or a frontend. The guest memory is a flat
+ * buffer behind a minimal memory controller. Every program stops with
+ * HLT and leaves a result in EAX, which is checked against the same
+ * computation on the host, so an optimization that breaks the
+ * emulator does not go unnoticed.
+ *
+ * Instructions are counted like the emulator commits them, so a rep
+ * movs is one instruction, however many bytes it moves.
+ *
+ * A threshold translates blocks that ran that often to host code,
+ * like halifax:threshold does.  The default is to interpret.
+ *
+ * Usage: halifaxbench [scale] [scenario|all] [threshold]
+ */
+
+#include <nul/motherboard.h>
+#include <nul/vcpu.h>
+#include "../../executor/instcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+enum {
+  RAM_SIZE   = 32 << 20,
+  GDT        = 0x500,
+  LOAD       = 0x10000,
+  STACK      = 0x80000,
+  PAGEDIR    = 0x200000,        // followed by the page tables
+  CHASE      = 0x1000000,
+  CHASE_SIZE = 8 << 20,
+  CODE_SIZE  = 2 << 20,
+};
+
+#ifdef __x86_64__
+# define HOST_CODE ".code64\n"
+#else
+# define HOST_CODE ""
+#endif
+
+// The guest programs. They are assembled together with this file and
+// copied to LOAD, so absolute addresses are computed relative to that.
+#define GUEST(NAME, CODE)					\
+  extern "C" const unsigned char NAME[], NAME##_end[];		\
+  asm(".pushsection .rodata\n"					\
+      ".code32\n"						\
+      #NAME ":\n" CODE #NAME "_end:\n"				\
+      HOST_CODE							\
+      ".popsection\n")
+
+#define ABS(NAME, LABEL) "(" LABEL " - " #NAME " + 0x10000)"
+
+// Integer ALU loop. ECX iterations.
+GUEST(guest_alu,
+      "xor %eax, %eax\n"
+      "mov $1, %ebx\n"
+      "xor %edx, %edx\n"
+      "1: add %ebx, %eax\n"
+      "xor %eax, %edx\n"
+      "rol $3, %edx\n"
+      "sub %ecx, %ebx\n"
+      "and $0xfffff, %ebx\n"
+      "or $1, %ebx\n"
+      "add %edx, %eax\n"
+      "dec %ecx\n"
+      "jnz 1b\n"
+      "hlt\n");
+
+// Flags that are consumed by ADC, SETcc and PUSHF, or are
+// overwritten unseen. ECX iterations.
+GUEST(guest_flags,
+      "xor %eax, %eax\n"
+      "mov $0x9e3779b9, %ebx\n"
+      "1: add %ebx, %ebx\n"
+      "adc $0, %eax\n"
+      "cmp %ecx, %ebx\n"
+      "setb %dl\n"
+      "movzbl %dl, %edx\n"
+      "add %edx, %eax\n"
+      "xor %ecx, %ebx\n"
+      "push %ebx\n"
+      "lea 1(%eax), %eax\n"
+      "pop %edx\n"
+      "pushf\n"
+      "pop %edx\n"
+      "and $0xc4, %edx\n"             // SF, ZF and PF
+      "add %edx, %eax\n"
+      "dec %ecx\n"
+      "jnz 1b\n"
+      "hlt\n");
+
+// rep stos to 1M and rep movs from there to 1.5M, 64k each. EBP
+// iterations.
+GUEST(guest_string,
+      "xor %ebx, %ebx\n"
+      "1: mov $0x100000, %edi\n"
+      "mov $16384, %ecx\n"
+      "mov %ebp, %eax\n"
+      "rep stosl\n"
+      "mov $0x100000, %esi\n"
+      "mov $0x180000, %edi\n"
+      "mov $16384, %ecx\n"
+      "rep movsl\n"
+      "add 0x180000 + 4 * 16383, %ebx\n"
+      "dec %ebp\n"
+      "jnz 1b\n"
+      "mov %ebx, %eax\n"
+      "hlt\n");
+
+// Follow a linked list through 8M of paged memory. ECX steps.
+GUEST(guest_chase,
+      "1: mov (%eax), %eax\n"
+      "dec %ecx\n"
+      "jnz 1b\n"
+      "hlt\n");
+
+// Far call and return, then IRET. ECX iterations.
+GUEST(guest_far,
+      "xor %eax, %eax\n"
+      "1: lcall $0x8, $" ABS(guest_far, "3f") "\n"
+      "pushf\n"
+      "push %cs\n"
+      "push $" ABS(guest_far, "2f") "\n"
+      "iret\n"
+      "2: dec %ecx\n"
+      "jnz 1b\n"
+      "hlt\n"
+      "3: add %ecx, %eax\n"
+      "lret\n");
+
+// Calls with a stack frame that load and store an array. ECX
+// iterations.
+GUEST(guest_call,
+      "xor %eax, %eax\n"
+      "mov $0x100000, %esi\n"
+      "1: mov %ecx, %edx\n"
+      "and $0xff, %edx\n"
+      "call 2f\n"
+      "dec %ecx\n"
+      "jnz 1b\n"
+      "hlt\n"
+      "2: push %ebp\n"
+      "mov %esp, %ebp\n"
+      "add (%esi,%edx,4), %eax\n"
+      "mov %eax, 4(%esi,%edx,4)\n"
+      "pop %ebp\n"
+      "ret\n");
+
+// Modify the immediate of an instruction in the loop. ECX iterations.
+GUEST(guest_smc,
+      "xor %eax, %eax\n"
+      "1: .byte 0x05; 2: .long 0\n"  // add $imm32, %eax
+      "incl " ABS(guest_smc, "2b") "\n"
+      "dec %ecx\n"
+      "jnz 1b\n"
+      "hlt\n");
+
+static unsigned char ram[RAM_SIZE] __attribute__((aligned(4096)));
+static unsigned      ram_gen[RAM_SIZE >> 12];
+
+void Logging::panic(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  Logging::vprintf(format, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  abort();
+}
+
+void Logging::printf(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  Logging::vprintf(format, ap);
+  va_end(ap);
+}
+
+void Logging::vprintf(const char *format, va_list &ap)
+{
+  vfprintf(stderr, format, ap);
+}
+
+/**
+ * The guest memory.
+ */
+static bool receive(Device *, MessageMem &msg)
+{
+  if (msg.phys >= RAM_SIZE - 4) return false;
+  unsigned *ptr = reinterpret_cast<unsigned *>(ram + msg.phys);
+  if (msg.read) *msg.ptr = *ptr; else { *ptr = *msg.ptr; ram_gen[msg.phys >> 12]++; }
+  return true;
+}
+
+static bool receive(Device *, MessageMemRegion &msg)
+{
+  if (msg.page >= (RAM_SIZE >> 12)) return false;
+  msg.start_page = 0;
+  msg.count      = RAM_SIZE >> 12;
+  msg.ptr        = reinterpret_cast<char *>(ram);
+  msg.gen        = ram_gen;
+  return true;
+}
+
+static bool halted, crashed;
+
+static bool receive(Device *, CpuMessage &msg)
+{
+  switch (msg.type) {
+  case CpuMessage::TYPE_HLT:
+    halted = true;
+    return true;
+  case CpuMessage::TYPE_TRIPLE:
+    crashed = true;
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * The emulator without anything else.
+ */
+class BenchCpu : public InstructionCache
+{
+public:
+  BenchCpu(VCpu *vcpu) : InstructionCache(vcpu) {}
+};
+
+struct Scenario {
+  const char          *name;
+  const unsigned char *code;
+  const unsigned char *code_end;
+  unsigned             iterations;
+
+  /// Prepare memory and registers. Returns the expected EAX.
+  unsigned (*setup)(CpuState &cpu, unsigned iterations);
+};
+
+static unsigned setup_alu(CpuState &cpu, unsigned n)
+{
+  cpu.ecx = n;
+  unsigned eax = 0, ebx = 1, edx = 0;
+  for (unsigned ecx = n; ecx; ecx--) {
+    eax += ebx;
+    edx ^= eax;
+    edx  = (edx << 3) | (edx >> 29);
+    ebx -= ecx;
+    ebx  = (ebx & 0xfffff) | 1;
+    eax += edx;
+  }
+  return eax;
+}
+
+static unsigned setup_flags(CpuState &cpu, unsigned n)
+{
+  cpu.ecx = n;
+  unsigned eax = 0, ebx = 0x9e3779b9;
+  for (unsigned ecx = n; ecx; ecx--) {
+    eax += ebx >> 31;
+    ebx += ebx;
+    eax += ebx < ecx;
+    ebx ^= ecx;
+    eax += 1;
+    eax += (ebx >> 31) << 7 | (!ebx) << 6 | !__builtin_parity(ebx & 0xff) << 2;
+  }
+  return eax;
+}
+
+static unsigned setup_string(CpuState &cpu, unsigned n)
+{
+  cpu.ebp = n;
+  return n * (n + 1ULL) / 2;
+}
+
+static unsigned setup_chase(CpuState &cpu, unsigned n)
+{
+  // Identity-map the memory with 4k pages.
+  unsigned *pd = reinterpret_cast<unsigned *>(ram + PAGEDIR);
+  unsigned *pt = pd + 1024;
+  for (unsigned i = 0; i < (RAM_SIZE >> 22); i++)
+    pd[i] = (PAGEDIR + 0x1000 * (i + 1)) | 3;
+  for (unsigned i = 0; i < (RAM_SIZE >> 12); i++)
+    pt[i] = (i << 12) | 3;
+  cpu.cr3  = PAGEDIR;
+  cpu.cr0 |= 0x80000000;
+
+  // A random cycle through two words per page.
+  enum { NODES = CHASE_SIZE / 2048 };
+  static unsigned order[NODES];
+  unsigned seed = 42;
+  for (unsigned i = 0; i < NODES; i++) order[i] = i;
+  for (unsigned i = NODES - 1; i > 0; i--) {
+    unsigned j = rand_r(&seed) % (i + 1);
+    unsigned t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+  for (unsigned i = 0; i < NODES; i++)
+    *reinterpret_cast<unsigned *>(ram + CHASE + order[i] * 2048) = CHASE + order[(i + 1) % NODES] * 2048;
+
+  cpu.eax = CHASE + order[0] * 2048;
+  cpu.ecx = n;
+  unsigned eax = cpu.eax;
+  for (unsigned i = 0; i < n; i++) eax = *reinterpret_cast<unsigned *>(ram + eax);
+  return eax;
+}
+
+static unsigned setup_far(CpuState &cpu, unsigned n)
+{
+  cpu.ecx = n;
+  return n * (n + 1ULL) / 2;
+}
+
+static unsigned setup_call(CpuState &cpu, unsigned n)
+{
+  cpu.ecx = n;
+  unsigned array[257] = {}, eax = 0;
+  for (unsigned ecx = n; ecx; ecx--) {
+    eax += array[ecx & 0xff];
+    array[(ecx & 0xff) + 1] = eax;
+  }
+  return eax;
+}
+
+static unsigned setup_smc(CpuState &cpu, unsigned n)
+{
+  cpu.ecx = n;
+  return n * (n - 1ULL) / 2;
+}
+
+static const Scenario scenarios[] = {
+  { "alu",    guest_alu,    guest_alu_end,    2000000, setup_alu    },
+  { "flags",  guest_flags,  guest_flags_end,  1000000, setup_flags  },
+  { "string", guest_string, guest_string_end, 200,     setup_string },
+  { "chase",  guest_chase,  guest_chase_end,  2000000, setup_chase  },
+  { "far",    guest_far,    guest_far_end,    200000,  setup_far    },
+  { "call",   guest_call,   guest_call_end,   1000000, setup_call   },
+  { "smc",    guest_smc,    guest_smc_end,    200000,  setup_smc    },
+};
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Flat 32-bit protected mode with a code and a data segment in the GDT.
+ */
+static void reset_cpu(CpuState &cpu)
+{
+  unsigned long long *gdt = reinterpret_cast<unsigned long long *>(ram + GDT);
+  gdt[0] = 0;
+  gdt[1] = 0x00cf9b000000ffffULL;
+  gdt[2] = 0x00cf93000000ffffULL;
+
+  cpu.clear();
+  cpu.cr0 = 0x11;
+  cpu.efl = 2;
+  cpu.eip = LOAD;
+  cpu.esp = STACK;
+  cpu.cs.set(0x08, 0, 0xffffffff, 0xc9b);
+  cpu.ss.set(0x10, 0, 0xffffffff, 0xc93);
+  cpu.ds = cpu.es = cpu.fs = cpu.gs = cpu.ss;
+  cpu.ld.set(0, 0, 0xffff, 0x1000);
+  cpu.tr.set(0, 0, 0xffff, 0x8b);
+  cpu.gd.set(0, GDT, 3 * 8 - 1, 0);
+  cpu.id.set(0, 0, 0xffff, 0);
+}
+
+static bool run(const Scenario &s, unsigned scale, unsigned threshold, void *code)
+{
+  VCpu vcpu(nullptr);
+  vcpu.mem.add(nullptr, receive);
+  vcpu.memregion.add(nullptr, receive);
+  vcpu.executor.add(nullptr, receive);
+  BenchCpu *emulator = new BenchCpu(&vcpu);
+  emulator->enable_persistent_tlb();
+  if (threshold) emulator->enable_translation(code, CODE_SIZE, threshold);
+
+  memset(ram, 0, RAM_SIZE);
+  memset(ram_gen, 0, sizeof(ram_gen));
+  memcpy(ram + LOAD, s.code, s.code_end - s.code);
+
+  CpuState cpu;
+  reset_cpu(cpu);
+  unsigned iterations = s.iterations * scale;
+  unsigned expected   = s.setup(cpu, iterations);
+
+  halted = crashed = false;
+  unsigned long long start     = now_ns();
+  unsigned long long start_tsc = Cpu::rdtsc();
+  while (!halted && !crashed) {
+    CpuMessage msg(CpuMessage::TYPE_SINGLE_STEP, &cpu, ~0U);
+    emulator->step(msg);
+  }
+  unsigned long long cycles = Cpu::rdtsc() - start_tsc;
+  unsigned long long ns     = now_ns() - start;
+  unsigned long long insns  = vcpu.stats.instructions;
+  delete emulator;
+
+  printf("%-8s %12llu insns %9.2f Minsns/s %8.1f cycles/insn\n", s.name, insns,
+         insns * 1000.0 / ns, double(cycles) / insns);
+  if (crashed || cpu.eax != expected) {
+    printf("%-8s FAILED: eax %08x expected %08x at eip %08x%s\n", s.name,
+           cpu.eax, expected, cpu.eip, crashed ? " after a triple fault" : "");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned scale = argc > 1 ? atoi(argv[1]) : 1;
+  const char *only = argc > 2 && strcmp(argv[2], "all") ? argv[2] : nullptr;
+  unsigned threshold = argc > 3 ? atoi(argv[3]) : 0;
+  if (!scale) {
+    fprintf(stderr, "Usage: halifaxbench [scale] [scenario|all] [threshold]\n");
+    return EXIT_FAILURE;
+  }
+
+  void *code = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+
+  bool ok = true;
+  for (const Scenario &s : scenarios)
+    if (!only || !strcmp(only, s.name))
+      ok &= run(s, scale, threshold, code);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// EOF
@@ -0,0 +1,194 @@
+/**
+ * Timeout list micro-benchmark
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Compares the timer wheel in TimeoutList with the sorted list it
+ * replaced. Both get the same stream of requests, cancels and
+ * triggers, like a number of periodic device timers would produce.
+ * The triggered timeouts have to match.
+ *
+ * Usage: timerbench [timers] [operations]
+ */
+
+#include <nul/timer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * The old TimeoutList: a sorted doubly linked list.
+ */
+template <unsigned ENTRIES, typename DATA>
+class SortedTimeoutList
+{
+  struct TimeoutEntry
+  {
+    TimeoutEntry *_next;
+    TimeoutEntry *_prev;
+    timevalue _timeout;
+    DATA * data;
+    bool      _free;
+  };
+
+  TimeoutEntry  _entries[ENTRIES];
+public:
+  unsigned alloc(DATA * _data = 0)
+  {
+    for (unsigned i=1; i < ENTRIES; i++) {
+      if (not _entries[i]._free) continue;
+      _entries[i].data  = _data;
+      _entries[i]._free = false;
+      return i;
+    }
+    fprintf(stderr, "Can't alloc a timer!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int cancel(unsigned nr)
+  {
+    TimeoutEntry *current = _entries+nr;
+    if (current->_next == current) return -2;
+    int res = _entries[0]._next != current;
+
+    current->_next->_prev =  current->_prev;
+    current->_prev->_next =  current->_next;
+    current->_next = current->_prev = current;
+    return res;
+  }
+
+  int request(unsigned nr, timevalue to)
+  {
+    timevalue old = timeout();
+    TimeoutEntry *current = _entries + nr;
+    cancel(nr);
+
+    TimeoutEntry *t = _entries;
+    do { t = t->_next; }  while (t->_timeout < to);
+
+    current->_timeout = to;
+    current->_next = t;
+    current->_prev = t->_prev;
+    t->_prev->_next = current;
+    t->_prev = current;
+    return timeout() == old;
+  }
+
+  unsigned  trigger(timevalue now) {
+    if (now >= timeout()) return _entries[0]._next - _entries;
+    return 0;
+  }
+
+  timevalue timeout() { return _entries[0]._next->_timeout; }
+
+  SortedTimeoutList()
+  {
+    for (unsigned i = 0; i < ENTRIES; i++) {
+      _entries[i]._prev = _entries + i;
+      _entries[i]._next = _entries + i;
+      _entries[i].data  = 0;
+      _entries[i]._free = true;
+    }
+    _entries[0]._timeout = ~0ULL;
+  }
+};
+
+enum { MAX_TIMERS = 4096 };
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Replay a pseudo-random workload. Every timer has a period between
+ * 1us and 10ms (in 1GHz TSC units) and is rearmed when it fires or
+ * with a probability of 1/4 before that. Returns a checksum of the
+ * fired timeouts.
+ */
+template <typename LIST>
+static unsigned long long run(LIST &list, unsigned timers, unsigned ops, unsigned long long &ns)
+{
+  unsigned nr[MAX_TIMERS];
+  unsigned index[MAX_TIMERS];
+  unsigned period[MAX_TIMERS];
+  unsigned seed = 42;
+  timevalue now = 1000000;
+  unsigned long long sum = 0;
+  unsigned long long fired = 0;
+
+  for (unsigned i = 0; i < timers; i++) {
+    nr[i]     = list.alloc();
+    period[i] = 1000 + rand_r(&seed) % 10000000;
+    index[nr[i]] = i;
+    list.request(nr[i], now + period[i]);
+  }
+
+  unsigned long long start = now_ns();
+  for (unsigned op = 0; op < ops; op++) {
+    unsigned i = rand_r(&seed) % timers;
+    switch (rand_r(&seed) % 4) {
+    case 0:
+      list.request(nr[i], now + period[i]);
+      break;
+    default:
+      now += rand_r(&seed) % 2000;
+      unsigned t;
+      while ((t = list.trigger(now))) {
+        // timers with the same timeout may trigger in any order
+        sum    = sum * 31 + list.timeout();
+        fired += t;
+        list.cancel(t);
+        list.request(t, now + period[index[t]]);
+      }
+      break;
+    }
+  }
+  ns = now_ns() - start;
+  return sum ^ fired;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned timers = argc > 1 ? atoi(argv[1]) : 32;
+  unsigned ops    = argc > 2 ? atoi(argv[2]) : 1000000;
+  if (!timers || timers >= MAX_TIMERS) {
+    fprintf(stderr, "timers must be between 1 and %u\n", MAX_TIMERS - 1);
+    return EXIT_FAILURE;
+  }
+
+  static SortedTimeoutList<MAX_TIMERS, void> sorted;
+  static TimeoutList<32, void> wheel;
+
+  unsigned long long ns_sorted, ns_wheel;
+  unsigned long long sum_sorted = run(sorted, timers, ops, ns_sorted);
+  unsigned long long sum_wheel  = run(wheel,  timers, ops, ns_wheel);
+
+  printf("%u timers, %u operations\n", timers, ops);
+  printf("sorted list: %8.1f ns/op\n", double(ns_sorted) / ops);
+  printf("timer wheel: %8.1f ns/op\n", double(ns_wheel)  / ops);
+  if (sum_sorted != sum_wheel) {
+    printf("MISMATCH: the timeouts triggered in a different order\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// EOF
@@ -0,0 +1,392 @@
+/**
+ * UNIX Seoul frontend - asynchronous disk I/O
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Disk requests are submitted as a single vectored read or write and
+ * complete in the background. The MessageDiskCommit is sent from the
+ * completion thread, so the submitting vCPU never waits for the disk.
+ *
+ * We use io_uring if the kernel supports it. Otherwise, and whenever
+ * the ring is full, requests go to a small pool of worker threads.
+ */
+
+#include <nul/motherboard.h>
+#include <host/dma.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+#include <seoul/unix.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+struct DiskRequest {
+  DiskRequest       *next;
+  int                fd;
+  MessageDisk::Type  type;
+  unsigned           disknr;
+  unsigned long      usertag;
+  off_t              offset;
+  size_t             length;
+  unsigned           dmacount;
+  DmaDescriptor     *dma;
+  struct iovec      *iov;
+  ssize_t            res;
+  bool               pooled;
+};
+
+static Motherboard *disk_mb;
+
+// Worker pool
+
+enum { DISK_WORKERS = 4 };
+
+static pthread_mutex_t  pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   drain_cond = PTHREAD_COND_INITIALIZER;
+static DiskRequest     *pool_head;
+static DiskRequest     *pool_tail;
+
+/**
+ * Write bookkeeping for flushes. The workers run requests in
+ * parallel, so a flush has to wait for the writes before it.
+ */
+static unsigned         writes_inflight; // Submitted, but not completed.
+static unsigned         writes_queued;   // Still waiting in the pool queue.
+static unsigned         pool_writes;     // Given to the pool, but not completed.
+
+static void disk_complete(DiskRequest *r)
+{
+  MessageDisk::Status status = MessageDisk::DISK_OK;
+
+  if (r->res < 0) {
+    Logging::printf("disk %u: I/O error %zd\n", r->disknr, r->res);
+    status = MessageDisk::DISK_STATUS_DEVICE;
+  } else if (r->type != MessageDisk::DISK_FLUSH_CACHE and size_t(r->res) < r->length)
+    Logging::printf("short read/write: %zd instead of %zd\n", r->res, r->length);
+
+  // Let the instruction emulator know about modified code.
+  if (r->type == MessageDisk::DISK_READ)
+    for (unsigned i=0; i < r->dmacount; i++) {
+      MessageMemRegion mmsg(r->dma[i].byteoffset >> 12);
+      if (disk_mb->bus_memregion.send(mmsg, true))
+        mmsg.written(r->dma[i].byteoffset, r->dma[i].bytecount);
+    }
+
+  if (r->type == MessageDisk::DISK_WRITE) {
+    pthread_mutex_lock(&pool_mtx);
+    writes_inflight--;
+    if (r->pooled) pool_writes--;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&pool_mtx);
+  }
+
+  // The busses take the device lock themselves.
+  MessageDiskCommit cmsg(r->disknr, r->usertag, status);
+  disk_mb->bus_diskcommit.send(cmsg);
+
+  delete [] r->dma;
+  delete [] r->iov;
+  delete r;
+}
+
+static void disk_execute(DiskRequest *r)
+{
+  switch (r->type) {
+  case MessageDisk::DISK_READ:
+    r->res = preadv(r->fd, r->iov, r->dmacount, r->offset);
+    break;
+  case MessageDisk::DISK_WRITE:
+    r->res = pwritev(r->fd, r->iov, r->dmacount, r->offset);
+    break;
+  case MessageDisk::DISK_FLUSH_CACHE:
+    r->res = fdatasync(r->fd);
+    break;
+  default:
+    assert(0);
+  }
+  if (r->res < 0) r->res = -errno;
+}
+
+static void *disk_worker_fn(void *)
+{
+  while (true) {
+    pthread_mutex_lock(&pool_mtx);
+    while (!pool_head) pthread_cond_wait(&pool_cond, &pool_mtx);
+    DiskRequest *r = pool_head;
+    pool_head = r->next;
+    if (!pool_head) pool_tail = nullptr;
+    if (r->type == MessageDisk::DISK_WRITE) writes_queued--;
+
+    // The queue is FIFO, so every write that was submitted before the
+    // flush has left it already. Wait until they are all completed.
+    if (r->type == MessageDisk::DISK_FLUSH_CACHE)
+      while (writes_inflight != writes_queued)
+        pthread_cond_wait(&drain_cond, &pool_mtx);
+    pthread_mutex_unlock(&pool_mtx);
+
+    disk_execute(r);
+    disk_complete(r);
+  }
+
+  // NOTREACHED
+  return nullptr;
+}
+
+static void pool_submit(DiskRequest *r)
+{
+  r->next   = nullptr;
+  r->pooled = true;
+  pthread_mutex_lock(&pool_mtx);
+  if (r->type == MessageDisk::DISK_WRITE) {
+    writes_queued++;
+    pool_writes++;
+  }
+  if (pool_tail) pool_tail->next = r; else pool_head = r;
+  pool_tail = r;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_mtx);
+}
+
+// io_uring
+
+#ifdef HAVE_IO_URING
+
+enum { RING_ENTRIES = 64 };
+
+static struct {
+  int                  fd;
+  unsigned             inflight;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+} ring;
+
+static pthread_mutex_t ring_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_enter(unsigned submit, unsigned complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, ring.fd, submit, complete, flags, nullptr, 0);
+}
+
+static bool ring_init()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (fd < 0) return false;
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  char *sq = reinterpret_cast<char *>(mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           fd, IORING_OFF_SQ_RING));
+  char *cq = sq;
+  if (sq != MAP_FAILED and !(p.features & IORING_FEAT_SINGLE_MMAP))
+    cq = reinterpret_cast<char *>(mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_CQ_RING));
+  void *sqes = MAP_FAILED;
+  if (sq != MAP_FAILED and cq != MAP_FAILED)
+    sqes = mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  ring.fd       = fd;
+  ring.sq_tail  = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  ring.sq_mask  = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  ring.sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  ring.sqes     = reinterpret_cast<struct io_uring_sqe *>(sqes);
+  ring.cq_head  = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  ring.cq_tail  = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  ring.cq_mask  = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  ring.cqes     = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+  return true;
+}
+
+/**
+ * Queue a request on the ring. Fails if there is no ring or more
+ * requests are in flight than the completion queue can hold.
+ */
+static bool ring_submit(DiskRequest *r)
+{
+  if (!ring.sqes) return false;
+
+  pthread_mutex_lock(&ring_mtx);
+  if (ring.inflight >= RING_ENTRIES) {
+    pthread_mutex_unlock(&ring_mtx);
+    return false;
+  }
+
+  unsigned tail = *ring.sq_tail;
+  unsigned idx  = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+
+  sqe->fd        = r->fd;
+  sqe->user_data = reinterpret_cast<uintptr_t>(r);
+  switch (r->type) {
+  case MessageDisk::DISK_READ:
+  case MessageDisk::DISK_WRITE:
+    sqe->opcode = r->type == MessageDisk::DISK_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->addr   = reinterpret_cast<uintptr_t>(r->iov);
+    sqe->len    = r->dmacount;
+    sqe->off    = r->offset;
+    break;
+  case MessageDisk::DISK_FLUSH_CACHE:
+    // Flush everything that was submitted before.
+    sqe->opcode      = IORING_OP_FSYNC;
+    sqe->flags       = IOSQE_IO_DRAIN;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    break;
+  default:
+    assert(0);
+  }
+
+  ring.sq_array[idx] = idx;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.inflight++;
+
+  bool res = ring_enter(1, 0, 0) == 1;
+  if (!res) {
+    // The kernel did not take it, so we drop it again.
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    ring.inflight--;
+  }
+  pthread_mutex_unlock(&ring_mtx);
+  return res;
+}
+
+static void *ring_completion_fn(void *)
+{
+  while (true) {
+    if (ring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 and errno != EINTR) {
+      perror("io_uring_enter");
+      break;
+    }
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      DiskRequest *r = reinterpret_cast<DiskRequest *>(uintptr_t(cqe->user_data));
+      r->res = cqe->res;
+      __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+      pthread_mutex_lock(&ring_mtx);
+      ring.inflight--;
+      pthread_mutex_unlock(&ring_mtx);
+
+      disk_complete(r);
+    }
+  }
+
+  return nullptr;
+}
+
+#else
+
+static bool ring_init()                { return false; }
+static bool ring_submit(DiskRequest *) { return false; }
+
+#endif
+
+bool disk_io_init(Motherboard &mb)
+{
+  disk_mb = &mb;
+
+  pthread_t tid;
+  if (ring_init()) {
+#ifdef HAVE_IO_URING
+    if (0 != pthread_create(&tid, nullptr, ring_completion_fn, nullptr)) {
+      perror("pthread_create");
+      return false;
+    }
+    pthread_setname_np(tid, "disk");
+#endif
+    Logging::printf("disk: using io_uring.\n");
+  }
+
+  // The pool also takes the requests that do not fit into the ring.
+  for (unsigned i = 0; i < DISK_WORKERS; i++) {
+    if (0 != pthread_create(&tid, nullptr, disk_worker_fn, nullptr)) {
+      perror("pthread_create");
+      return false;
+    }
+    pthread_setname_np(tid, "disk");
+  }
+  return true;
+}
+
+void disk_io_submit(int fd, char *base, MessageDisk &msg)
+{
+  DiskRequest *r = new DiskRequest;
+  r->fd       = fd;
+  r->type     = msg.type;
+  r->disknr   = msg.disknr;
+  r->usertag  = msg.usertag;
+  r->offset   = msg.sector << 9;
+  r->length   = 0;
+  r->dmacount = 0;
+  r->dma      = nullptr;
+  r->iov      = nullptr;
+  r->pooled   = false;
+
+  if (msg.type != MessageDisk::DISK_FLUSH_CACHE) {
+    // The descriptors belong to the caller, so we keep our own copy.
+    r->dmacount = msg.dmacount;
+    r->dma      = new DmaDescriptor[msg.dmacount];
+    r->iov      = new struct iovec[msg.dmacount];
+    for (unsigned i=0; i < msg.dmacount; i++) {
+      r->dma[i]          = msg.dma[i];
+      r->iov[i].iov_base = base + msg.dma[i].byteoffset;
+      r->iov[i].iov_len  = msg.dma[i].bytecount;
+      r->length         += msg.dma[i].bytecount;
+    }
+  }
+
+  // The ring only orders a flush against the writes on the ring, so
+  // it goes to the pool as long as the pool has writes outstanding.
+  pthread_mutex_lock(&pool_mtx);
+  bool ordered = !pool_writes;
+  if (r->type == MessageDisk::DISK_WRITE) writes_inflight++;
+  pthread_mutex_unlock(&pool_mtx);
+
+  if ((r->type == MessageDisk::DISK_FLUSH_CACHE and !ordered) or !ring_submit(r))
+    pool_submit(r);
+}
+
+// EOF
@@ -20,8 +20,39 @@
 
 #include <pthread.h>
 
-// Serialize access for devices. Currently also used to serialize
-// everything else.
+// Serialize access for devices. Busses take it recursively, the
+// instruction emulators of the vCPUs run without it.
 extern pthread_mutex_t irq_mtx;
 
+class Motherboard;
+class PacketRing;
+struct MessageDisk;
+struct MessageNetwork;
+
+// Asynchronous disk I/O. Requests complete in the background by
+// sending MessageDiskCommit. Guest addresses are relative to base.
+bool disk_io_init(Motherboard &mb);
+void disk_io_submit(int fd, char *base, MessageDisk &msg);
+
+// Network backend with one thread per TAP queue. Received packets are
+// sent on bus_network in bursts, or go into the rings of NIC models
+// that attached one.
+bool net_io_init(Motherboard &mb, const char *tap, unsigned queues);
+void net_io_attach(PacketRing *ring);
+bool net_io_start();
+void net_io_stop();
+bool net_io_send(MessageNetwork &msg);
+void net_io_print_stats();
+
+// The host TSC frequency in Hz, from CPUID or measured at the first
+// call.
+unsigned long long tsc_frequency();
+
+// Profiling. Every thread has to block SIGUSR1 before it starts, so
+// that the profiling thread gets it. The counters are dumped on a
+// SIGUSR1 or profile_request() to path or, without one, the log.
+void profile_block_signal();
+bool profile_init(Motherboard &mb, const char *path);
+void profile_request();
+
 // EOF
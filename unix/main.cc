@@ -37,6 +37,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <time.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -57,7 +59,9 @@ const char version_str[] =
 
 static char  *ram;
 static size_t ram_size = 128 << 20; // 128 MB
-static int    tap_fd;               // TAP device. If 0, network packets go to /dev/null.
+static char  *tap_name;             // TAP device. If 0, network packets go to /dev/null.
+static unsigned tap_queues = 1;
+static char  *profile_path;         // Profiling output. If 0, it goes to the log.
 
 static const char *pc_ps2[] = {
   // Unix backend
@@ -98,7 +102,7 @@ static timevalue             last_to = ~0ULL;
 static timer_t               timer_id;
 
 
-static Clock                 mb_clock(1000000);   // XXX Use correct frequency
+static Clock                 mb_clock(tsc_frequency());
 static Motherboard           mb(&mb_clock, NULL);
 
 // Multiboot module data
@@ -107,6 +111,7 @@ struct Module {
   char       *memory;
   size_t      size;
   const char *cmdline;
+  int         fd;
 
   static Module from_file(const char *filename, const char *cmdline)
   {
@@ -122,6 +127,7 @@ struct Module {
 
     m.cmdline = cmdline;
     m.size    = info.st_size;
+    m.fd      = fd;
 
     m.memory  = reinterpret_cast<char *>(mmap(NULL, m.size, PROT_READ, MAP_PRIVATE,
                                               fd, 0));
@@ -136,6 +142,22 @@ struct Module {
 
 static std::vector<Module> modules;
 
+/**
+ * Map part of a module copy-on-write into guest memory. This avoids
+ * copying large modules and only costs memory for pages the guest
+ * modifies.
+ */
+static bool map_module(Module &m, char *dst, size_t offset, size_t len)
+{
+  if ((reinterpret_cast<uintptr_t>(dst) | offset) & 0xFFF or
+      offset > m.size or len > m.size - offset or
+      dst < ram or dst + len > ram + ram_size)
+    return false;
+
+  return MAP_FAILED != mmap(dst, len, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE,
+                            m.fd, offset);
+}
+
 // Disk data
 
 struct Disk {
@@ -163,8 +185,29 @@ struct Disk {
 
 static std::vector<Disk> disks;
 
-// Used to serialize all operations (for now).
+// Serializes the device models. The vCPUs only take it when they
+// leave the instruction emulator, so they run in parallel otherwise.
+//
+// This is deliberately one recursive lock and not one per bus or
+// device: a message regularly crosses busses while it is delivered
+// (irqlines -> PIC/IOAPIC -> bus_apic -> Lapic -> bus_apic for IPIs),
+// so independent locks would be taken in both orders and deadlock.
+// The Lapic stays under it for the same reason, as it is reached
+// from other vCPUs and the timer thread and sends IPIs on bus_apic.
+// Cross-CPU wakeups do not need it; they use the VCpu event word.
 pthread_mutex_t irq_mtx;
+static __thread unsigned irq_mtx_depth;
+
+static void device_lock(void *, bool acquire)
+{
+  if (acquire) {
+    pthread_mutex_lock(&irq_mtx);
+    irq_mtx_depth++;
+  } else {
+    irq_mtx_depth--;
+    pthread_mutex_unlock(&irq_mtx);
+  }
+}
 
 static void skip_instruction(CpuMessage &msg)
 {
@@ -188,17 +231,27 @@ static void handle_vcpu(bool skip, CpuMessage::Type type, VCpu *vcpu, CpuState *
   CpuMessage msg(type, static_cast<CpuState *>(utcb), utcb->mtd);
   msg.mtr_in = ~0U;
   if (skip) skip_instruction(msg);
+  vcpu->stats.exits[type]++;
 
   /**
-   * Send the message to the VCpu.
+   * Send the message to the VCpu.  Only the instruction emulator runs
+   * without the device lock.
    */
+  bool step = type == CpuMessage::TYPE_SINGLE_STEP;
+  if (!step) device_lock(nullptr, true);
   if (!vcpu->executor.send(msg, true))
     Logging::panic("nobody to execute %s at %x:%x\n", __func__, msg.cpu->cs.sel, msg.cpu->eip);
+  if (step) device_lock(nullptr, true);
 
   /**
-   * Check whether we should inject something...
+   * Check whether we should inject something.  This is only needed
+   * if an event is pending that the CPU could take now.  Events that
+   * arrive later stop the emulator at the next instruction boundary,
+   * so that we get here again.
    */
-  if (msg.mtr_in & MTD_INJ && msg.type != CpuMessage::TYPE_CHECK_IRQ) {
+  bool irq_window = msg.cpu->efl & 0x200 && !(msg.cpu->intr_state & 3);
+  if (msg.mtr_in & MTD_INJ && msg.type != CpuMessage::TYPE_CHECK_IRQ
+      && (vcpu->event_pending(irq_window) || msg.cpu->actv_state & 3)) {
     msg.type = CpuMessage::TYPE_CHECK_IRQ;
     if (!vcpu->executor.send(msg, true))
       Logging::panic("nobody to execute %s at %x:%x\n", __func__, msg.cpu->cs.sel, msg.cpu->eip);
@@ -208,14 +261,14 @@ static void handle_vcpu(bool skip, CpuMessage::Type type, VCpu *vcpu, CpuState *
    * If the IRQ injection is performed, recalc the IRQ window.
    */
   if (msg.mtr_out & MTD_INJ) {
-    vcpu->inj_count ++;
+    vcpu->stats.injections++;
 
     msg.type = CpuMessage::TYPE_CALC_IRQWINDOW;
     if (!vcpu->executor.send(msg, true))
       Logging::panic("nobody to execute %s at %x:%x\n", __func__, msg.cpu->cs.sel, msg.cpu->eip);
   }
   msg.cpu->mtd = msg.mtr_out;
-
+  device_lock(nullptr, false);
 }
 
 
@@ -225,15 +278,14 @@ static void *vcpu_thread_fn(void *arg)
   CpuState cpu_state;
   memset(&cpu_state, 0, sizeof(cpu_state));
 
-  pthread_mutex_lock(&irq_mtx);
-  handle_vcpu(false, CpuMessage::TYPE_HLT, vcpu, &cpu_state);
-  pthread_mutex_unlock(&irq_mtx);
+  // Wait until the machine is completely set up.
+  device_lock(nullptr, true);
+  device_lock(nullptr, false);
 
+  handle_vcpu(false, CpuMessage::TYPE_HLT, vcpu, &cpu_state);
   while (true) {
-    pthread_mutex_lock(&irq_mtx);
     handle_vcpu(false, CpuMessage::TYPE_SINGLE_STEP, vcpu, &cpu_state);
     // Logging::printf("eip %x\n", cpu_state.eip);
-    pthread_mutex_unlock(&irq_mtx);
   }
 
   // NOTREACHED
@@ -282,11 +334,14 @@ static bool receive(Device *, MessageHostOp &msg)
 
       break;
     }
-    case MessageHostOp::OP_VCPU_BLOCK:
-      pthread_mutex_unlock(&irq_mtx);
+    case MessageHostOp::OP_VCPU_BLOCK: {
+      // Drop the device lock completely while we sleep.
+      unsigned depth = irq_mtx_depth;
+      for (unsigned i = 0; i < depth; i++) device_lock(nullptr, false);
       sem_wait(&vcpu_info[msg.value].block);
-      pthread_mutex_lock(&irq_mtx);
+      for (unsigned i = 0; i < depth; i++) device_lock(nullptr, true);
       break;
+    }
     case MessageHostOp::OP_VCPU_RELEASE:
       sem_post(&vcpu_info[msg.value].block);
       break;
@@ -296,7 +351,8 @@ static bool receive(Device *, MessageHostOp &msg)
 
       if (msg.module < modules.size() and
           msg.size   > modules[msg.module].size) {
-        memcpy(msg.start, modules[msg.module].memory, modules[msg.module].size);
+        if (!map_module(modules[msg.module], msg.start, 0, modules[msg.module].size))
+          memcpy(msg.start, modules[msg.module].memory, modules[msg.module].size);
 
         // Align the end of the module to get the cmdline on a new page.
         uintptr_t s = reinterpret_cast<uintptr_t>(msg.start) + modules[msg.module].size;
@@ -310,6 +366,24 @@ static bool receive(Device *, MessageHostOp &msg)
       } else
         res = false;
       break;
+    case MessageHostOp::OP_MAP_MODULE:
+      msg.module --;
+      res = msg.module < modules.size() and
+        map_module(modules[msg.module], msg.start, msg.offset, msg.size);
+      break;
+    case MessageHostOp::OP_GUEST_MEM_TRACKED:
+    case MessageHostOp::OP_VCPU_EMULATED:
+      // The guest runs only in the instruction emulator.
+      break;
+    case MessageHostOp::OP_ALLOC_CODE:
+      // Executable memory for translated guest code.
+      msg.ptr = reinterpret_cast<char *>(mmap(NULL, msg.len, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (msg.ptr == MAP_FAILED) {
+        msg.ptr = NULL;
+        res = false;
+      }
+      break;
     case MessageHostOp::OP_GET_MAC: {
       static unsigned long long mac_prefix = 0x42000000;
       static unsigned long long mac_host   = random();
@@ -373,10 +447,10 @@ static void timeout_request()
 
 static void timeout_handler_fn(union sigval)
 {
-  pthread_mutex_lock(&irq_mtx);
+  device_lock(nullptr, true);
   timeout_trigger();
   timeout_request();
-  pthread_mutex_unlock(&irq_mtx);
+  device_lock(nullptr, false);
 }
 
 static bool receive(Device *, MessageTimer &msg)
@@ -409,45 +483,14 @@ static bool receive(Device *, MessageTime &msg)
 
 // Network support
 
-static unsigned char network_pbuf[2048];
-
-static void *network_io_thread_fn(void *)
-{
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(tap_fd, &set);
-
-  while (true) {
-    fd_set rset = set;
-    if (0 > select(tap_fd + 1, &rset, nullptr, nullptr, nullptr)) {
-      perror("select");
-      break;
-    }
-
-    int  res = read(tap_fd, network_pbuf, sizeof(network_pbuf));
-    if (res <= 0) break;
-    printf("tap: read %u bytes.\n", res);
-    MessageNetwork msg(network_pbuf, res, 0);
-
-    pthread_mutex_lock(&irq_mtx);
-    mb.bus_network.send(msg);
-    pthread_mutex_unlock(&irq_mtx);
-  }
-
-  return nullptr;
-}
-
 static bool receive(Device *, MessageNetwork &msg)
 {
-  int res;
-
   switch (msg.type) {
   case MessageNetwork::PACKET:
-    Logging::printf("packet %zu bytes\n", msg.len);
-    if (tap_fd and msg.buffer != network_pbuf) {
-      res = write(tap_fd, msg.buffer, msg.len);
-      if (res != static_cast<int>(msg.len)) perror("write to tap");
-    }
+    net_io_send(msg);
+    return true;
+  case MessageNetwork::RING_ATTACH:
+    net_io_attach(msg.ring);
     return true;
   case MessageNetwork::QUERY_MAC:
   default:
@@ -470,31 +513,23 @@ static bool receive(Device *, MessageDisk &msg)
     for (unsigned i=0; i < msg.dmacount; i++) {
       size_t  start = offset;
       size_t  end   = start + msg.dma[i].bytecount;
-      ssize_t bytes;
 
-      if (end > disk.size or start > disk.size or
+      if (end > disk.size or start > disk.size or i >= IOV_MAX or
           msg.dma[i].byteoffset > msg.physsize or
-          msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize) {
+          msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize or
+          msg.dma[i].byteoffset + msg.dma[i].bytecount > ram_size) {
         status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
                                      (i << MessageDisk::DISK_STATUS_SHIFT));
         break;
       }
-
-      // XXX Workaround, use hostop GUEST_MEM.
-      msg.physoffset = reinterpret_cast<uintptr_t>(ram);
-
-      typedef int (*RWFn)(int,void *,size_t,off_t);
-      bytes = ((msg.type == MessageDisk::DISK_READ) ? (RWFn)pread : (RWFn)pwrite)
-        (disk.fd, reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset),
-         end - start, start);
-
-      if (bytes < ssize_t(end - start)) {
-        Logging::printf("short read/write: %zd instead of %zd\n", bytes, end - start);
-      }
-
-      offset += end - start;
+      offset = end;
     }
-    break;
+    if (status != MessageDisk::DISK_OK) break;
+
+    // The whole request goes to the disk at once and is committed
+    // later from the I/O thread.
+    disk_io_submit(disk.fd, ram, msg);
+    return true;
   case MessageDisk::DISK_GET_PARAMS:
     {
       msg.params->flags = DiskParameter::FLAG_HARDDISK;
@@ -505,7 +540,8 @@ static bool receive(Device *, MessageDisk &msg)
       return true;
     }
   case MessageDisk::DISK_FLUSH_CACHE:
-    break;
+    disk_io_submit(disk.fd, ram, msg);
+    return true;
   default:
     assert(0);
   }
@@ -518,7 +554,7 @@ static bool receive(Device *, MessageDisk &msg)
 
 static void usage()
 {
-  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [-d disk-image]\n"
+  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device[:queues]] [-d disk-image] [-p profile-file]\n"
                   "             [kernel parameters] [module1 parameters] ...\n");
   exit(EXIT_FAILURE);
 }
@@ -528,6 +564,7 @@ int main(int argc, char **argv)
   printf("Seoul %s booting.\n"
          "Visit https://github.com/TUD-OS/seoul for information.\n\n",
          version_str);
+  printf("TSC frequency %llu kHz.\n", mb_clock.freq() / 1000);
 
   if (argc < 2) {
     fprintf(stderr, "No parameters given.\n");
@@ -535,21 +572,26 @@ int main(int argc, char **argv)
   }
 
   int ch;
-  while ((ch = getopt(argc, argv, "hm:n:d:")) != -1) {
+  while ((ch = getopt(argc, argv, "hm:n:d:p:")) != -1) {
     switch (ch) {
     case 'm':
       ram_size = atoi(optarg) << 20;
       break;
-    case 'n':
-      tap_fd = open(optarg, O_RDWR);
-      if (tap_fd < 0) {
-        perror("open tap device");
-        return EXIT_FAILURE;
+    case 'n': {
+      tap_name = optarg;
+      char *queues = strrchr(optarg, ':');
+      if (queues) {
+        *queues = 0;
+        tap_queues = atoi(queues + 1);
       }
+    }
       break;
     case 'd':
       disks.push_back(Disk::from_file(optarg));
       break;
+    case 'p':
+      profile_path = optarg;
+      break;
     case 'h':
     case '?':
     default:
@@ -576,6 +618,9 @@ int main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  // All threads we create inherit this.
+  profile_block_signal();
+
   // Creating timer. I hate C++: No useful initializers...
   struct sigevent ev;
   ev.sigev_notify            = SIGEV_THREAD;
@@ -595,12 +640,16 @@ int main(int argc, char **argv)
   mb.bus_network.add(nullptr, receive);
   mb.bus_disk   .add(nullptr, receive);
 
-  // Synchronization initialization
-  if (0 != pthread_mutex_init(&irq_mtx, nullptr)) {
+  // Synchronization initialization. The device lock is taken
+  // recursively by every bus a message passes.
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  if (0 != pthread_mutex_init(&irq_mtx, &attr)) {
     perror("pthread_mutex_init");
     return EXIT_FAILURE;
   }
-  pthread_mutex_lock(&irq_mtx);
+  device_lock(nullptr, true);
 
   // Create standard PC
   for (const char **dev = pc_ps2; *dev != NULL; dev++) {
@@ -610,6 +659,11 @@ int main(int argc, char **argv)
   Logging::printf("Devices and %zu virtual CPU%s started successfully.\n",
                   vcpu_info.size(), vcpu_info.size() == 1 ? "" : "s");
 
+  // Devices are shared between the vCPU and the background threads.
+  mb.set_lock(nullptr, device_lock);
+  for (VCpu *vcpu = mb.last_vcpu; vcpu; vcpu=vcpu->get_last())
+    vcpu->set_lock(nullptr, device_lock);
+
   // init VCPUs
   for (VCpu *vcpu = mb.last_vcpu; vcpu; vcpu=vcpu->get_last()) {
     Logging::printf("Initializing virtual CPU %p.\n", vcpu);
@@ -635,29 +689,29 @@ int main(int argc, char **argv)
   MessageLegacy msg2(MessageLegacy::RESET, 0);
   mb.bus_legacy.send_fifo(msg2);
 
-  pthread_t iothread;
-  if (tap_fd) {
+  if (!disks.empty() and !disk_io_init(mb))
+    return EXIT_FAILURE;
+
+  if (tap_name) {
     Logging::printf("Starting background threads.\n");
-    if (0 != pthread_create(&iothread, NULL, network_io_thread_fn, NULL)) {
-      perror("pthread_create");
+    if (!net_io_init(mb, tap_name, tap_queues) or !net_io_start())
       return EXIT_FAILURE;
-    }
-    pthread_setname_np(iothread, "io");
   }
 
+  if (!profile_init(mb, profile_path))
+    return EXIT_FAILURE;
+
   Logging::printf("Virtual CPUs starting.\n");
-  pthread_mutex_unlock(&irq_mtx);
+  device_lock(nullptr, false);
 
   // Waiting for CPUs to exit.
   for (Vcpu_info &i : vcpu_info)
     if (0 != pthread_join(i.tid, nullptr))
       perror("pthread_join");
 
-  // Force IO thread to exit.
-  if (tap_fd) {
-    close(tap_fd);
-    pthread_join(iothread, nullptr);
-  }
+  // Force IO threads to exit.
+  if (tap_name)
+    net_io_stop();
 
   printf("Terminating.\n");
   return EXIT_SUCCESS;
@@ -122,18 +122,22 @@ class NcursesDisplay : public StaticReceiver<NcursesDisplay> {
         goto done;
       case KEY_HOME: {
         MessageConsole msg(MessageConsole::TYPE_RESET);
-        pthread_mutex_lock(&irq_mtx);
         mb.bus_console.send(msg);
-        pthread_mutex_unlock(&irq_mtx);
       }
         break;
 
+      case 'n':
+        net_io_print_stats();
+        break;
+
+      case 'p':
+        profile_request();
+        break;
+
       case KEY_F(12): {
-        pthread_mutex_lock(&irq_mtx);
         CpuEvent msg(VCpu::EVENT_DEBUG);
         for (VCpu *vcpu = mb.last_vcpu; vcpu; vcpu=vcpu->get_last())
           vcpu->bus_event.send(msg);
-        pthread_mutex_unlock(&irq_mtx);
       }
         break;
 
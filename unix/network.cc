@@ -0,0 +1,373 @@
+/**
+ * UNIX Seoul frontend - network backend
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Every queue of the TAP device has its own thread. It drains up to
+ * BATCH packets into its ring of preallocated buffers and hands them
+ * to the NIC models as one burst, so the device lock is taken once
+ * per burst and the models raise one interrupt for it. After a burst
+ * the thread keeps polling for POLL_NS before it sleeps again, which
+ * hides the wakeup latency when packets keep coming.
+ *
+ * NIC models that attach a PacketRing get their packets through it
+ * instead. The packets are read into the buffers of the queue and
+ * then copied into every ring, which takes only as much space as the
+ * packet needs. The device lock is only taken to notify a model that
+ * went idle. Every queue thread is a producer, so they take turns on
+ * a ring, but never hold it while reading from the TAP device.
+ *
+ * A TAP interface name opens one or more queues of a multi-queue TAP
+ * device via /dev/net/tun. A path, e.g. of a macvtap device, is
+ * opened as a single queue.
+ */
+
+#include <nul/motherboard.h>
+#include <service/packetring.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include <pthread.h>
+
+#include <seoul/unix.h>
+
+enum {
+  MAX_QUEUES  = 16,
+  MAX_RINGS   = 8,
+  BATCH       = 32,
+  RING        = 2 * BATCH,
+  BUFFER_SIZE = 16384,
+  POLL_NS     = 50000,
+};
+
+struct NetCounter {
+  unsigned long long packets;
+  unsigned long long bytes;
+
+  void add(unsigned long long p, unsigned long long b)
+  {
+    Cpu::atomic_xadd(&packets, p);
+    Cpu::atomic_xadd(&bytes, b);
+  }
+};
+
+struct NetQueue {
+  int            fd;
+  pthread_t      tid;
+  unsigned char *ring;          // RING buffers of BUFFER_SIZE
+  unsigned       head;
+  NetCounter     rx;
+  NetCounter     tx;
+};
+
+static Motherboard   *net_mb;
+static NetQueue       net_queues[MAX_QUEUES];
+static unsigned       net_queue_count;
+static unsigned char *net_buffers;
+static unsigned       net_next_tx_queue;
+
+struct NetRing {
+  PacketRing     *ring;
+  pthread_mutex_t producer;
+};
+
+static NetRing        net_rings[MAX_RINGS];
+static unsigned       net_ring_count;
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int tap_open_queue(const char *name, bool multi_queue)
+{
+  int fd = open("/dev/net/tun", O_RDWR);
+  if (fd < 0) {
+    perror("open /dev/net/tun");
+    return -1;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+#ifdef IFF_MULTI_QUEUE
+  if (multi_queue) ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#endif
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  if (0 > ioctl(fd, TUNSETIFF, &ifr)) {
+    perror("TUNSETIFF");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Deliver a burst of packets. The models see the "more" hint on all
+ * but the last one.
+ */
+static void net_deliver(NetQueue &q, unsigned first, const size_t *len, unsigned count)
+{
+  unsigned long long bytes = 0;
+
+  // Nobody may cancel us while we hold the device lock.
+  int state;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+  pthread_mutex_lock(&irq_mtx);
+  for (unsigned i = 0; i < count; i++) {
+    MessageNetwork msg(q.ring + ((first + i) % RING) * BUFFER_SIZE, len[i], 0);
+    msg.more = i + 1 < count;
+    net_mb->bus_network.send(msg);
+    bytes += len[i];
+  }
+  pthread_mutex_unlock(&irq_mtx);
+  pthread_setcancelstate(state, nullptr);
+
+  q.rx.add(count, bytes);
+}
+
+/**
+ * Read a burst of packets and copy them into the attached rings.
+ */
+static unsigned net_read_rings(NetQueue &q)
+{
+  size_t len[BATCH];
+  unsigned count = 0;
+  unsigned long long bytes = 0;
+
+  while (count < BATCH) {
+    ssize_t res = read(q.fd, q.ring + count * BUFFER_SIZE, BUFFER_SIZE);
+    if (res <= 0) break;
+    len[count++] = res;
+    bytes += res;
+  }
+  if (!count) return 0;
+
+  for (unsigned i = 0; i < net_ring_count; i++) {
+    pthread_mutex_lock(&net_rings[i].producer);
+    // A full ring drops the packet, like a real link would.
+    for (unsigned j = 0; j < count; j++)
+      net_rings[i].ring->produce(q.ring + j * BUFFER_SIZE, len[j]);
+    bool wakeup = net_rings[i].ring->produce_flush();
+    pthread_mutex_unlock(&net_rings[i].producer);
+    if (!wakeup) continue;
+
+    int state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&irq_mtx);
+    MessageNetwork msg(MessageNetwork::RING_NOTIFY, 0);
+    msg.ring = net_rings[i].ring;
+    net_mb->bus_network.send(msg);
+    pthread_mutex_unlock(&irq_mtx);
+    pthread_setcancelstate(state, nullptr);
+  }
+
+  q.rx.add(count, bytes);
+  return count;
+}
+
+static void *net_rx_thread_fn(void *arg)
+{
+  NetQueue &q = *static_cast<NetQueue *>(arg);
+  unsigned long long last_packet = 0;
+  size_t len[BATCH];
+
+  while (true) {
+    unsigned count = 0;
+    if (net_ring_count) {
+      errno = 0;
+      count = net_read_rings(q);
+      if (!count and errno != EAGAIN and errno != EINTR) {
+        perror("read from tap");
+        return nullptr;
+      }
+    } else while (count < BATCH) {
+      ssize_t res = read(q.fd, q.ring + ((q.head + count) % RING) * BUFFER_SIZE, BUFFER_SIZE);
+      if (res < 0 and (errno == EAGAIN or errno == EINTR)) break;
+      if (res <= 0) {
+        if (res < 0) perror("read from tap");
+        return nullptr;
+      }
+      len[count++] = res;
+    }
+
+    if (count) {
+      if (!net_ring_count) {
+        net_deliver(q, q.head, len, count);
+        q.head = (q.head + count) % RING;
+      }
+      last_packet = now_ns();
+      continue;
+    }
+
+    // Nothing to do. Poll for a while before we sleep.
+    if (now_ns() - last_packet < POLL_NS) {
+      Cpu::pause();
+      continue;
+    }
+
+    struct pollfd pfd = { q.fd, POLLIN, 0 };
+    if (0 > poll(&pfd, 1, -1) and errno != EINTR) {
+      perror("poll");
+      return nullptr;
+    }
+  }
+}
+
+bool net_io_init(Motherboard &mb, const char *tap, unsigned queues)
+{
+  net_mb = &mb;
+  if (queues == 0) queues = 1;
+  if (queues > MAX_QUEUES) {
+    fprintf(stderr, "At most %u network queues are supported.\n", MAX_QUEUES);
+    return false;
+  }
+
+  bool is_path = strchr(tap, '/');
+  if (is_path and queues > 1) {
+    fprintf(stderr, "%s: multiple queues need a TAP interface name.\n", tap);
+    return false;
+  }
+
+  for (unsigned i = 0; i < queues; i++) {
+    int fd = is_path ? open(tap, O_RDWR) : tap_open_queue(tap, queues > 1);
+    if (fd < 0) {
+      if (is_path) perror("open tap device");
+      return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    net_queues[i].fd = fd;
+  }
+
+  net_buffers = new unsigned char[queues * RING * BUFFER_SIZE];
+  for (unsigned i = 0; i < queues; i++)
+    net_queues[i].ring = net_buffers + i * RING * BUFFER_SIZE;
+  net_queue_count = queues;
+  return true;
+}
+
+void net_io_attach(PacketRing *ring)
+{
+  if (net_ring_count == MAX_RINGS)
+    Logging::panic("Too many network rings.");
+  net_rings[net_ring_count].ring = ring;
+  pthread_mutex_init(&net_rings[net_ring_count].producer, nullptr);
+  net_ring_count++;
+}
+
+bool net_io_start()
+{
+  for (unsigned i = 0; i < net_queue_count; i++) {
+    if (0 != pthread_create(&net_queues[i].tid, nullptr, net_rx_thread_fn, net_queues + i)) {
+      perror("pthread_create");
+      return false;
+    }
+    pthread_setname_np(net_queues[i].tid, "net");
+  }
+  return true;
+}
+
+void net_io_stop()
+{
+  for (unsigned i = 0; i < net_queue_count; i++) {
+    pthread_cancel(net_queues[i].tid);
+    pthread_join(net_queues[i].tid, nullptr);
+    close(net_queues[i].fd);
+  }
+  net_queue_count = 0;
+}
+
+bool net_io_send(MessageNetwork &msg)
+{
+  if (!net_queue_count) return false;
+
+  // Don't send our own packets back.
+  if (msg.buffer >= net_buffers and msg.buffer < net_buffers + net_queue_count * RING * BUFFER_SIZE)
+    return false;
+
+  // Every sending thread sticks to one queue, so its packets stay in
+  // order.
+  static __thread unsigned tx_queue = ~0U;
+  if (tx_queue == ~0U)
+    tx_queue = Cpu::atomic_xadd(&net_next_tx_queue, 1U);
+  NetQueue &q = net_queues[tx_queue % net_queue_count];
+
+  // The tap device takes one packet per writev.
+  struct iovec iov[MessageNetwork::MAX_FRAGMENTS + 1];
+  unsigned count = 1;
+  if (msg.fragcount) {
+    count = msg.fragcount < sizeof(iov)/sizeof(*iov) ? msg.fragcount : sizeof(iov)/sizeof(*iov);
+    for (unsigned i = 0; i < count; i++) {
+      iov[i].iov_base = const_cast<unsigned char *>(msg.fragments[i].buffer);
+      iov[i].iov_len  = msg.fragments[i].len;
+    }
+  } else {
+    iov[0].iov_base = const_cast<unsigned char *>(msg.buffer);
+    iov[0].iov_len  = msg.len;
+  }
+
+  ssize_t res = writev(q.fd, iov, count);
+  if (res != static_cast<ssize_t>(msg.len)) {
+    // A full queue drops the packet, like a real link would.
+    if (res >= 0 or errno != EAGAIN) perror("write to tap");
+    return false;
+  }
+  q.tx.add(1, msg.len);
+  return true;
+}
+
+void net_io_print_stats()
+{
+  static unsigned long long last_time;
+  static NetCounter         last_rx, last_tx;
+
+  NetCounter rx = { 0, 0 }, tx = { 0, 0 };
+  for (unsigned i = 0; i < net_queue_count; i++) {
+    rx.packets += net_queues[i].rx.packets;
+    rx.bytes   += net_queues[i].rx.bytes;
+    tx.packets += net_queues[i].tx.packets;
+    tx.bytes   += net_queues[i].tx.bytes;
+  }
+
+  unsigned long long now = now_ns();
+  double secs = last_time ? (now - last_time) / 1e9 : 0;
+  if (secs > 0)
+    Logging::printf("net: %u queue%s, RX %.0f pps %.3f Gbps, TX %.0f pps %.3f Gbps\n",
+                    net_queue_count, net_queue_count == 1 ? "" : "s",
+                    (rx.packets - last_rx.packets) / secs, (rx.bytes - last_rx.bytes) * 8 / secs / 1e9,
+                    (tx.packets - last_tx.packets) / secs, (tx.bytes - last_tx.bytes) * 8 / secs / 1e9);
+  Logging::printf("net: RX %llu packets %llu bytes, TX %llu packets %llu bytes\n",
+                  rx.packets, rx.bytes, tx.packets, tx.bytes);
+
+  last_time = now;
+  last_rx   = rx;
+  last_tx   = tx;
+}
+
+// EOF
@@ -0,0 +1,131 @@
+/**
+ * UNIX Seoul frontend - profiling output
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * The busses and vCPUs count all the time. A SIGUSR1 makes the
+ * profiling thread dump the counters, with the change since the last
+ * dump in the diff columns. The output is appended to a file, which
+ * may also be a FIFO, or goes to the log.
+ *
+ * The counters are read without the device lock, so a dump does not
+ * disturb the VM, but a counter may be off by one message.
+ */
+
+#include <nul/motherboard.h>
+#include <nul/vcpu.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <seoul/unix.h>
+
+static Motherboard *profile_mb;
+static const char  *profile_path;
+static pthread_t    profile_tid;
+
+static void profile_file_printf(void *data, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(static_cast<FILE *>(data), format, ap);
+  va_end(ap);
+}
+
+static void profile_log_printf(void *, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  Logging::vprintf(format, ap);
+  va_end(ap);
+}
+
+static void profile_dump(ProfileFunction out, void *data)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  out(data, "VMSTAT %lu.%03lu\n", ts.tv_sec, ts.tv_nsec / 1000000);
+
+  profile_mb->dump_profile(false, out, data);
+
+  char name[16];
+  unsigned nr = 0;
+  for (VCpu *vcpu = profile_mb->last_vcpu; vcpu; vcpu = vcpu->get_last()) {
+    snprintf(name, sizeof(name), "vcpu%u", nr++);
+    vcpu->profile_dump(name, out, data);
+  }
+}
+
+static void *profile_thread_fn(void *)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  while (true) {
+    int sig;
+    if (0 != sigwait(&set, &sig)) continue;
+
+    if (!profile_path) {
+      profile_dump(profile_log_printf, nullptr);
+      continue;
+    }
+
+    // Open the file for every dump, so that a FIFO can get a new reader.
+    FILE *f = fopen(profile_path, "a");
+    if (!f) {
+      perror(profile_path);
+      continue;
+    }
+    profile_dump(profile_file_printf, f);
+    fclose(f);
+  }
+  return nullptr;
+}
+
+void profile_block_signal()
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+bool profile_init(Motherboard &mb, const char *path)
+{
+  profile_mb   = &mb;
+  profile_path = path;
+
+  if (0 != pthread_create(&profile_tid, nullptr, profile_thread_fn, nullptr)) {
+    perror("pthread_create");
+    return false;
+  }
+  pthread_setname_np(profile_tid, "profile");
+  return true;
+}
+
+void profile_request()
+{
+  kill(getpid(), SIGUSR1);
+}
+
+// EOF
@@ -0,0 +1,138 @@
+/**
+ * Burst forwarding test
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+/**
+ * Sends MessageMem bursts through a VCPU memory bus whose forwarder
+ * passes them on to the motherboard like the VirtualCpu does.  The
+ * receivers stand in for those of the unix frontend: the LAPIC and
+ * the RAM take bursts they fully cover, the IOAPIC only handles
+ * single dwords.
+ *
+ * A burst the IOAPIC claims only partially has to be split exactly
+ * once, so that no piece reaches a device twice.
+ *
+ * Usage: bustest
+ */
+
+#include <nul/bus.h>
+#include <nul/message.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+void Logging::panic(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  abort();
+}
+
+void Logging::printf(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+}
+
+void Logging::vprintf(const char *format, va_list &ap)
+{
+  vfprintf(stderr, format, ap);
+}
+
+enum {
+  RAM_SIZE    = 0x1000,
+  IOAPIC_BASE = 0xfec00000,
+  IOAPIC_EOI  = IOAPIC_BASE + 0x40,
+  LAPIC_BASE  = 0xfee00000,
+};
+
+static DBus<MessageMem> mem;
+static unsigned ram_bursts, ram_pieces, ioapic_eois, ioapic_others;
+
+static bool ram(Device *, MessageMem &msg)
+{
+  if (!msg.covered(0, RAM_SIZE)) return false;
+  if (msg.count > 1) ram_bursts++; else ram_pieces++;
+  return true;
+}
+
+static bool ioapic(Device *, MessageMem &msg)
+{
+  if (msg.count != 1) Logging::panic("IOAPIC got a burst of %u\n", msg.count);
+  if (msg.phys == IOAPIC_EOI) ioapic_eois++;
+  else if (msg.phys == IOAPIC_BASE) ioapic_others++;
+  else return false;
+  return true;
+}
+
+static bool lapic(Device *, MessageMem &msg)
+{
+  return msg.covered(LAPIC_BASE, 0x1000);
+}
+
+static bool forward(Device *, MessageMem &msg)
+{
+  return mem.send_unsplit(msg, true);
+}
+
+static int failures;
+
+static void check(const char *name, bool res, bool expected, unsigned eois, unsigned bursts, unsigned pieces)
+{
+  if (res == expected && ioapic_eois == eois && !ioapic_others && ram_bursts == bursts && ram_pieces == pieces) {
+    printf("%-20s ok\n", name);
+  } else {
+    printf("%-20s FAILED: result %u, %u EOIs, %u other IOAPIC writes, %u RAM bursts, %u RAM pieces\n",
+           name, res, ioapic_eois, ioapic_others, ram_bursts, ram_pieces);
+    failures++;
+  }
+  ram_bursts = ram_pieces = ioapic_eois = ioapic_others = 0;
+}
+
+int main()
+{
+  // In the order the unix frontend creates them.
+  mem.add(nullptr, ram, true);
+  mem.add(nullptr, ioapic);
+
+  DBus<MessageMem> vcpu;
+  vcpu.add(nullptr, forward, true);
+  vcpu.add(nullptr, lapic, true);
+
+  unsigned data[2] = { 0, 0 };
+
+  // A 64-bit write to the EOI register, whose upper half nobody takes.
+  MessageMem partial(false, IOAPIC_EOI, data, 2);
+  check("partially claimed", vcpu.send(partial, true), false, 1, 0, 0);
+
+  MessageMem ram_burst(false, 0x100, data, 2);
+  check("RAM burst", vcpu.send(ram_burst, true), true, 0, 1, 0);
+
+  // Crosses the end of the RAM, thus only the first piece is taken.
+  MessageMem ram_end(false, RAM_SIZE - 4, data, 2);
+  check("RAM end", vcpu.send(ram_end, true), false, 0, 0, 1);
+
+  MessageMem single(false, IOAPIC_EOI, data);
+  check("single", vcpu.send(single, true), true, 1, 0, 0);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/**
+ * UNIX Seoul frontend - TSC frequency
+ *
+ * Copyright (C) 2012, Julian Stecklina <jsteckli@os.inf.tu-dresden.de>
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <nul/timer.h>
+
+#include <time.h>
+
+#include <seoul/unix.h>
+
+/**
+ * The frequency from CPUID leaf 0x15 (TSC to crystal ratio) or,
+ * without a crystal frequency, leaf 0x16 (base frequency in MHz).
+ * Returns 0 if the CPU does not tell.
+ */
+static timevalue tsc_cpuid_frequency()
+{
+  unsigned ebx = 0, ecx = 0, edx = 0;
+  unsigned max = Cpu::cpuid(0, ebx, ecx, edx);
+  if (max < 0x15) return 0;
+
+  ebx = ecx = edx = 0;
+  unsigned denominator = Cpu::cpuid(0x15, ebx, ecx, edx);
+  if (denominator && ebx && ecx)
+    return static_cast<timevalue>(ecx) * ebx / denominator;
+
+  if (max < 0x16) return 0;
+  ebx = ecx = edx = 0;
+  return static_cast<timevalue>(Cpu::cpuid(0x16, ebx, ecx, edx) & 0xffff) * 1000000;
+}
+
+static timevalue tsc_monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Measure the TSC against the monotonic clock.  The clock reads are
+ * bracketed by TSC reads and we keep the round where the brackets
+ * were the tightest, as it was disturbed the least.
+ */
+static timevalue tsc_calibrate()
+{
+  enum {
+    ROUNDS   = 5,
+    INTERVAL = 10000000,        // ns per round
+  };
+
+  timevalue best = 0, best_err = ~0ULL;
+  for (unsigned i=0; i < ROUNDS; i++) {
+    timevalue t0  = Cpu::rdtsc();
+    timevalue ns0 = tsc_monotonic_ns();
+    timevalue t1  = Cpu::rdtsc();
+
+    timevalue t2, ns1, t3;
+    do {
+      t2  = Cpu::rdtsc();
+      ns1 = tsc_monotonic_ns();
+      t3  = Cpu::rdtsc();
+    } while (ns1 - ns0 < INTERVAL);
+
+    timevalue err = (t1 - t0) + (t3 - t2);
+    if (err >= best_err) continue;
+    best_err = err;
+    best = Math::muldiv128((t2 + t3) / 2 - (t0 + t1) / 2, 1000000000ULL, ns1 - ns0);
+  }
+  return best;
+}
+
+timevalue tsc_frequency()
+{
+  static timevalue freq;
+  if (!freq) freq = tsc_cpuid_frequency();
+  if (!freq) freq = tsc_calibrate();
+  return freq;
+}
+
+// EOF